@@ -1,19 +1,39 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <wchar.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "hidapi.h"
 #include "mcp2221.h"
+#include "mcp2221.hpp"
+#include "mcp2221_async.h"
+#include "mcp2221_hotplug.h"
+#include "mcp2221_metrics.h"
+#include "mcp2221_private.h"
+#include "mcp2221_trace.h"
 
-#define ENABLE_DEBUG
+#define READ_TIMEOUT_MS (1000)
 
-#ifdef ENABLE_DEBUG
-#define PRINT_DEBUG(x, ...) printf(x, __VA_ARGS__) 
-#else
-#define PRINT_DEBUG(x, ...) {}
-#endif
+// bound of a drain, the device queues only a few reports
+#define RESPONSE_DRAIN_MAX (16)
 
-#define READ_TIMEOUT_MS (1000)
+// deadline of the operation budget of the thread, 0 : none
+static thread_local uint64_t budget_deadline_us = 0;
+
+// handle whose queued gpio writes this thread is sending, its own report must not flush again
+static thread_local MCP2221Handle *gpio_flushing = NULL;
 
 // ----- helper api -----
 static int mcp2221_validate_gpio_setting(GPIOSetting *setting) {
@@ -26,500 +46,1972 @@ static int mcp2221_validate_gpio_setting(GPIOSetting *setting) {
 	if (setting->enable_direction < 0 || 1 < setting->enable_direction) {
 		return STATUS_ARGUMENT_ERROR;
 	}
-	if (setting->direction < 0 || GPIO_DIR_MAX <= setting->direction) {
-		return STATUS_ARGUMENT_ERROR;
+	if (setting->direction < 0 || GPIO_DIR_MAX <= setting->direction) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+// Check the response of Set GPIO Output Values.
+// The altered ports echo the command, the others report 0xEE.
+// A field is checked only if at least one port alters it.
+static int mcp2221_check_gpio_output_echo(uint8_t cmd[64], uint8_t buf[64], int value_mask, int direction_mask) {
+	typedef mcp2221::layout::SetGpioOutput L;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if (value_mask != 0) {
+			// the command of an untouched port, as echoed
+			int alter = L::not_altered;
+			int value = L::not_altered;
+
+			if (value_mask & (1 << i)) {
+				alter = L::AlterValue::get(cmd, i);
+				value = L::Value::get(cmd, i);
+			}
+			if (L::AlterValue::get(buf, i) != alter || L::Value::get(buf, i) != value) {
+				return STATUS_IO_ERROR;
+			}
+		}
+
+		if (direction_mask != 0) {
+			int alter     = L::not_altered;
+			int direction = L::not_altered;
+
+			if (direction_mask & (1 << i)) {
+				alter     = L::AlterDirection::get(cmd, i);
+				direction = L::Direction::get(cmd, i);
+			}
+			if (L::AlterDirection::get(buf, i) != alter || L::Direction::get(buf, i) != direction) {
+				return STATUS_IO_ERROR;
+			}
+		}
+	}
+
+	return STATUS_OK;
+}
+
+// ----- hidapi transport -----
+static std::mutex hid_mutex;
+static int        hid_users = 0;
+
+// hid_init / hid_exit are process wide, the last handle releases the library.
+int mcp2221_hid_acquire() {
+	std::lock_guard<std::mutex> lock(hid_mutex);
+
+	if (hid_users == 0 && hid_init() != 0) {
+		printf("[ERROR] hid_init error.\n");
+		return STATUS_IO_ERROR;
+	}
+
+	hid_users++;
+
+	return STATUS_OK;
+}
+
+void mcp2221_hid_release() {
+	std::lock_guard<std::mutex> lock(hid_mutex);
+
+	hid_users--;
+
+	if (hid_users == 0 && hid_exit() != 0) {
+		printf("hid_exit error.\n");
+	}
+}
+
+static void mcp2221_copy_serial(char *dst, int size, const wchar_t *serial) {
+	dst[0] = '\0';
+
+	if (serial == NULL) {
+		return;
+	}
+
+	size_t n = wcstombs(dst, serial, size - 1);
+	if (n == (size_t)-1) {
+		n = 0;
+	}
+	dst[n] = '\0';
+}
+
+// Find the path of a device. serial NULL : the first device.
+static int mcp2221_hid_find(const char *serial, char path[256], char found_serial[64]) {
+	struct hid_device_info *devs = hid_enumerate(0x04d8, 0x00dd);
+	int ret = STATUS_IO_ERROR;
+
+	for (struct hid_device_info *cur = devs ; cur != NULL ; cur = cur->next) {
+		char cur_serial[64];
+
+		mcp2221_copy_serial(cur_serial, sizeof(cur_serial), cur->serial_number);
+
+		if (serial != NULL && strcmp(serial, cur_serial) != 0) {
+			continue;
+		}
+
+		snprintf(path, 256, "%s", cur->path);
+		snprintf(found_serial, 64, "%s", cur_serial);
+		ret = STATUS_OK;
+		break;
+	}
+
+	hid_free_enumeration(devs);
+
+	return ret;
+}
+
+// Opens hid_path, or looks the device up by hid_serial (or takes the first one) if no path is set.
+static int mcp2221_hid_open(void *context) {
+	MCP2221Handle *handle = (MCP2221Handle *)context;
+
+	handle->dev = NULL;
+
+	if (mcp2221_hid_acquire() != STATUS_OK) {
+		return STATUS_IO_ERROR;
+	}
+
+	if (handle->hid_path[0] == '\0') {
+		const char *serial = handle->hid_serial[0] != '\0' ? handle->hid_serial : NULL;
+
+		if (mcp2221_hid_find(serial, handle->hid_path, handle->hid_serial) != STATUS_OK) {
+			printf("[ERROR] device not found.\n");
+			mcp2221_hid_release();
+			return STATUS_IO_ERROR;
+		}
+	}
+
+	handle->dev = hid_open_path(handle->hid_path);
+	if (handle->dev == NULL) {
+		printf("[ERROR] hid_open error.\n");
+		mcp2221_hid_release();
+		return STATUS_IO_ERROR;
+	}
+
+	if (handle->hid_serial[0] == '\0') {
+		// opened by path, the serial number is needed to find the device again
+		wchar_t serial[64];
+
+		if (hid_get_serial_number_string(handle->dev, serial, 64) == 0) {
+			mcp2221_copy_serial(handle->hid_serial, sizeof(handle->hid_serial), serial);
+		}
+	}
+
+	return STATUS_OK;
+}
+
+// The library is held while the device is open, a second close does nothing.
+static int mcp2221_hid_close(void *context) {
+	MCP2221Handle *handle = (MCP2221Handle *)context;
+
+	if (handle->dev != NULL) {
+		hid_close(handle->dev);
+		handle->dev = NULL;
+
+		mcp2221_hid_release();
+	}
+
+	return STATUS_OK;
+}
+
+static int mcp2221_hid_send(void *context, const uint8_t *data, int length) {
+	MCP2221Handle *handle = (MCP2221Handle *)context;
+
+	if (handle->dev == NULL) {
+		// disconnected
+		return STATUS_IO_ERROR;
+	}
+
+	const int send_size = 64 + 1;
+	uint8_t send_data[send_size] = {0};
+	memcpy(send_data + 1, data, length);
+
+	if (hid_write(handle->dev, send_data, send_size) != send_size) {
+		printf("[ERROR] hid_write error.\n");
+		return STATUS_IO_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+static int mcp2221_hid_recv(void *context, uint8_t *data, int length, int timeout_ms) {
+	MCP2221Handle *handle = (MCP2221Handle *)context;
+
+	if (handle->dev == NULL) {
+		return STATUS_IO_ERROR;
+	}
+
+	const int recv_size = 64;
+
+	if (length == recv_size) {
+		// straight into the caller's buffer
+		int ret = hid_read_timeout(handle->dev, data, recv_size, timeout_ms);
+		if (ret == 0) {
+			return STATUS_RECV_TIMEOUT;
+		}
+		if (ret != recv_size) {
+			printf("[ERROR] hid_read_timeout error.\n");
+			return STATUS_IO_ERROR;
+		}
+		return STATUS_OK;
+	}
+
+	uint8_t recv_data[recv_size] = {0};
+
+	int ret = hid_read_timeout(handle->dev, recv_data, recv_size, timeout_ms);
+	if (ret == 0) {
+		return STATUS_RECV_TIMEOUT;
+	}
+	if (ret != recv_size) {
+		printf("[ERROR] hid_read_timeout error.\n");
+		return STATUS_IO_ERROR;
+	}
+
+	memcpy(data, recv_data, length);
+
+	return STATUS_OK;
+}
+
+static int mcp2221_hid_send_report(MCP2221Handle *handle, uint8_t report[65]) {
+	if (handle->dev == NULL) {
+		return STATUS_IO_ERROR;
+	}
+
+	report[0] = 0;
+
+	if (hid_write(handle->dev, report, 65) != 65) {
+		printf("[ERROR] hid_write error.\n");
+		return STATUS_IO_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+// ----- low level api -----
+int mcp2221_lowlevel_send(MCP2221Transport *transport, uint8_t *data, int length) {
+	if (length < 0 || 64 < length) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (data == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (mcp2221_trace_enabled()) {
+		mcp2221_trace_record(MCP2221_TRACE_SEND, data, length);
+	}
+
+	int ret = transport->send(transport->context, data, length);
+
+	if (mcp2221_metrics_enabled()) {
+		mcp2221_metrics_send(length > 0 ? data[0] : 0, length, ret);
+	}
+
+	return ret;
+}
+
+// Send a report whose command starts at report[1], without copying it if the backend can.
+int mcp2221_lowlevel_send_report(MCP2221Handle *handle, uint8_t report[65]) {
+	if (report == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (handle->send_report == NULL) {
+		return mcp2221_lowlevel_send(&handle->transport, report + 1, 64);
+	}
+
+	if (mcp2221_trace_enabled()) {
+		mcp2221_trace_record(MCP2221_TRACE_SEND, report + 1, 64);
+	}
+
+	int ret = handle->send_report(handle, report);
+
+	if (mcp2221_metrics_enabled()) {
+		mcp2221_metrics_send(report[1], 64, ret);
+	}
+
+	return ret;
+}
+
+int mcp2221_lowlevel_recv(MCP2221Transport *transport, uint8_t *data, int length, int timeout_ms) {
+	int ret;
+
+	if (length < 0 || 64 < length) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (data == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	ret = transport->recv(transport->context, data, length, timeout_ms);
+
+	if (mcp2221_metrics_enabled()) {
+		mcp2221_metrics_recv(data, length, ret, timeout_ms);
+	}
+
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	if (mcp2221_trace_enabled()) {
+		mcp2221_trace_record(MCP2221_TRACE_RECV, data, length);
+	}
+
+	return STATUS_OK;
+}
+
+// ----- command api -----
+
+// Set GPIO Output Values
+// @param cmd cmd needed to allocate 64byte
+void mcp2221_command_set_gpio_output(uint8_t cmd[64], GPIOSetting *gp0, GPIOSetting *gp1, GPIOSetting *gp2, GPIOSetting *gp3) {
+	mcp2221::encode_set_gpio_output(cmd, gp0, gp1, gp2, gp3);
+}
+
+// Get GPIO Values
+void mcp2221_command_get_gpio_input(uint8_t cmd[64]) {
+	mcp2221::encode_get_gpio_input(cmd);
+}
+
+// Set SRAM settings
+void mcp2221_command_set_sram_settings(uint8_t cmd[64], SRAMSetting *setting) {
+	mcp2221::encode_set_sram_settings(cmd, setting);
+}
+
+// Get SRAM settings
+void mcp2221_command_get_sram_setting(uint8_t cmd[64]) {
+	mcp2221::encode_get_sram_setting(cmd);
+}
+
+// Read Flash Data
+// @param section FLASH_CHIP_SETTINGS / FLASH_GP_SETTINGS
+void mcp2221_command_read_flash_data(uint8_t cmd[64], int section) {
+	mcp2221::encode_read_flash_data(cmd, section);
+}
+
+// Write Flash Data
+// @param length up to 62 bytes
+void mcp2221_command_write_flash_data(uint8_t cmd[64], int section, const uint8_t *data, int length) {
+	mcp2221::encode_write_flash_data(cmd, section, data, length);
+}
+
+// ----- high layaer api -----
+// One caller of the blocking api waiting for its response (see mcp2221_submit).
+struct _MCP2221Submission {
+	uint8_t *report;	// NULL : cmd is sent
+	uint8_t *cmd;
+	uint8_t *recv_buf;
+	uint64_t deadline_us;	// 0 : none
+	int      timeout_ms;
+	int      status;
+	int      done;
+
+	MCP2221Submission *next;
+};
+
+#define COMPLETION_SPIN (1000)
+
+// Wait until done is 1.
+// @param timeout_ms < 0 : wait forever
+int mcp2221_completion_wait(int *done, int timeout_ms) {
+	// the response is often sent by the time the caller waits
+	for (int i = 0 ; i < COMPLETION_SPIN ; i++) {
+		if (__atomic_load_n(done, __ATOMIC_ACQUIRE) == 1) {
+			return STATUS_OK;
+		}
+	}
+
+	uint64_t deadline_us = timeout_ms < 0 ? 0 : mcp2221_get_time_us() + (uint64_t)timeout_ms * 1000;
+	int expected = 0;
+
+	if (!__atomic_compare_exchange_n(done, &expected, 2, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) && expected == 1) {
+		return STATUS_OK;
+	}
+
+	for (;;) {
+		struct timespec ts;
+		struct timespec *timeout = NULL;
+
+		if (timeout_ms >= 0) {
+			uint64_t now = mcp2221_get_time_us();
+
+			if (deadline_us <= now) {
+				return STATUS_TIMEOUT;
+			}
+
+			ts.tv_sec  = (deadline_us - now) / 1000000;
+			ts.tv_nsec = (deadline_us - now) % 1000000 * 1000;
+			timeout = &ts;
+		}
+
+		syscall(SYS_futex, done, FUTEX_WAIT_PRIVATE, 2, timeout, NULL, 0);
+
+		if (__atomic_load_n(done, __ATOMIC_ACQUIRE) == 1) {
+			return STATUS_OK;
+		}
+	}
+}
+
+// The waiter may release the memory of done as soon as it is set.
+void mcp2221_completion_signal(int *done) {
+	if (__atomic_exchange_n(done, 1, __ATOMIC_RELEASE) == 2) {
+		syscall(SYS_futex, done, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+void mcp2221_state_lock(MCP2221Handle *handle) {
+	while (__atomic_exchange_n(&handle->state_lock, 1, __ATOMIC_ACQUIRE) != 0) {
+		while (__atomic_load_n(&handle->state_lock, __ATOMIC_RELAXED) != 0) {
+			sched_yield();
+		}
+	}
+}
+
+void mcp2221_state_unlock(MCP2221Handle *handle) {
+	__atomic_store_n(&handle->state_lock, 0, __ATOMIC_RELEASE);
+}
+
+// lock whose waiters sleep : 0 free, 1 held, 2 held with sleeping waiters
+static void mcp2221_sleep_lock(int *lock) {
+	int state = 0;
+
+	if (__atomic_compare_exchange_n(lock, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	while (__atomic_exchange_n(lock, 2, __ATOMIC_ACQUIRE) != 0) {
+		syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+	}
+}
+
+static void mcp2221_sleep_unlock(int *lock) {
+	if (__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) == 2) {
+		syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+// a transfer takes several round trips, the waiters sleep
+void mcp2221_transaction_lock(MCP2221Handle *handle) {
+	mcp2221_sleep_lock(&handle->transaction_lock);
+}
+
+void mcp2221_transaction_unlock(MCP2221Handle *handle) {
+	mcp2221_sleep_unlock(&handle->transaction_lock);
+}
+
+void mcp2221_count_response(uint64_t *counter) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+// Read the reports left in the device queue without waiting.
+void mcp2221_drain_responses(MCP2221Handle *handle) {
+	uint8_t buf[64];
+
+	for (int i = 0 ; i < RESPONSE_DRAIN_MAX ; i++) {
+		if (mcp2221_lowlevel_recv(&handle->transport, buf, 64, 0) != STATUS_OK) {
+			break;
+		}
+		mcp2221_count_response(&handle->response_stats.discarded);
+	}
+
+	handle->drain_pending = 0;
+}
+
+// Wait for the response to cmd.
+// The device echoes the command code in byte 0, a report of another command is the late
+// response of an abandoned one : it is dropped and the wait goes on until timeout_ms.
+// After a timeout the response may still come, it is drained before the next command.
+int mcp2221_recv_response(MCP2221Handle *handle, const uint8_t *cmd, uint8_t *buf, int timeout_ms) {
+	uint64_t deadline = mcp2221_get_time_us() + (uint64_t)timeout_ms * 1000;
+
+	for (;;) {
+		int ret = mcp2221_lowlevel_recv(&handle->transport, buf, 64, timeout_ms);
+
+		if (ret == STATUS_OK && buf[0] == cmd[0]) {
+			return STATUS_OK;
+		}
+
+		if (ret == STATUS_OK) {
+			mcp2221_count_response(&handle->response_stats.mismatched);
+
+			uint64_t now = mcp2221_get_time_us();
+
+			if (now < deadline) {
+				timeout_ms = (deadline - now + 999) / 1000;
+				continue;
+			}
+
+			ret = STATUS_RECV_TIMEOUT;
+		}
+
+		if (ret == STATUS_RECV_TIMEOUT) {
+			mcp2221_count_response(&handle->response_stats.recv_timeouts);
+			handle->drain_pending = 1;
+		}
+
+		return ret;
+	}
+}
+
+static void mcp2221_submission_execute(MCP2221Handle *handle, MCP2221Submission *submission) {
+	int ret;
+	int timeout_ms = submission->timeout_ms;
+
+	if (submission->deadline_us != 0) {
+		// the time spent in the queue counts
+		uint64_t now = mcp2221_get_time_us();
+
+		if (submission->deadline_us <= now) {
+			submission->status = STATUS_SEND_TIMEOUT;
+			mcp2221_completion_signal(&submission->done);
+			return;
+		}
+
+		int remaining_ms = (submission->deadline_us - now + 999) / 1000;
+		if (remaining_ms < timeout_ms) {
+			timeout_ms = remaining_ms;
+		}
+	}
+
+	if (handle->drain_pending) {
+		mcp2221_drain_responses(handle);
+	}
+
+	const uint8_t *cmd;
+
+	if (submission->report != NULL) {
+		cmd = submission->report + 1;
+		ret = mcp2221_lowlevel_send_report(handle, submission->report);
+	} else {
+		cmd = submission->cmd;
+		ret = mcp2221_lowlevel_send(&handle->transport, submission->cmd, 64);
+	}
+
+	if (ret == STATUS_OK) {
+		ret = mcp2221_recv_response(handle, cmd, submission->recv_buf, timeout_ms);
+	}
+
+	submission->status = ret == STATUS_OK || ret == STATUS_RECV_TIMEOUT ? ret : STATUS_IO_ERROR;
+
+	mcp2221_completion_signal(&submission->done);
+}
+
+// Send a command and wait for its response, from any thread.
+// Every caller pushes its command onto the lock-free queue of the handle. The first one to find
+// the handle idle becomes its owner and sends the queued commands of all threads in order,
+// one send / recv pair at a time, so that each response goes back to the caller of its command.
+static int mcp2221_submit(MCP2221Handle *handle, MCP2221Submission *submission) {
+	submission->done = 0;
+
+	mcp2221_mpsc_push(&handle->submit_head, submission);
+
+	// the owner looks at the queue again after giving up the handle, nothing is left behind
+	while (
+			__atomic_load_n(&handle->submit_head, __ATOMIC_SEQ_CST) != NULL &&
+			__atomic_exchange_n(&handle->submit_owner, 1, __ATOMIC_SEQ_CST) == 0
+	) {
+		MCP2221Submission *list;
+
+		while ((list = mcp2221_mpsc_take_all(&handle->submit_head)) != NULL) {
+			while (list != NULL) {
+				MCP2221Submission *next = list->next;
+
+				mcp2221_submission_execute(handle, list);
+				list = next;
+			}
+		}
+
+		__atomic_store_n(&handle->submit_owner, 0, __ATOMIC_SEQ_CST);
+	}
+
+	mcp2221_completion_wait(&submission->done, -1);
+
+	return submission->status;
+}
+
+// A command which leaves the device in the same state when it is sent twice.
+static int mcp2221_command_is_idempotent(const uint8_t *cmd) {
+	using namespace mcp2221::layout;
+
+	switch (cmd[0]) {
+	case Status::code:
+		// no cancel, no speed change
+		return Status::Cancel::get(cmd) == 0 && Status::SetSpeed::get(cmd) == 0;
+	case SetSram::code:
+		// a second clear of the interrupt flag would drop an edge latched in between
+		return SetSram::ClearInterrupt::get(cmd) == 0;
+	case 0x50:
+	case 0x51:
+	case 0x61:
+	case 0xB0:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// Issue with the deadline of the thread and the retry policy of the handle.
+static int mcp2221_issue_submission_retry(MCP2221Handle *handle, MCP2221Submission *submission) {
+	int ret;
+
+	for (int attempt = 0 ; ; attempt++) {
+		uint64_t deadline = budget_deadline_us;
+
+		if (deadline != 0 && deadline <= mcp2221_get_time_us()) {
+			return STATUS_SEND_TIMEOUT;
+		}
+
+		submission->deadline_us = deadline;
+		submission->timeout_ms  = handle->recv_timeout_ms;
+
+		ret = mcp2221_submit(handle, submission);
+
+		if (ret == STATUS_OK || ret == STATUS_SEND_TIMEOUT) {
+			return ret;
+		}
+		if (attempt >= handle->retry_max || !mcp2221_command_is_idempotent(submission->cmd)) {
+			return ret;
+		}
+
+		// bounded exponential backoff, within the budget
+		uint64_t backoff = (uint64_t)handle->retry_backoff_us << (attempt < 16 ? attempt : 16);
+		if (backoff > (uint64_t)handle->retry_backoff_max_us) {
+			backoff = handle->retry_backoff_max_us;
+		}
+
+		if (deadline != 0 && deadline <= mcp2221_get_time_us() + backoff) {
+			return ret;
+		}
+
+		if (backoff > 0) {
+			struct timespec ts;
+			ts.tv_sec  = backoff / 1000000;
+			ts.tv_nsec = (backoff % 1000000) * 1000;
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+static int mcp2221_issue_submission(MCP2221Handle *handle, MCP2221Submission *submission) {
+	if (!mcp2221_metrics_enabled()) {
+		return mcp2221_issue_submission_retry(handle, submission);
+	}
+
+	uint64_t start = mcp2221_get_time_us();
+	int ret = mcp2221_issue_submission_retry(handle, submission);
+
+	mcp2221_metrics_command(submission->cmd[0], ret, mcp2221_get_time_us() - start);
+
+	return ret;
+}
+
+// Send a command and receive its response.
+// The response is the first report echoing the command code (see mcp2221_recv_response).
+// If the command pipeline is running, the command is queued to its I/O thread.
+// @return STATUS_SEND_TIMEOUT / STATUS_RECV_TIMEOUT when the deadline or the timeout of the handle passed
+int mcp2221_issue_command(MCP2221Handle *handle, uint8_t send_cmd[64], uint8_t recv_buf[64]) {
+	if (__atomic_load_n(&handle->gpio_pending_count, __ATOMIC_RELAXED) > 0) {
+		// the queued gpio writes go first
+		mcp2221_flush_gpio(handle);
+	}
+
+	if (handle->async != NULL) {
+		if (mcp2221_async_is_io_thread(handle)) {
+			// called from a completion callback, it would wait for itself
+			return STATUS_ARGUMENT_ERROR;
+		}
+		uint64_t start = mcp2221_get_time_us();
+		int ret;
+
+		if (budget_deadline_us != 0 && budget_deadline_us <= start) {
+			ret = STATUS_SEND_TIMEOUT;
+		} else {
+			// the pipeline owns the request until its response, only the handle timeout applies
+			ret = mcp2221_async_issue(handle, send_cmd, recv_buf);
+		}
+
+		if (mcp2221_metrics_enabled()) {
+			mcp2221_metrics_command(send_cmd[0], ret, mcp2221_get_time_us() - start);
+		}
+
+		return ret;
+	}
+
+	return mcp2221_issue_command_direct(handle, send_cmd, recv_buf);
+}
+
+// Same as mcp2221_issue_command, the command starts at report[1] (see mcp2221::Report).
+// report[0] is overwritten with the report id.
+int mcp2221_issue_report(MCP2221Handle *handle, uint8_t report[65], uint8_t recv_buf[64]) {
+	MCP2221Submission submission;
+
+	if (__atomic_load_n(&handle->gpio_pending_count, __ATOMIC_RELAXED) > 0) {
+		mcp2221_flush_gpio(handle);
+	}
+
+	if (handle->async != NULL) {
+		return mcp2221_issue_command(handle, report + 1, recv_buf);
+	}
+
+	submission.report   = report;
+	submission.cmd      = report + 1;
+	submission.recv_buf = recv_buf;
+
+	return mcp2221_issue_submission(handle, &submission);
+}
+
+int mcp2221_issue_command_direct(MCP2221Handle *handle, uint8_t send_cmd[64], uint8_t recv_buf[64]) {
+	MCP2221Submission submission;
+
+	submission.report   = NULL;
+	submission.cmd      = send_cmd;
+	submission.recv_buf = recv_buf;
+
+	return mcp2221_issue_submission(handle, &submission);
+}
+
+// Counters of the response correlation of the handle.
+void mcp2221_get_response_stats(MCP2221Handle *handle, MCP2221ResponseStats *stats) {
+	stats->recv_timeouts = __atomic_load_n(&handle->response_stats.recv_timeouts, __ATOMIC_RELAXED);
+	stats->mismatched    = __atomic_load_n(&handle->response_stats.mismatched, __ATOMIC_RELAXED);
+	stats->discarded     = __atomic_load_n(&handle->response_stats.discarded, __ATOMIC_RELAXED);
+}
+
+// Wait at most recv_timeout_ms for each response (1000 by default).
+int mcp2221_set_timeout(MCP2221Handle *handle, int recv_timeout_ms) {
+	if (recv_timeout_ms <= 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	handle->recv_timeout_ms = recv_timeout_ms;
+
+	return STATUS_OK;
+}
+
+// Send a command again when it failed or its response timed out, up to retries times.
+// The wait before the n-th retry is backoff_us * 2^(n-1), at most backoff_max_us.
+// Only commands which can be repeated safely are retried (GPIO / SRAM / flash reads, plain status),
+// I2C transfers are never sent twice. retries = 0 disables retrying (default).
+int mcp2221_set_retry(MCP2221Handle *handle, int retries, int backoff_us, int backoff_max_us) {
+	if (retries < 0 || backoff_us < 0 || backoff_max_us < backoff_us) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	handle->retry_max            = retries;
+	handle->retry_backoff_us     = backoff_us;
+	handle->retry_backoff_max_us = backoff_max_us;
+
+	return STATUS_OK;
+}
+
+// Operation budget of the calling thread.
+// Until mcp2221_end_budget, every command of this thread on any handle must be sent before the
+// deadline (STATUS_SEND_TIMEOUT) and its response is awaited at most until the deadline
+// (STATUS_RECV_TIMEOUT), so that a composite operation such as set then verify keeps the
+// deadline of its caller. Retries stop at the deadline.
+// Nested budgets keep the earlier deadline, budget_us < 0 lifts it (cleanup commands).
+// @return token for mcp2221_end_budget
+uint64_t mcp2221_begin_budget(int budget_us) {
+	uint64_t previous = budget_deadline_us;
+
+	if (budget_us < 0) {
+		budget_deadline_us = 0;
+	} else {
+		uint64_t deadline = mcp2221_get_time_us() + budget_us;
+
+		if (previous == 0 || deadline < previous) {
+			budget_deadline_us = deadline;
+		}
+	}
+
+	return previous;
+}
+
+void mcp2221_end_budget(uint64_t token) {
+	budget_deadline_us = token;
+}
+
+// @return time left, -1 if the thread has no budget
+int64_t mcp2221_budget_remaining_us() {
+	if (budget_deadline_us == 0) {
+		return -1;
+	}
+
+	uint64_t now = mcp2221_get_time_us();
+
+	return budget_deadline_us <= now ? 0 : (int64_t)(budget_deadline_us - now);
+}
+
+/*
+int mcp2221_setup_port_func(MCP2221Handle *handle, int port, int func) {
+	if (port < 0 || 4 < port) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (port == 0 && (func < 0 || GP0_FUNC_MAX <= func)) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (port == 1 && (func < 0 || GP1_FUNC_MAX <= func)) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (port == 2 && (func < 0 || GP2_FUNC_MAX <= func)) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (port == 3 && (func < 0 || GP3_FUNC_MAX <= func)) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	handle->setting.gpn_func[port] = func;
+
+	return STATUS_OK;
+}
+
+int mcp2221_setup_initial_gpio_setting(MCP2221Handle *handle, int port, GPIOSetting *setting) {
+	if (port < 0 || 4 < port) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (mcp2221_validate_gpio_setting(setting) != STATUS_OK) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	handle->setting.gpn_gpio[port].enable_value     = setting->enable_value;
+	handle->setting.gpn_gpio[port].value            = setting->value;
+	handle->setting.gpn_gpio[port].enable_direction = setting->enable_direction;
+	handle->setting.gpn_gpio[port].direction        = setting->direction;
+
+	return STATUS_OK;
+}
+*/
+
+// Read one flash section, data is the structure as stored (bytes 4 - of the response).
+static int mcp2221_read_flash_section(MCP2221Handle *handle, int section, uint8_t *data, int length) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	mcp2221_command_read_flash_data(cmd, section);
+
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	if (buf[0] != mcp2221::layout::ReadFlash::code || buf[1] != 0) {
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+		return STATUS_IO_ERROR;
+	}
+
+	memcpy(data, buf + mcp2221::layout::ReadFlash::data, length);
+
+	return STATUS_OK;
+}
+
+// Write one flash section unless it already holds data.
+static int mcp2221_write_flash_section(MCP2221Handle *handle, int section, const uint8_t *current, const uint8_t *data, int length) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	if (memcmp(current, data, length) == 0) {
+		// identical, save a flash write cycle
+		return STATUS_OK;
+	}
+
+	// the password (chip settings bytes 12 - 19) stays 0
+	mcp2221_command_write_flash_data(cmd, section, data, length);
+
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	if (buf[0] != 0xB1 || buf[1] != 0) {
+		// 0x03 : the flash is locked
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[1]);
+		return STATUS_IO_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+static uint8_t mcp2221_flash_gp_byte(FlashSetting *setting, int port) {
+	typedef mcp2221::layout::FlashGp L;
+
+	return L::Func::encode(setting->gpn_func[port]) | L::Direction::encode(setting->gpn_gpio_direction[port]) | L::Value::encode(setting->gpn_gpio_value[port]);
+}
+
+// Store the power-up configuration. Each section is read back first and only written if it differs.
+// Chip settings which are not part of FlashSetting (security, VID / PID, USB power) are kept.
+int mcp2221_write_flash_setting(MCP2221Handle *handle, FlashSetting *setting) {
+	int ret;
+
+	if (setting->enable_chip_setting) {
+		if (setting->clock_output < 0 || 0x1F < setting->clock_output) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+		if (setting->dac_value < 0 || 0x1F < setting->dac_value) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+		if (setting->dac_reference < 0 || ADC_REF_MAX <= setting->dac_reference) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+		if (setting->adc_reference < 0 || ADC_REF_MAX <= setting->adc_reference) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+
+		uint8_t current[10];
+		uint8_t data[10];
+
+		ret = mcp2221_read_flash_section(handle, FLASH_CHIP_SETTINGS, current, sizeof(current));
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		typedef mcp2221::layout::FlashChip L;
+
+		// the other bits of the section are kept
+		memcpy(data, current, sizeof(data));
+
+		L::SerialEnumeration::set(data, setting->serial_enumeration);
+		L::ClockOutput::set(data, setting->clock_output);
+		L::DacReference::set(data, setting->dac_reference);
+		L::DacReferenceVrm::set(data, setting->dac_reference != ADC_REF_VDD);
+		L::DacValue::set(data, setting->dac_value);
+		L::AdcReference::set(data, setting->adc_reference);
+		L::AdcReferenceVrm::set(data, setting->adc_reference != ADC_REF_VDD);
+
+		ret = mcp2221_write_flash_section(handle, FLASH_CHIP_SETTINGS, current, data, sizeof(data));
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+	}
+
+	if (setting->enable_gp_setting) {
+		for (int i = 0 ; i < 4 ; i++) {
+			if (setting->gpn_func[i] < 0 || 7 < setting->gpn_func[i]) {
+				return STATUS_ARGUMENT_ERROR;
+			}
+		}
+
+		uint8_t current[4];
+		uint8_t data[4];
+
+		ret = mcp2221_read_flash_section(handle, FLASH_GP_SETTINGS, current, sizeof(current));
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		for (int i = 0 ; i < 4 ; i++) {
+			data[i] = mcp2221_flash_gp_byte(setting, i);
+		}
+
+		ret = mcp2221_write_flash_section(handle, FLASH_GP_SETTINGS, current, data, sizeof(data));
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+	}
+
+	return STATUS_OK;
+}
+
+// Read the power-up configuration (both sections).
+int mcp2221_read_flash_setting(MCP2221Handle *handle, FlashSetting *setting) {
+	int ret;
+	uint8_t chip[10];
+	uint8_t gp[4];
+
+	ret = mcp2221_read_flash_section(handle, FLASH_CHIP_SETTINGS, chip, sizeof(chip));
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	ret = mcp2221_read_flash_section(handle, FLASH_GP_SETTINGS, gp, sizeof(gp));
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	typedef mcp2221::layout::FlashChip L;
+	typedef mcp2221::layout::FlashGp   G;
+
+	setting->serial_enumeration = L::SerialEnumeration::get(chip);
+	setting->clock_output       = L::ClockOutput::get(chip);
+	setting->dac_reference      = L::DacReferenceVrm::get(chip) ? L::DacReference::get(chip) : ADC_REF_VDD;
+	setting->dac_value          = L::DacValue::get(chip);
+	setting->adc_reference      = L::AdcReferenceVrm::get(chip) ? L::AdcReference::get(chip) : ADC_REF_VDD;
+	setting->vid                = L::Vid::get(chip);
+	setting->pid                = L::Pid::get(chip);
+
+	for (int i = 0 ; i < 4 ; i++) {
+		setting->gpn_func[i]           = G::Func::get(gp, i);
+		setting->gpn_gpio_direction[i] = G::Direction::get(gp, i);
+		setting->gpn_gpio_value[i]     = G::Value::get(gp, i);
+	}
+
+	return STATUS_OK;
+}
+
+// Send a Set SRAM Settings report and check its answer.
+// The shadow is invalidated if the result is unknown, the caller updates it on success.
+int mcp2221_issue_set_sram(MCP2221Handle *handle, uint8_t report[65]) {
+	uint8_t buf[64];
+
+	mcp2221_invalidate_gpio_cache(handle);
+
+	int ret = mcp2221_issue_report(handle, report, buf);
+	if (ret != STATUS_OK) {
+		mcp2221_invalidate_setting(handle);
+		return ret;
+	}
+
+	if (buf[0] != 0x60 || buf[1] != 0) {
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+		mcp2221_invalidate_setting(handle);
+		return STATUS_IO_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+int mcp2221_write_sram_setting(MCP2221Handle *handle, SRAMSetting *setting) {
+	int ret;
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+
+	mcp2221_command_set_sram_settings(cmd, setting);
+
+	ret = mcp2221_issue_set_sram(handle, report.wire);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	mcp2221_state_lock(handle);
+
+	if (setting->enable_gpio_config) {
+		for (int i = 0 ; i < 4 ; i++) {
+			handle->setting.gpn_func[i]           = setting->gpn_func[i];
+			handle->setting.gpn_gpio_value[i]     = setting->gpn_gpio_value[i];
+			handle->setting.gpn_gpio_direction[i] = setting->gpn_gpio_direction[i];
+		}
+	}
+
+	mcp2221_state_unlock(handle);
+
+	return STATUS_OK;
+}
+
+int mcp2221_read_sram_setting(MCP2221Handle *handle, SRAMSetting *setting) {
+	int ret;
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	mcp2221_command_get_sram_setting(cmd);
+
+	ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	mcp2221::SramView view(buf);
+
+	if (!view.ok()) {
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+		return STATUS_IO_ERROR;
+	}
+
+	view.setting(setting);
+
+	// the device state is known now
+	mcp2221_state_lock(handle);
+	handle->setting = *setting;
+	handle->setting.enable_gpio_config = 0;
+	handle->adc_reference = view.adc_reference();
+	handle->setting_valid = 1;
+	mcp2221_state_unlock(handle);
+
+	return STATUS_OK;
+}
+
+// Bring the device to the target with the fewest commands.
+// The target is compared with the shadow state of the handle (read from the device once):
+// - nothing changed : no command
+// - a GP function changed : one 0x60 with the whole gpio configuration
+// - otherwise : one 0x50 with the changed GPIO fields
+// Only the gpio configuration selected by enable_gpio_config is compared, the ADC reference
+// and the interrupt are changed by their own functions (mcp2221_set_adc_reference, mcp2221_set_interrupt_edge).
+// Value and direction of ports which are not GPIO are ignored.
+int mcp2221_apply_setting(MCP2221Handle *handle, SRAMSetting *target) {
+	int ret;
+
+	for (int i = 0 ; i < 4 && target->enable_gpio_config ; i++) {
+		if (target->gpn_func[i] < 0 || 7 < target->gpn_func[i]) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+		if (target->gpn_gpio_value[i] < 0 || GPIO_VALUE_MAX <= target->gpn_gpio_value[i]) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+		if (target->gpn_gpio_direction[i] < 0 || GPIO_DIR_MAX <= target->gpn_gpio_direction[i]) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+	}
+
+	SRAMSetting current;
+
+	mcp2221_state_lock(handle);
+	int valid = handle->setting_valid;
+	current = handle->setting;
+	mcp2221_state_unlock(handle);
+
+	if (!valid) {
+		ret = mcp2221_read_sram_setting(handle, &current);
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+	}
+
+	SRAMSetting *shadow = &current;
+
+	int func_changed = 0;
+
+	GPIOSetting gpio[4];
+	int gpio_changed = 0;
+
+	memset(gpio, 0, sizeof(gpio));
+
+	for (int i = 0 ; i < 4 && target->enable_gpio_config ; i++) {
+		if (target->gpn_func[i] != shadow->gpn_func[i]) {
+			func_changed = 1;
+		}
+		if (target->gpn_func[i] != 0) {
+			// GPn_FUNC_GPIO is 0 for every port
+			continue;
+		}
+
+		if (target->gpn_gpio_value[i] != shadow->gpn_gpio_value[i]) {
+			gpio[i].enable_value = 1;
+			gpio[i].value        = (GPIOValue)target->gpn_gpio_value[i];
+			gpio_changed = 1;
+		}
+		if (target->gpn_gpio_direction[i] != shadow->gpn_gpio_direction[i]) {
+			gpio[i].enable_direction = 1;
+			gpio[i].direction        = (GPIODirection)target->gpn_gpio_direction[i];
+			gpio_changed = 1;
+		}
+	}
+
+	if (func_changed) {
+		return mcp2221_write_sram_setting(handle, target);
+	}
+
+	if (gpio_changed) {
+		return mcp2221_set_gpio_output(handle, gpio);
+	}
+
+	return STATUS_OK;
+}
+
+// The device was changed behind the handle (e.g. another process, a reset).
+// The next mcp2221_apply_setting reads the state again.
+void mcp2221_invalidate_setting(MCP2221Handle *handle) {
+	mcp2221_state_lock(handle);
+	handle->setting_valid = 0;
+	mcp2221_state_unlock(handle);
+}
+
+// Use the cached snapshot if it is enabled and fresh enough.
+static int mcp2221_get_gpio_snapshot_cached(MCP2221Handle *handle, GPIOSnapshot *snapshot) {
+	if (handle->gpio_cache_max_age_us > 0) {
+		mcp2221_state_lock(handle);
+
+		if (
+				handle->gpio_cache_valid &&
+				mcp2221_get_time_us() - handle->gpio_cache_time_us < (uint64_t)handle->gpio_cache_max_age_us
+		) {
+			*snapshot = handle->gpio_cache;
+			mcp2221_state_unlock(handle);
+			return STATUS_OK;
+		}
+
+		mcp2221_state_unlock(handle);
+	}
+
+	return mcp2221_get_gpio_snapshot(handle, snapshot);
+}
+
+// Only the fields of the masks must have been altered, the other ports may belong to another writer.
+static int mcp2221_check_gpio_output_fields(uint8_t cmd[64], uint8_t buf[64], int value_mask, int direction_mask) {
+	typedef mcp2221::layout::SetGpioOutput L;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if ((value_mask & (1 << i)) && (L::AlterValue::get(buf, i) != L::AlterValue::get(cmd, i) || L::Value::get(buf, i) != L::Value::get(cmd, i))) {
+			return STATUS_IO_ERROR;
+		}
+		if ((direction_mask & (1 << i)) && (L::AlterDirection::get(buf, i) != L::AlterDirection::get(cmd, i) || L::Direction::get(buf, i) != L::Direction::get(cmd, i))) {
+			return STATUS_IO_ERROR;
+		}
+	}
+
+	return STATUS_OK;
+}
+
+static int mcp2221_gpio_output_masks(GPIOSetting gpio[4], int *value_mask, int *direction_mask) {
+	*value_mask     = 0;
+	*direction_mask = 0;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if (mcp2221_validate_gpio_setting(&gpio[i]) != STATUS_OK) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+
+		*value_mask     |= gpio[i].enable_value << i;
+		*direction_mask |= gpio[i].enable_direction << i;
+	}
+
+	return STATUS_OK;
+}
+
+// called with the state lock held
+static void mcp2221_update_gpio_shadow(MCP2221Handle *handle, GPIOSetting gpio[4]) {
+	for (int i = 0 ; i < 4 ; i++) {
+		if (gpio[i].enable_value) {
+			handle->setting.gpn_gpio_value[i] = gpio[i].value;
+		}
+		if (gpio[i].enable_direction) {
+			handle->setting.gpn_gpio_direction[i] = gpio[i].direction;
+		}
+	}
+}
+
+// Set value and direction of several ports with one report.
+// Only the fields whose enable_value / enable_direction is set are altered.
+// With coalescing enabled the write is merged with the queued ones and sent at once,
+// the result is still the one of the fields of this write.
+int mcp2221_set_gpio_output(MCP2221Handle *handle, GPIOSetting gpio[4]) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+	int value_mask;
+	int direction_mask;
+
+	if (handle->gpio_coalesce_us > 0) {
+		int status;
+
+		int ret = mcp2221_queue_gpio_output(handle, gpio, &status);
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		mcp2221_flush_gpio(handle);
+
+		return __atomic_load_n(&status, __ATOMIC_ACQUIRE);
+	}
+
+	if (mcp2221_gpio_output_masks(gpio, &value_mask, &direction_mask) != STATUS_OK) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	mcp2221_command_set_gpio_output(cmd, &gpio[0], &gpio[1], &gpio[2], &gpio[3]);
+
+	mcp2221_invalidate_gpio_cache(handle);
+
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		mcp2221_invalidate_setting(handle);
+		return ret;
+	}
+
+	// check return value
+	if (buf[0] != 0x50 || mcp2221_check_gpio_output_echo(cmd, buf, value_mask, direction_mask) != STATUS_OK) {
+		mcp2221_invalidate_setting(handle);
+		return STATUS_IO_ERROR;
+	}
+
+	mcp2221_state_lock(handle);
+	mcp2221_update_gpio_shadow(handle, gpio);
+	mcp2221_state_unlock(handle);
+
+	return STATUS_OK;
+}
+
+// Sends the queued gpio writes of a handle when their deadline passes, also while the application is idle.
+struct _MCP2221GpioTimer {
+	MCP2221Handle *handle;
+
+	std::mutex              mutex;
+	std::condition_variable wake;
+	int                     armed;	// a batch was started since the last poll
+	int                     stop;
+
+	std::thread thread;
+};
+
+static void mcp2221_gpio_timer_run(MCP2221GpioTimer *timer) {
+	std::unique_lock<std::mutex> lock(timer->mutex);
+
+	while (!timer->stop) {
+		int next_us;
+
+		timer->armed = 0;
+
+		lock.unlock();
+		mcp2221_poll_gpio(timer->handle, &next_us);
+		lock.lock();
+
+		auto woken = [timer] { return timer->stop || timer->armed; };
+
+		if (next_us < 0) {
+			timer->wake.wait(lock, woken);
+		} else {
+			timer->wake.wait_for(lock, std::chrono::microseconds(next_us), woken);
+		}
+	}
+}
+
+// a write started a new batch
+static void mcp2221_gpio_timer_arm(MCP2221GpioTimer *timer) {
+	std::lock_guard<std::mutex> lock(timer->mutex);
+
+	timer->armed = 1;
+	timer->wake.notify_one();
+}
+
+static void mcp2221_gpio_timer_stop(MCP2221Handle *handle) {
+	MCP2221GpioTimer *timer = handle->gpio_timer;
+
+	if (timer == NULL) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(timer->mutex);
+
+		timer->stop = 1;
+		timer->wake.notify_one();
+	}
+
+	timer->thread.join();
+
+	handle->gpio_timer = NULL;
+	delete timer;
+}
+
+// Coalesce gpio writes : they are merged (the last write of a field wins) and sent as one report
+// by mcp2221_flush_gpio, or by a timer thread of the handle when window_us has passed since the
+// first queued write. mcp2221_poll_gpio sends expired writes from the calling thread.
+// Every other command sends the queued writes first, so reads always see them.
+// window_us = 0 sends the queued writes and disables coalescing.
+int mcp2221_set_gpio_coalesce(MCP2221Handle *handle, int window_us) {
+	if (window_us < 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (window_us == 0) {
+		handle->gpio_coalesce_us = 0;
+
+		mcp2221_gpio_timer_stop(handle);
+
+		return mcp2221_flush_gpio(handle);
+	}
+
+	if (handle->gpio_timer == NULL) {
+		MCP2221GpioTimer *timer = new MCP2221GpioTimer();
+
+		timer->handle = handle;
+		timer->armed  = 0;
+		timer->stop   = 0;
+		timer->thread = std::thread(mcp2221_gpio_timer_run, timer);
+
+		handle->gpio_timer = timer;
+	}
+
+	handle->gpio_coalesce_us = window_us;
+
+	return STATUS_OK;
+}
+
+// Queue a write while coalescing is enabled (sent at once otherwise).
+// @param status set to STATUS_PENDING, then to the result of the echo check of the fields of this write (may be NULL).
+//               The result is stored by the thread which flushes, possibly another one : status must stay
+//               valid until a mcp2221_flush_gpio called after this returned. Until then it may only be read
+//               with an atomic load (__atomic_load_n, acquire).
+int mcp2221_queue_gpio_output(MCP2221Handle *handle, GPIOSetting gpio[4], int *status) {
+	int ret;
+	int value_mask;
+	int direction_mask;
+
+	if (mcp2221_gpio_output_masks(gpio, &value_mask, &direction_mask) != STATUS_OK) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (handle->gpio_coalesce_us == 0) {
+		ret = mcp2221_set_gpio_output(handle, gpio);
+		if (status != NULL) {
+			*status = ret;
+		}
+		return ret;
+	}
+
+	if (status != NULL) {
+		__atomic_store_n(status, STATUS_PENDING, __ATOMIC_RELAXED);
+	}
+
+	mcp2221_state_lock(handle);
+
+	while (handle->gpio_pending_count == GPIO_COALESCE_MAX) {
+		mcp2221_state_unlock(handle);
+		mcp2221_flush_gpio(handle);
+		mcp2221_state_lock(handle);
+	}
+
+	int first = handle->gpio_pending_count == 0;
+
+	if (first) {
+		memset(handle->gpio_pending, 0, sizeof(handle->gpio_pending));
+		handle->gpio_pending_deadline_us = mcp2221_get_time_us() + handle->gpio_coalesce_us;
+	}
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if (gpio[i].enable_value) {
+			handle->gpio_pending[i].enable_value = 1;
+			handle->gpio_pending[i].value        = gpio[i].value;
+		}
+		if (gpio[i].enable_direction) {
+			handle->gpio_pending[i].enable_direction = 1;
+			handle->gpio_pending[i].direction        = gpio[i].direction;
+		}
+	}
+
+	GPIOPendingWrite *write = &handle->gpio_pending_writes[handle->gpio_pending_count];
+
+	write->status         = status;
+	write->value_mask     = value_mask;
+	write->direction_mask = direction_mask;
+
+	// read without the lock by mcp2221_issue_command
+	__atomic_store_n(&handle->gpio_pending_count, handle->gpio_pending_count + 1, __ATOMIC_RELAXED);
+
+	handle->gpio_cache_valid = 0;
+
+	int expired = handle->gpio_pending_deadline_us <= mcp2221_get_time_us();
+
+	mcp2221_state_unlock(handle);
+
+	if (expired) {
+		return mcp2221_flush_gpio(handle);
+	}
+	if (first) {
+		mcp2221_gpio_timer_arm(handle->gpio_timer);
 	}
 
 	return STATUS_OK;
 }
 
-// ----- low level api -----
-int mcp2221_lowlevel_send(hid_device *dev, uint8_t *data, int length) {
-	if (length < 0 || 64 < length) {
-		return STATUS_ARGUMENT_ERROR;
+static int mcp2221_flush_gpio_locked(MCP2221Handle *handle) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+	GPIOSetting      gpio[4];
+	GPIOPendingWrite writes[GPIO_COALESCE_MAX];
+
+	mcp2221_state_lock(handle);
+
+	int count = handle->gpio_pending_count;
+
+	if (count == 0) {
+		mcp2221_state_unlock(handle);
+		return STATUS_OK;
 	}
-	if (data == NULL) {
-		return STATUS_ARGUMENT_ERROR;
+
+	// taken off the queue first, issuing the report would flush it again
+	memcpy(gpio, handle->gpio_pending, sizeof(gpio));
+	memcpy(writes, handle->gpio_pending_writes, sizeof(GPIOPendingWrite) * count);
+	__atomic_store_n(&handle->gpio_pending_count, 0, __ATOMIC_RELAXED);
+
+	handle->gpio_cache_valid = 0;
+
+	mcp2221_state_unlock(handle);
+
+	mcp2221_command_set_gpio_output(cmd, &gpio[0], &gpio[1], &gpio[2], &gpio[3]);
+
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret == STATUS_OK && buf[0] != 0x50) {
+		ret = STATUS_IO_ERROR;
 	}
 
-#ifdef ENABLE_DEBUG
-	printf("----- send begin -----\n");
-	for (int i = 0 ; i < length ; i++) {
-		printf("0x%02x ", data[i]);
-		if (i % 16 == 15) {
-			printf("\n");
+	int all = ret;
+
+	for (int i = 0 ; i < count ; i++) {
+		int status = ret;
+
+		if (status == STATUS_OK) {
+			status = mcp2221_check_gpio_output_fields(cmd, buf, writes[i].value_mask, writes[i].direction_mask);
+		}
+		if (writes[i].status != NULL) {
+			// read by the thread which queued the write
+			__atomic_store_n(writes[i].status, status, __ATOMIC_RELEASE);
+		}
+		if (status != STATUS_OK) {
+			all = STATUS_IO_ERROR;
 		}
 	}
-	printf("----- send end -----\n");
-#endif
 
-	const int send_size = 64 + 1;
-	uint8_t send_data[send_size] = {0};
-	memcpy(send_data + 1, data, length);
+	mcp2221_state_lock(handle);
 
-	if (hid_write(dev, send_data, send_size) != send_size) {
-		printf("[ERROR] hid_write error.\n");
-		return STATUS_IO_ERROR;
+	if (all == STATUS_OK) {
+		mcp2221_update_gpio_shadow(handle, gpio);
+	} else {
+		handle->setting_valid = 0;
 	}
 
-	return STATUS_OK;
+	mcp2221_state_unlock(handle);
+
+	return all;
 }
 
-int mcp2221_lowlevel_recv(hid_device *dev, uint8_t *data, int length) {
-	if (length < 0 || 64 < length) {
-		return STATUS_ARGUMENT_ERROR;
-	}
-	if (data == NULL) {
-		return STATUS_ARGUMENT_ERROR;
+// Send the queued gpio writes with one report.
+// The batches reach the device in the order they were taken off the queue : gpio_flush_lock is
+// held until the report is answered, a newer batch waits for it. When this returns, every write
+// queued before the call has its result.
+// @return STATUS_OK if every queued write was applied
+int mcp2221_flush_gpio(MCP2221Handle *handle) {
+	if (gpio_flushing == handle) {
+		// the report of the batch being sent, a newer batch stays queued for the next flush
+		return STATUS_OK;
 	}
 
-	const int recv_size = 64;
-	uint8_t recv_data[recv_size] = {0};
-
-	if (hid_read_timeout(dev, recv_data, recv_size, READ_TIMEOUT_MS) != recv_size) {
-		printf("[ERROR] hid_read_timeout error.\n");
-		return STATUS_IO_ERROR;
-	}
+	mcp2221_sleep_lock(&handle->gpio_flush_lock);
+	gpio_flushing = handle;
 
-	memcpy(data, recv_data, length);
+	int ret = mcp2221_flush_gpio_locked(handle);
 
-#ifdef ENABLE_DEBUG
-	printf("----- recv begin -----\n");
-	for (int i = 0 ; i < length ; i++) {
-		printf("0x%02x ", data[i]);
-		if (i % 16 == 15) {
-			printf("\n");
-		}
-	}
-	printf("----- recv end -----\n");
-#endif
+	gpio_flushing = NULL;
+	mcp2221_sleep_unlock(&handle->gpio_flush_lock);
 
-	return STATUS_OK;
+	return ret;
 }
 
-int mcp2221_lowlevel_init(hid_device **dev) {
-	int ret;
+// Send the queued writes if their deadline has passed.
+// @param next_us time until the next deadline, -1 if nothing is queued (may be NULL)
+int mcp2221_poll_gpio(MCP2221Handle *handle, int *next_us) {
+	int ret = STATUS_OK;
 
-	*dev = NULL;
+	mcp2221_state_lock(handle);
 
-	ret = hid_init();
-	if (ret != 0) {
-		printf("[ERROR] hid_init error.\n");
-		return STATUS_IO_ERROR;
+	int      count       = handle->gpio_pending_count;
+	uint64_t deadline_us = handle->gpio_pending_deadline_us;
+
+	mcp2221_state_unlock(handle);
+
+	if (count > 0) {
+		uint64_t now = mcp2221_get_time_us();
+
+		if (deadline_us <= now) {
+			ret = mcp2221_flush_gpio(handle);
+		} else if (next_us != NULL) {
+			*next_us = deadline_us - now;
+			return STATUS_OK;
+		}
 	}
 
-	*dev = hid_open(0x04d8, 0x00dd, NULL);
-	if (dev == NULL) {
-		printf("[ERROR] hid_open error.\n");
-		return STATUS_IO_ERROR;
+	if (next_us != NULL) {
+		*next_us = -1;
 	}
 
-	return STATUS_OK;
+	return ret;
 }
 
-int mcp2221_lowlevel_destroy(hid_device *dev) {
-	int ret;
-
-	hid_close(dev);
+// ----- interrupt on change -----
+// GP1 set to GP1_FUNC_INT latches the selected edges into a flag of the status report.
+// The flag holds one edge : the edges until it is cleared are merged into it.
 
-	ret = hid_exit();
-	if (ret != 0) {
-		printf("hid_exit error.\n");
-		return STATUS_IO_ERROR;
+// Select the detected edges (InterruptEdge) and clear the flag.
+int mcp2221_set_interrupt_edge(MCP2221Handle *handle, int edge) {
+	if (edge < 0 || INTERRUPT_EDGE_BOTH < edge) {
+		return STATUS_ARGUMENT_ERROR;
 	}
 
-	return STATUS_OK;
-}
+	mcp2221::Report report;
 
-// ----- command api -----
+	mcp2221::encode_set_interrupt(report.command(), 1, edge, 1);
 
-// Set GPIO Output Values
-// @param cmd cmd needed to allocate 64byte
-void mcp2221_command_set_gpio_output(uint8_t cmd[64], GPIOSetting *gp0, GPIOSetting *gp1, GPIOSetting *gp2, GPIOSetting *gp3) {
-	memset(cmd, 0, 64);
+	return mcp2221_issue_set_sram(handle, report.wire);
+}
 
-	cmd[0] = 0x50;
+// Read the flag without clearing it (one status report, nothing else is altered).
+int mcp2221_get_interrupt(MCP2221Handle *handle, int *latched) {
+	mcp2221::Report report;
+	uint8_t buf[64];
 
-	if (gp0 != NULL) {
-		cmd[2] = gp0->enable_value;
-		cmd[3] = gp0->value;
-		cmd[4] = gp0->enable_direction;
-		cmd[5] = gp0->direction;
-	}
+	mcp2221::encode_status(report.command(), 0, 0);
 
-	if (gp1 != NULL) {
-		cmd[6] = gp1->enable_value;
-		cmd[7] = gp1->value;
-		cmd[8] = gp1->enable_direction;
-		cmd[9] = gp1->direction;
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		return ret;
 	}
 
-	if (gp2 != NULL) {
-		cmd[10] = gp2->enable_value;
-		cmd[11] = gp2->value;
-		cmd[12] = gp2->enable_direction;
-		cmd[13] = gp2->direction;
-	}
+	mcp2221::StatusView view(buf);
 
-	if (gp3 != NULL) {
-		cmd[14] = gp3->enable_value;
-		cmd[15] = gp3->value;
-		cmd[16] = gp3->enable_direction;
-		cmd[17] = gp3->direction;
+	if (!view.ok()) {
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+		return STATUS_IO_ERROR;
 	}
-}
 
-// Get GPIO Values
-void mcp2221_command_get_gpio_input(uint8_t cmd[64]) {
-	memset(cmd, 0, 64);
+	*latched = view.interrupt() != 0;
 
-	cmd[0] = 0x51;
+	return STATUS_OK;
 }
 
-// Set SRAM settings
-void mcp2221_command_set_sram_settings(uint8_t cmd[64], SRAMSetting *setting) {
-	memset(cmd, 0, 64);
+// Clear the flag, the edge detection is kept.
+int mcp2221_clear_interrupt(MCP2221Handle *handle) {
+	mcp2221::Report report;
 
-	cmd[0]  = 0x60;
+	mcp2221::encode_set_interrupt(report.command(), 0, 0, 1);
 
-	cmd[1]  = 0;
-	cmd[2]  = 0;	// won't be altered
-	cmd[3]  = 0;	// won't be altered
-	cmd[4]  = 0;	// won't be altered
-	cmd[5]  = 0;	// won't be altered
-	cmd[6]  = 0;	// won't be altered
-	cmd[7]  = (setting->enable_gpio_config & 0x1) << 7;
-	cmd[8]  = (setting->gpn_func[0] & 0x7) | ((setting->gpn_gpio_direction[0] & 0x1) << 3) | ((setting->gpn_gpio_value[0] & 0x1) << 4);
-	cmd[9]  = (setting->gpn_func[1] & 0x7) | ((setting->gpn_gpio_direction[1] & 0x1) << 3) | ((setting->gpn_gpio_value[1] & 0x1) << 4);
-	cmd[10] = (setting->gpn_func[2] & 0x7) | ((setting->gpn_gpio_direction[2] & 0x1) << 3) | ((setting->gpn_gpio_value[2] & 0x1) << 4);
-	cmd[11] = (setting->gpn_func[3] & 0x7) | ((setting->gpn_gpio_direction[3] & 0x1) << 3) | ((setting->gpn_gpio_value[3] & 0x1) << 4);
+	return mcp2221_issue_set_sram(handle, report.wire);
 }
 
-// Get SRAM settings
-void mcp2221_command_get_sram_setting(uint8_t cmd[64]) {
-	memset(cmd, 0, 64);
+// Wait for a latched edge and clear it.
+// The flag is polled with the status report every interval_us (1000 : one full speed frame).
+// An edge after the clear is latched again, it is never lost. Edges between the poll which saw
+// the flag and the clear are merged into the returned event.
+// @param timeout_ms < 0 : wait forever
+// @return STATUS_OK on an edge, STATUS_TIMEOUT
+int mcp2221_wait_interrupt(MCP2221Handle *handle, int timeout_ms, int interval_us) {
+	int latched;
 
-	cmd[0]  = 0x61;
-}
+	if (interval_us <= 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
 
-// ----- high layaer api -----
-int mcp2221_issue_command(MCP2221Handle *handle, uint8_t send_cmd[64], uint8_t recv_buf[64]) {
-	int ret;
+	uint64_t start = mcp2221_get_time_us();
+	uint64_t next  = start;
+
+	for (;;) {
+		if (mcp2221_get_interrupt(handle, &latched) != STATUS_OK) {
+			return STATUS_IO_ERROR;
+		}
 
-	ret = mcp2221_lowlevel_send(handle->dev, send_cmd, 64);
-	if (ret != STATUS_OK) return STATUS_IO_ERROR;
+		if (latched) {
+			return mcp2221_clear_interrupt(handle);
+		}
 
-	ret = mcp2221_lowlevel_recv(handle->dev, recv_buf, 64);
-	if (ret != STATUS_OK) return STATUS_IO_ERROR;
+		next += interval_us;
 
-	return STATUS_OK;
+		if (timeout_ms >= 0 && start + (uint64_t)timeout_ms * 1000 <= next) {
+			return STATUS_TIMEOUT;
+		}
+
+		struct timespec ts;
+		ts.tv_sec  = next / 1000000;
+		ts.tv_nsec = (next % 1000000) * 1000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
 }
 
-/*
-int mcp2221_setup_port_func(MCP2221Handle *handle, int port, int func) {
-	if (port < 0 || 4 < port) {
+// Set output values of the ports selected by mask.
+// bit n of values is the value of GPn.
+int mcp2221_set_gpio_values(MCP2221Handle *handle, int mask, int values) {
+	GPIOSetting gpio[4];
+
+	if (mask & ~GPIO_PORT_MASK_ALL) {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	if (port == 0 && (func < 0 || GP0_FUNC_MAX <= func)) {
-		return STATUS_ARGUMENT_ERROR;
+	memset(gpio, 0, sizeof(gpio));
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if (mask & GPIO_PORT_MASK(i)) {
+			gpio[i].enable_value = 1;
+			gpio[i].value        = (values & GPIO_PORT_MASK(i)) ? GPIO_VALUE_H : GPIO_VALUE_L;
+		}
 	}
 
-	if (port == 1 && (func < 0 || GP1_FUNC_MAX <= func)) {
+	return mcp2221_set_gpio_output(handle, gpio);
+}
+
+// Set directions of the ports selected by mask.
+// bit n of dirs is the direction of GPn (1 : input, 0 : output).
+int mcp2221_set_gpio_directions(MCP2221Handle *handle, int mask, int dirs) {
+	GPIOSetting gpio[4];
+
+	if (mask & ~GPIO_PORT_MASK_ALL) {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	if (port == 2 && (func < 0 || GP2_FUNC_MAX <= func)) {
-		return STATUS_ARGUMENT_ERROR;
+	memset(gpio, 0, sizeof(gpio));
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if (mask & GPIO_PORT_MASK(i)) {
+			gpio[i].enable_direction = 1;
+			gpio[i].direction        = (dirs & GPIO_PORT_MASK(i)) ? GPIO_DIR_IN : GPIO_DIR_OUT;
+		}
 	}
 
-	if (port == 3 && (func < 0 || GP3_FUNC_MAX <= func)) {
+	return mcp2221_set_gpio_output(handle, gpio);
+}
+
+int mcp2221_set_gpio_direction(MCP2221Handle *handle, int port, GPIODirection dir) {
+	GPIOSetting gpio[4];
+
+	if (port < 0 || 4 <= port) {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	handle->setting.gpn_func[port] = func;
+	memset(gpio, 0, sizeof(gpio));
 
-	return STATUS_OK;
+	gpio[port].enable_direction = 1;
+	gpio[port].direction        = dir;
+
+	return mcp2221_set_gpio_output(handle, gpio);
 }
 
-int mcp2221_setup_initial_gpio_setting(MCP2221Handle *handle, int port, GPIOSetting *setting) {
-	if (port < 0 || 4 < port) {
+int mcp2221_get_gpio_direction(MCP2221Handle *handle, int port, GPIODirection *dir) {
+	GPIOSnapshot snapshot;
+
+	if (port < 0 || 4 <= port) {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	if (mcp2221_validate_gpio_setting(setting) != STATUS_OK) {
-		return STATUS_ARGUMENT_ERROR;
+	if (mcp2221_get_gpio_snapshot_cached(handle, &snapshot) != STATUS_OK) {
+		return STATUS_IO_ERROR;
 	}
 
-	handle->setting.gpn_gpio[port].enable_value     = setting->enable_value;
-	handle->setting.gpn_gpio[port].value            = setting->value;
-	handle->setting.gpn_gpio[port].enable_direction = setting->enable_direction;
-	handle->setting.gpn_gpio[port].direction        = setting->direction;
+	*dir = snapshot.direction[port];
 
 	return STATUS_OK;
 }
-*/
 
-int mcp2221_write_flash_setting(MCP2221Handle *handle) {
+int mcp2221_set_gpio_value(MCP2221Handle *handle, int port, GPIOValue value) {
+	GPIOSetting gpio[4];
 
-	return STATUS_OK;
-}
+	if (port < 0 || 4 <= port) {
+		return STATUS_ARGUMENT_ERROR;
+	}
 
-int mcp2221_read_flash_setting(MCP2221Handle *handle) {
+	memset(gpio, 0, sizeof(gpio));
 
-	return STATUS_OK;
-}
+	gpio[port].enable_value = 1;
+	gpio[port].value        = value;
 
-int mcp2221_write_sram_setting(MCP2221Handle *handle, SRAMSetting *setting) {
-	int ret;
-	uint8_t cmd[64];
-	uint8_t buf[64];
+	return mcp2221_set_gpio_output(handle, gpio);
+}
 
-	mcp2221_command_set_sram_settings(cmd, setting);
+int mcp2221_get_gpio_value(MCP2221Handle *handle, int port, GPIOValue *value) {
+	GPIOSnapshot snapshot;
 
-	if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK) {
-		return STATUS_IO_ERROR;
+	if (port < 0 || 4 <= port) {
+		return STATUS_ARGUMENT_ERROR;
 	}
 
-	if (buf[0] != 0x60 || buf[1] != 0) {
-		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+	if (mcp2221_get_gpio_snapshot_cached(handle, &snapshot) != STATUS_OK) {
 		return STATUS_IO_ERROR;
 	}
 
+	*value = snapshot.value[port];
+
 	return STATUS_OK;
 }
 
-int mcp2221_read_sram_setting(MCP2221Handle *handle, SRAMSetting *setting) {
-	int ret;
-	uint8_t cmd[64];
+// Read value and direction of all ports with one report.
+// The result is also stored to the gpio cache.
+int mcp2221_get_gpio_snapshot(MCP2221Handle *handle, GPIOSnapshot *snapshot) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
 	uint8_t buf[64];
 
-	mcp2221_command_get_sram_setting(cmd);
+	mcp2221_command_get_gpio_input(cmd);
 
-	if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK) {
-		return STATUS_IO_ERROR;
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		return ret;
 	}
 
-	if (buf[0] != 0x61 || buf[1] != 0) {
+	mcp2221::GpioInputView view(buf);
+
+	if (!view.ok()) {
 		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
 		return STATUS_IO_ERROR;
 	}
 
-	setting->gpn_func[0] = buf[22] & 0x7;
-	setting->gpn_func[1] = buf[23] & 0x7;
-	setting->gpn_func[2] = buf[24] & 0x7;
-	setting->gpn_func[3] = buf[25] & 0x7;
+	view.snapshot(snapshot);
 
-	setting->gpn_gpio_direction[0] = (buf[22] >> 3) & 0x1;
-	setting->gpn_gpio_direction[1] = (buf[23] >> 3) & 0x1;
-	setting->gpn_gpio_direction[2] = (buf[24] >> 3) & 0x1;
-	setting->gpn_gpio_direction[3] = (buf[25] >> 3) & 0x1;
-
-	setting->gpn_gpio_value[0] = (buf[22] >> 4) & 0x1;
-	setting->gpn_gpio_value[1] = (buf[23] >> 4) & 0x1;
-	setting->gpn_gpio_value[2] = (buf[24] >> 4) & 0x1;
-	setting->gpn_gpio_value[3] = (buf[25] >> 4) & 0x1;
+	mcp2221_state_lock(handle);
+	handle->gpio_cache         = *snapshot;
+	handle->gpio_cache_time_us = mcp2221_get_time_us();
+	handle->gpio_cache_valid   = 1;
+	mcp2221_state_unlock(handle);
 
 	return STATUS_OK;
 }
 
-int mcp2221_set_gpio_direction(MCP2221Handle *handle, int port, GPIODirection dir) {
-	int ret;
-	uint8_t cmd[64];
-	uint8_t buf[64];
-	GPIOSetting gpio;
-
-	gpio.enable_value     = 0;
-	gpio.value            = GPIO_VALUE_L;
-	gpio.enable_direction = 1;
-	gpio.direction        = dir;
-
-	if (mcp2221_validate_gpio_setting(&gpio) != STATUS_OK) {
+// Enable the gpio read cache.
+// The per-port getters reuse a snapshot younger than max_age_us.
+// max_age_us = 0 disables the cache.
+int mcp2221_set_gpio_cache(MCP2221Handle *handle, int max_age_us) {
+	if (max_age_us < 0) {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	switch (port) {
-		case 0:
-			mcp2221_command_set_gpio_output(cmd, &gpio, NULL, NULL, NULL);
-			break;
-		case 1:
-			mcp2221_command_set_gpio_output(cmd, NULL, &gpio, NULL, NULL);
-			break;
-		case 2:
-			mcp2221_command_set_gpio_output(cmd, NULL, NULL, &gpio, NULL);
-			break;
-		case 3:
-			mcp2221_command_set_gpio_output(cmd, NULL, NULL, NULL, &gpio);
-			break;
-		default:
-			return STATUS_ARGUMENT_ERROR;
-	}
-
-	if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK) {
-		return STATUS_IO_ERROR;
-	}
-
-	// check return value
-	if (buf[0] != 0x50) {
-		return STATUS_IO_ERROR;
-	}
-
-	for (int i = 0 ; i < 4 ; i++) {
-		if (i == port) {
-			if (
-					buf[4 * i + 4] != cmd[4 * i + 4] ||
-					buf[4 * i + 5] != cmd[4 * i + 5]
-			) {
-				return STATUS_IO_ERROR;
-			}
-		} else {
-			if (
-					buf[4 * i + 4] != 0xEE ||
-					buf[4 * i + 5] != 0xEE
-			) {
-				return STATUS_IO_ERROR;
-			}
-		}
-	}
+	handle->gpio_cache_max_age_us = max_age_us;
+	handle->gpio_cache_valid      = 0;
 
 	return STATUS_OK;
 }
 
-int mcp2221_get_gpio_direction(MCP2221Handle *handle, int port, GPIODirection *dir) {
-	int ret;
-	uint8_t cmd[64];
-	uint8_t buf[64];
+void mcp2221_invalidate_gpio_cache(MCP2221Handle *handle) {
+	mcp2221_state_lock(handle);
+	handle->gpio_cache_valid = 0;
+	mcp2221_state_unlock(handle);
+}
 
-	if (port < 0 || 4 <= port) {
+// List the connected devices.
+// @param count number of devices stored (at most max)
+int mcp2221_enumerate(MCP2221DeviceInfo *devices, int max, int *count) {
+	if (devices == NULL || max < 0 || count == NULL) {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	mcp2221_command_get_gpio_input(cmd);
-
-	if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK) {
+	if (mcp2221_hid_acquire() != STATUS_OK) {
 		return STATUS_IO_ERROR;
 	}
 
-	if (buf[0] != 0x51 || buf[1] != 0) {
-		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
-		return STATUS_IO_ERROR;
-	}
+	struct hid_device_info *devs = hid_enumerate(0x04d8, 0x00dd);
+	int n = 0;
 
-	*dir = (GPIODirection)buf[3 + 2*port];
-	if (*dir == 0xEF) {
-		*dir = GPIO_DIR_MAX;
+	for (struct hid_device_info *cur = devs ; cur != NULL && n < max ; cur = cur->next) {
+		snprintf(devices[n].path, sizeof(devices[n].path), "%s", cur->path);
+		mcp2221_copy_serial(devices[n].serial, sizeof(devices[n].serial), cur->serial_number);
+		n++;
 	}
 
+	hid_free_enumeration(devs);
+	mcp2221_hid_release();
+
+	*count = n;
+
 	return STATUS_OK;
 }
 
-int mcp2221_set_gpio_value(MCP2221Handle *handle, int port, GPIOValue value) {
+static int mcp2221_init_transport(
+		MCP2221Handle *handle,
+		const MCP2221Transport *transport,
+		int (*send_report)(MCP2221Handle *handle, uint8_t report[65])
+) {
 	int ret;
-	uint8_t cmd[64];
-	uint8_t buf[64];
-	GPIOSetting gpio;
 
-	if (mcp2221_validate_gpio_setting(&gpio) != STATUS_OK) {
+	if (transport == NULL || transport->send == NULL || transport->recv == NULL) {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	gpio.enable_value     = 1;
-	gpio.value            = value;
-	gpio.enable_direction = 0;
-	gpio.direction        = GPIO_DIR_IN;
+	handle->dev         = NULL;
+	handle->transport   = *transport;
+	handle->send_report = send_report;
 
-	switch (port) {
-		case 0:
-			mcp2221_command_set_gpio_output(cmd, &gpio, NULL, NULL, NULL);
-			break;
-		case 1:
-			mcp2221_command_set_gpio_output(cmd, NULL, &gpio, NULL, NULL);
-			break;
-		case 2:
-			mcp2221_command_set_gpio_output(cmd, NULL, NULL, &gpio, NULL);
-			break;
-		case 3:
-			mcp2221_command_set_gpio_output(cmd, NULL, NULL, NULL, &gpio);
-			break;
-		default:
-			return STATUS_ARGUMENT_ERROR;
-	}
+	handle->gpio_cache_max_age_us = 0;
+	handle->gpio_cache_valid      = 0;
+	handle->gpio_cache_time_us    = 0;
 
-	if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK) {
-		return STATUS_IO_ERROR;
-	}
+	handle->gpio_coalesce_us   = 0;
+	handle->gpio_pending_count = 0;
+	handle->gpio_flush_lock    = 0;
+	handle->gpio_timer         = NULL;
 
-	// check return value
-	if (buf[0] != 0x50) {
-		return STATUS_IO_ERROR;
-	}
+	handle->setting_valid = 0;
 
-	for (int i = 0 ; i < 4 ; i++) {
-		if (i == port) {
-			if (
-					buf[4 * i + 2] != cmd[4 * i + 2] ||
-					buf[4 * i + 3] != cmd[4 * i + 3]
-			) {
-				return STATUS_IO_ERROR;
-			}
-		} else {
-			if (
-					buf[4 * i + 2] != 0xEE ||
-					buf[4 * i + 3] != 0xEE
-			) {
-				return STATUS_IO_ERROR;
-			}
+	handle->submit_head  = NULL;
+	handle->submit_owner = 0;
+	handle->state_lock   = 0;
+
+	handle->transaction_lock = 0;
+
+	handle->recv_timeout_ms      = READ_TIMEOUT_MS;
+	handle->retry_max            = 0;
+	handle->retry_backoff_us     = 0;
+	handle->retry_backoff_max_us = 0;
+
+	handle->drain_pending = 0;
+	memset(&handle->response_stats, 0, sizeof(handle->response_stats));
+
+	handle->async   = NULL;
+	handle->hotplug = NULL;
+
+	if (handle->transport.open != NULL) {
+		ret = handle->transport.open(handle->transport.context);
+
+		if (ret != STATUS_OK) {
+			printf("mcp2221_init error.\n");
+			return STATUS_IO_ERROR;
 		}
 	}
 
 	return STATUS_OK;
 }
 
-int mcp2221_get_gpio_value(MCP2221Handle *handle, int port, GPIOValue *value) {
-	int ret;
-	uint8_t cmd[64];
-	uint8_t buf[64];
+static int mcp2221_init_hid(MCP2221Handle *handle, const char *serial, const char *path) {
+	MCP2221Transport transport;
 
-	if (port < 0 || 4 <= port) {
+	transport.context = handle;
+	transport.open    = mcp2221_hid_open;
+	transport.close   = mcp2221_hid_close;
+	transport.send    = mcp2221_hid_send;
+	transport.recv    = mcp2221_hid_recv;
+
+	snprintf(handle->hid_serial, sizeof(handle->hid_serial), "%s", serial != NULL ? serial : "");
+	snprintf(handle->hid_path, sizeof(handle->hid_path), "%s", path != NULL ? path : "");
+
+	return mcp2221_init_transport(handle, &transport, mcp2221_hid_send_report);
+}
+
+// Open the first MCP2221 found by hidapi.
+int mcp2221_init(MCP2221Handle *handle) {
+	return mcp2221_init_hid(handle, NULL, NULL);
+}
+
+// Open the MCP2221 with the serial number.
+int mcp2221_init_by_serial(MCP2221Handle *handle, const char *serial) {
+	if (serial == NULL || serial[0] == '\0') {
 		return STATUS_ARGUMENT_ERROR;
 	}
 
-	mcp2221_command_get_gpio_input(cmd);
+	return mcp2221_init_hid(handle, serial, NULL);
+}
 
-	if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK) {
-		return STATUS_IO_ERROR;
+// Open the MCP2221 at the hidapi path (see mcp2221_enumerate).
+int mcp2221_init_by_path(MCP2221Handle *handle, const char *path) {
+	if (path == NULL || path[0] == '\0') {
+		return STATUS_ARGUMENT_ERROR;
 	}
 
-	if (buf[0] != 0x51 || buf[1] != 0) {
-		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
-		return STATUS_IO_ERROR;
-	}
+	return mcp2221_init_hid(handle, NULL, path);
+}
 
-	*value = (GPIOValue)buf[2 + port * 2];
-	if (*value == 0xEE) {
-		*value = GPIO_VALUE_MAX;
-	}
+// Open a device through another transport (e.g. the simulator).
+int mcp2221_init_with_transport(MCP2221Handle *handle, const MCP2221Transport *transport) {
+	handle->hid_path[0]   = '\0';
+	handle->hid_serial[0] = '\0';
 
-	return STATUS_OK;
+	return mcp2221_init_transport(handle, transport, NULL);
 }
 
-int mcp2221_init(MCP2221Handle *handle) {
+int mcp2221_destroy(MCP2221Handle *handle) {
 	int ret;
-	ret = mcp2221_lowlevel_init(&handle->dev);
 
-	if (ret < 0) {
-		printf("mcp2221_init error.\n");
-		return STATUS_IO_ERROR;
+	mcp2221_set_gpio_coalesce(handle, 0);
+
+	if (handle->async != NULL) {
+		mcp2221_async_stop(handle);
+	}
+	if (handle->hotplug != NULL) {
+		mcp2221_set_auto_reopen(handle, 0);
 	}
 
-	return STATUS_OK;
-}
+	if (handle->transport.close == NULL) {
+		return STATUS_OK;
+	}
 
-int mcp2221_destroy(MCP2221Handle *handle) {
-	int ret;
-	ret = mcp2221_lowlevel_destroy(handle->dev);
+	ret = handle->transport.close(handle->transport.context);
 
-	if (ret < 0) {
+	if (ret != STATUS_OK) {
 		printf("mcp2221_destroy error.\n");
 		return STATUS_IO_ERROR;
 	}
@@ -54,6 +54,22 @@ enum GP3Function {
 	GP3_FUNC_MAX,
 };
 
+// edge detection of GP1 (GP1_FUNC_INT), bit or
+enum InterruptEdge {
+	INTERRUPT_EDGE_NONE    = 0,
+	INTERRUPT_EDGE_RISING  = 1,
+	INTERRUPT_EDGE_FALLING = 2,
+	INTERRUPT_EDGE_BOTH    = 3,
+};
+
+enum ADCReference {
+	ADC_REF_VDD = 0,
+	ADC_REF_1024MV,
+	ADC_REF_2048MV,
+	ADC_REF_4096MV,
+	ADC_REF_MAX,
+};
+
 typedef struct _SRAMSetting {
 	// byte 2 : Clock output divider value
 	// not impl
@@ -65,10 +81,10 @@ typedef struct _SRAMSetting {
 	// not impl
 
 	// byte 5 : ADC voltage reference
-	// not impl
+	// not altered, see mcp2221_set_adc_reference (mcp2221_adc.h)
 
 	// byte 6 : Setup the interrupt
-	// not impl
+	// not altered, see mcp2221_set_interrupt_edge / mcp2221_clear_interrupt
 
 	// byte 7 : Alter GPIO configuration
 	int enable_gpio_config;
@@ -82,6 +98,26 @@ typedef struct _SRAMSetting {
 	int gpn_gpio_direction[4];
 } SRAMSetting;
 
+// Power-up configuration stored in flash.
+// The device loads it into SRAM at power-up. Fields which are not used must be 0.
+typedef struct _FlashSetting {
+	// chip settings
+	int enable_chip_setting;
+	int serial_enumeration;	// report the serial number to the host
+	int clock_output;	// GP1 clock output : duty cycle (bit 4:3) and divider (bit 2:0)
+	int dac_reference;	// ADCReference
+	int dac_value;		// 0 - 31
+	int adc_reference;	// ADCReference
+	int vid;		// read only
+	int pid;		// read only
+
+	// GP settings
+	int enable_gp_setting;
+	int gpn_func[4];
+	int gpn_gpio_value[4];
+	int gpn_gpio_direction[4];
+} FlashSetting;
+
 typedef struct _GPIOSetting {
 	int           enable_value;
 	GPIOValue     value;
@@ -89,23 +125,180 @@ typedef struct _GPIOSetting {
 	GPIODirection direction;
 } GPIOSetting;
 
+#define GPIO_COALESCE_MAX (16)
+
+// a write waiting in the coalescing queue of the handle
+typedef struct _GPIOPendingWrite {
+	int *status;	// may be NULL, owned by the caller of mcp2221_queue_gpio_output
+	int  value_mask;
+	int  direction_mask;
+} GPIOPendingWrite;
+
+// reports which did not answer the command waited for (see mcp2221_get_response_stats)
+typedef struct _MCP2221ResponseStats {
+	uint64_t recv_timeouts;	// responses which did not arrive in time
+	uint64_t mismatched;	// received while waiting for another command, dropped
+	uint64_t discarded;	// drained from the device queue before a command
+} MCP2221ResponseStats;
+
+typedef struct _GPIOSnapshot {
+	// GPIO_VALUE_MAX / GPIO_DIR_MAX if the port is not set for GPIO
+	GPIOValue     value[4];
+	GPIODirection direction[4];
+} GPIOSnapshot;
+
+// Transport of 64 byte reports.
+// Every function returns STATUS_OK or STATUS_IO_ERROR,
+// recv returns STATUS_RECV_TIMEOUT if nothing arrived within timeout_ms.
+typedef struct _MCP2221Transport {
+	void *context;
+
+	int (*open)(void *context);
+	int (*close)(void *context);
+	int (*send)(void *context, const uint8_t *data, int length);
+	int (*recv)(void *context, uint8_t *data, int length, int timeout_ms);
+} MCP2221Transport;
+
+typedef struct _MCP2221DeviceInfo {
+	char path[256];
+	char serial[64];	// "" if the device has no serial number
+} MCP2221DeviceInfo;
+
+typedef struct _MCP2221Async MCP2221Async;
+typedef struct _MCP2221GpioTimer MCP2221GpioTimer;
+typedef struct _MCP2221Hotplug MCP2221Hotplug;
+typedef struct _MCP2221Submission MCP2221Submission;
+
+// A handle may be shared by several threads once it is set up.
+// Commands are paired with their responses (see mcp2221_issue_command) and the state below is
+// guarded by state_lock. I2C transfers span several reports, they are serialized as a whole by
+// transaction_lock (a raw 0x90 - 0x94 / 0x40 command of mcp2221_issue_command is not).
+// Configuration calls (mcp2221_set_gpio_cache, mcp2221_set_gpio_coalesce, mcp2221_set_timeout,
+// mcp2221_set_retry, mcp2221_async_start / stop, mcp2221_set_auto_reopen) and mcp2221_destroy
+// must not run concurrently with other calls on the handle.
+
 typedef struct _MCP2221Handle {
 	hid_device *dev;
 
+	// identity of the opened device, used to reopen it
+	char hid_path[256];
+	char hid_serial[64];
+
+	MCP2221Transport transport;
+
+	// send a whole output report (report[0] is the report id) without copying it,
+	// set by the hidapi backend only (NULL : the report goes through transport.send)
+	int (*send_report)(struct _MCP2221Handle *handle, uint8_t report[65]);
+
+	// shadow of the SRAM / GPIO state of the device (valid if setting_valid)
+	// kept up to date by every write through this handle
 	SRAMSetting setting;
+	int         adc_reference;	// ADCReference
+	int         setting_valid;
+
+	// gpio read cache (disabled if gpio_cache_max_age_us is 0)
+	int          gpio_cache_max_age_us;
+	int          gpio_cache_valid;
+	uint64_t     gpio_cache_time_us;
+	GPIOSnapshot gpio_cache;
+
+	// gpio write coalescing (disabled if gpio_coalesce_us is 0)
+	int              gpio_coalesce_us;
+	uint64_t         gpio_pending_deadline_us;
+	GPIOSetting      gpio_pending[4];
+	GPIOPendingWrite gpio_pending_writes[GPIO_COALESCE_MAX];
+	int              gpio_pending_count;
+	int              gpio_flush_lock;	// held from taking a batch off the queue to its results
+	MCP2221GpioTimer *gpio_timer;		// sends the queued writes at their deadline
+
+	// commands of the blocking api while no pipeline runs
+	MCP2221Submission *submit_head;		// lock-free stack, newest first
+	int                submit_owner;	// a caller is sending the queued commands
+
+	// spin lock of the shadow, the gpio cache and the coalescing queue
+	int state_lock;
+
+	// held for a whole I2C transfer, 0 free, 1 held, 2 held with sleeping waiters
+	int transaction_lock;
+
+	// deadlines and retries of the commands
+	int recv_timeout_ms;
+	int retry_max;
+	int retry_backoff_us;
+	int retry_backoff_max_us;
+
+	// response correlation, a late response may still be queued if drain_pending
+	int                  drain_pending;
+	MCP2221ResponseStats response_stats;
+
+	// command pipeline (NULL if not started, see mcp2221_async.h)
+	MCP2221Async *async;
+
+	// hotplug reopen (NULL if disabled, see mcp2221_hotplug.h)
+	MCP2221Hotplug *hotplug;
 } MCP2221Handle;
 
 #define STATUS_OK (0)
 #define STATUS_IO_ERROR (1)
 #define STATUS_ARGUMENT_ERROR (2)
+#define STATUS_I2C_NACK (3)
+#define STATUS_TIMEOUT (4)
+#define STATUS_PENDING (5)
+#define STATUS_SEND_TIMEOUT (6)	// the deadline passed before the command was sent
+#define STATUS_RECV_TIMEOUT (7)	// the command was sent, its response did not arrive in time
+
+// flash sections (sub-command of 0xB0 / 0xB1)
+#define FLASH_CHIP_SETTINGS (0x00)
+#define FLASH_GP_SETTINGS   (0x01)
+
+#define GPIO_PORT_MASK(port) (1 << (port))
+#define GPIO_PORT_MASK_ALL   (0xF)
+
+// command api : build a 64 byte report
+void mcp2221_command_set_gpio_output(uint8_t cmd[64], GPIOSetting *gp0, GPIOSetting *gp1, GPIOSetting *gp2, GPIOSetting *gp3);
+void mcp2221_command_get_gpio_input(uint8_t cmd[64]);
+void mcp2221_command_set_sram_settings(uint8_t cmd[64], SRAMSetting *setting);
+void mcp2221_command_get_sram_setting(uint8_t cmd[64]);
+void mcp2221_command_read_flash_data(uint8_t cmd[64], int section);
+void mcp2221_command_write_flash_data(uint8_t cmd[64], int section, const uint8_t *data, int length);
+int mcp2221_issue_command(MCP2221Handle *handle, uint8_t send_cmd[64], uint8_t recv_buf[64]);
+int mcp2221_issue_report(MCP2221Handle *handle, uint8_t report[65], uint8_t recv_buf[64]);
+int mcp2221_set_timeout(MCP2221Handle *handle, int recv_timeout_ms);
+int mcp2221_set_retry(MCP2221Handle *handle, int retries, int backoff_us, int backoff_max_us);
+uint64_t mcp2221_begin_budget(int budget_us);
+void mcp2221_end_budget(uint64_t token);
+int64_t mcp2221_budget_remaining_us();
+void mcp2221_get_response_stats(MCP2221Handle *handle, MCP2221ResponseStats *stats);
 
 int mcp2221_write_sram_setting(MCP2221Handle *handle, SRAMSetting *setting);
 int mcp2221_read_sram_setting(MCP2221Handle *handle, SRAMSetting *setting);
+int mcp2221_apply_setting(MCP2221Handle *handle, SRAMSetting *target);
+int mcp2221_read_flash_setting(MCP2221Handle *handle, FlashSetting *setting);
+int mcp2221_write_flash_setting(MCP2221Handle *handle, FlashSetting *setting);
+void mcp2221_invalidate_setting(MCP2221Handle *handle);
 int mcp2221_set_gpio_direction(MCP2221Handle *handle, int port, GPIODirection dir);
 int mcp2221_get_gpio_direction(MCP2221Handle *handle, int port , GPIODirection *dir);
 int mcp2221_set_gpio_value(MCP2221Handle *handle, int port, GPIOValue value);
 int mcp2221_get_gpio_value(MCP2221Handle *handle, int port, GPIOValue *value);
+int mcp2221_set_gpio_output(MCP2221Handle *handle, GPIOSetting gpio[4]);
+int mcp2221_set_gpio_values(MCP2221Handle *handle, int mask, int values);
+int mcp2221_set_gpio_directions(MCP2221Handle *handle, int mask, int dirs);
+int mcp2221_get_gpio_snapshot(MCP2221Handle *handle, GPIOSnapshot *snapshot);
+int mcp2221_set_gpio_cache(MCP2221Handle *handle, int max_age_us);
+void mcp2221_invalidate_gpio_cache(MCP2221Handle *handle);
+int mcp2221_set_gpio_coalesce(MCP2221Handle *handle, int window_us);
+int mcp2221_queue_gpio_output(MCP2221Handle *handle, GPIOSetting gpio[4], int *status);
+int mcp2221_flush_gpio(MCP2221Handle *handle);
+int mcp2221_poll_gpio(MCP2221Handle *handle, int *next_us);
+int mcp2221_set_interrupt_edge(MCP2221Handle *handle, int edge);
+int mcp2221_get_interrupt(MCP2221Handle *handle, int *latched);
+int mcp2221_clear_interrupt(MCP2221Handle *handle);
+int mcp2221_wait_interrupt(MCP2221Handle *handle, int timeout_ms, int interval_us);
+int mcp2221_enumerate(MCP2221DeviceInfo *devices, int max, int *count);
 int mcp2221_init(MCP2221Handle *handle);
+int mcp2221_init_by_serial(MCP2221Handle *handle, const char *serial);
+int mcp2221_init_by_path(MCP2221Handle *handle, const char *path);
+int mcp2221_init_with_transport(MCP2221Handle *handle, const MCP2221Transport *transport);
 int mcp2221_destroy(MCP2221Handle *handle);
 
 #ifdef __cplusplus
@@ -0,0 +1,658 @@
+#ifndef __MCP2221_HPP__
+#define __MCP2221_HPP__
+
+// C++ layer (header only)
+//
+// Commands are encoded in place into the report which goes to the wire and responses are
+// read through typed views over the receive buffer. Nothing is copied or allocated per command.
+// The C api is implemented with the same encoders and views.
+
+#include <string.h>
+#include <stdint.h>
+
+#include <new>
+
+#include "mcp2221.h"
+
+namespace mcp2221 {
+
+// Output report as written to hidapi. wire[0] is the report id, the command follows.
+struct Report {
+	alignas(16) uint8_t wire[65];
+
+	uint8_t *command() {
+		return wire + 1;
+	}
+};
+
+// ----- layout : the fields of every command and response -----
+//
+// A field is a bit range of one byte, or a little endian word, at a fixed offset of the report.
+// Fields repeated per port / channel have a stride and are indexed at run time, the offset is
+// then a multiply-add. The encoders and views below read and write reports only through these
+// descriptions, each access is a masked load or store.
+
+// bits [Shift, Shift + Width) of byte Byte + Stride * index
+template <int Byte, int Shift = 0, int Width = 8, int Stride = 0>
+struct Field {
+	static_assert(0 <= Byte && Byte + 3 * Stride < 64, "field outside of the report");
+	static_assert(0 <= Shift && 0 < Width && Shift + Width <= 8, "field outside of its byte");
+
+	static constexpr uint8_t mask = ((1 << Width) - 1) << Shift;
+
+	static constexpr int byte(int index = 0) {
+		return Byte + Stride * index;
+	}
+
+	static constexpr uint8_t encode(int value) {
+		return (uint8_t)((value << Shift) & mask);
+	}
+
+	static constexpr int decode(uint8_t b) {
+		return (b & mask) >> Shift;
+	}
+
+	static constexpr int get(const uint8_t *buf, int index = 0) {
+		return decode(buf[byte(index)]);
+	}
+
+	// the other bits of the byte are kept
+	static constexpr void set(uint8_t *buf, int value, int index = 0) {
+		buf[byte(index)] = (buf[byte(index)] & ~mask) | encode(value);
+	}
+};
+
+// Width bits of the little endian word at Byte + Stride * index
+template <int Byte, int Width = 16, int Stride = 0>
+struct Word {
+	static_assert(0 <= Byte && Byte + 1 + 3 * Stride < 64, "field outside of the report");
+	static_assert(8 < Width && Width <= 16, "not a word");
+
+	static constexpr int mask = (1 << Width) - 1;
+
+	static constexpr int byte(int index = 0) {
+		return Byte + Stride * index;
+	}
+
+	static constexpr int get(const uint8_t *buf, int index = 0) {
+		return (buf[byte(index)] | (buf[byte(index) + 1] << 8)) & mask;
+	}
+
+	static constexpr void set(uint8_t *buf, int value, int index = 0) {
+		buf[byte(index)]     = value & 0xFF;
+		buf[byte(index) + 1] = (value >> 8) & (mask >> 8);
+	}
+};
+
+namespace layout {
+
+// every report
+typedef Field<0> Code;		// command code, echoed in the response
+typedef Field<1> Result;	// response : 0 success
+
+// Status / Set Parameters (0x10)
+struct Status {
+	static constexpr uint8_t code = 0x10;
+
+	// command
+	typedef Field<2, 4, 1> Cancel;		// cancel the current I2C transfer
+	typedef Field<3, 5, 1> SetSpeed;	// load SpeedDivider
+	typedef Field<4>       SpeedDivider;
+
+	// response
+	typedef Field<2>          CancelStatus;
+	typedef Field<3>          SpeedStatus;
+	typedef Field<8>          I2CState;
+	typedef Word<9>           RequestedLength;
+	typedef Word<11>          TransferredLength;
+	typedef Field<14>         CurrentDivider;
+	typedef Field<16, 1, 7>   I2CAddress;
+	typedef Field<20, 6, 1>   AddressNack;
+	typedef Field<22>         SCL;
+	typedef Field<23>         SDA;
+	typedef Field<24>         Interrupt;	// edge latched on GP1
+	typedef Field<25>         ReadPending;
+	typedef Word<50, 10, 2>   Adc;		// ADC1 - ADC3
+
+	static constexpr uint8_t speed_applied = 0x20;
+};
+
+// Set GPIO Output Values (0x50), the response echoes the command
+struct SetGpioOutput {
+	static constexpr uint8_t code = 0x50;
+
+	typedef Field<2, 0, 8, 4> AlterValue;
+	typedef Field<3, 0, 8, 4> Value;
+	typedef Field<4, 0, 8, 4> AlterDirection;
+	typedef Field<5, 0, 8, 4> Direction;
+
+	// echoed for the fields of a port which were not altered
+	static constexpr uint8_t not_altered = 0xEE;
+};
+
+// Get GPIO Values (0x51)
+struct GetGpioValues {
+	static constexpr uint8_t code = 0x51;
+
+	typedef Field<2, 0, 8, 2> Value;
+	typedef Field<3, 0, 8, 2> Direction;
+
+	// the port is not set for GPIO
+	static constexpr uint8_t not_gpio_value     = 0xEE;
+	static constexpr uint8_t not_gpio_direction = 0xEF;
+};
+
+// GP designation byte, the same in Set / Get SRAM Settings and in the flash GP settings
+template <int Byte>
+struct GpDesignation {
+	typedef Field<Byte, 0, 3, 1> Func;
+	typedef Field<Byte, 3, 1, 1> Direction;
+	typedef Field<Byte, 4, 1, 1> Value;
+};
+
+// Set SRAM Settings (0x60)
+struct SetSram {
+	static constexpr uint8_t code = 0x60;
+
+	typedef Field<5, 7, 1> AlterAdcReference;
+	typedef Field<5, 1, 2> AdcReference;
+	typedef Field<5, 0, 1> AdcReferenceVrm;		// 0 : Vdd
+
+	typedef Field<6, 7, 1> AlterInterrupt;
+	typedef Field<6, 4, 1> AlterRising;
+	typedef Field<6, 3, 1> Rising;
+	typedef Field<6, 2, 1> AlterFalling;
+	typedef Field<6, 1, 1> Falling;
+	typedef Field<6, 0, 1> ClearInterrupt;
+
+	typedef Field<7, 7, 1> AlterGpio;
+	typedef GpDesignation<8> Gp;
+};
+
+// Get SRAM Settings (0x61)
+struct GetSram {
+	static constexpr uint8_t code = 0x61;
+
+	// chip settings 3 (byte 8 is the VID)
+	typedef Field<7, 3, 2> AdcReference;
+	typedef Field<7, 2, 1> AdcReferenceVrm;
+	typedef GpDesignation<22> Gp;
+};
+
+// Read Flash Data (0xB0)
+struct ReadFlash {
+	static constexpr uint8_t code = 0xB0;
+
+	typedef Field<1> Section;
+
+	static constexpr int data = 4;	// response : the section as stored
+};
+
+// Write Flash Data (0xB1)
+struct WriteFlash {
+	static constexpr uint8_t code = 0xB1;
+
+	typedef Field<1> Section;
+
+	static constexpr int data = 2;
+};
+
+// flash chip settings section (offsets into the data of the section)
+struct FlashChip {
+	typedef Field<0, 7, 1> SerialEnumeration;
+	typedef Field<1, 0, 5> ClockOutput;
+	typedef Field<2, 6, 2> DacReference;
+	typedef Field<2, 5, 1> DacReferenceVrm;
+	typedef Field<2, 0, 5> DacValue;
+	typedef Field<3, 3, 2> AdcReference;
+	typedef Field<3, 2, 1> AdcReferenceVrm;
+	typedef Word<4>        Vid;
+	typedef Word<6>        Pid;
+};
+
+// flash GP settings section
+typedef GpDesignation<0> FlashGp;
+
+// I2C Write / Read Data (0x90 - 0x94)
+struct I2CTransfer {
+	typedef Word<1>        Length;	// of the whole transfer
+	typedef Field<3, 1, 7> Address;
+	typedef Field<3, 0, 1> Read;
+
+	static constexpr int data = 4;	// write data
+};
+
+// Get I2C Data (0x40)
+struct I2CGetData {
+	static constexpr uint8_t code = 0x40;
+
+	typedef Field<2> State;
+	typedef Field<3> Length;	// I2C_READ_ERROR if the read failed
+
+	static constexpr int data = 4;
+};
+
+} // namespace layout
+
+// ----- encoders : build the command in cmd (64 bytes) -----
+// constexpr, the layout tests run them at compile time
+
+constexpr void clear_report(uint8_t *cmd) {
+	for (int i = 0 ; i < 64 ; i++) {
+		cmd[i] = 0;
+	}
+}
+constexpr void encode_set_gpio_output(uint8_t *cmd, const GPIOSetting *gp0, const GPIOSetting *gp1, const GPIOSetting *gp2, const GPIOSetting *gp3) {
+	const GPIOSetting *gp[4] = { gp0, gp1, gp2, gp3 };
+
+	typedef layout::SetGpioOutput L;
+
+	clear_report(cmd);
+
+	layout::Code::set(cmd, L::code);
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if (gp[i] != NULL) {
+			L::AlterValue::set(cmd, gp[i]->enable_value, i);
+			L::Value::set(cmd, gp[i]->value, i);
+			L::AlterDirection::set(cmd, gp[i]->enable_direction, i);
+			L::Direction::set(cmd, gp[i]->direction, i);
+		}
+	}
+}
+
+constexpr void encode_get_gpio_input(uint8_t *cmd) {
+	clear_report(cmd);
+
+	layout::Code::set(cmd, layout::GetGpioValues::code);
+}
+
+constexpr void encode_set_sram_settings(uint8_t *cmd, const SRAMSetting *setting) {
+	typedef layout::SetSram L;
+
+	clear_report(cmd);
+
+	layout::Code::set(cmd, L::code);
+
+	// bytes 2 - 6 : won't be altered (see encode_set_adc_reference, encode_set_interrupt)
+
+	L::AlterGpio::set(cmd, setting->enable_gpio_config);
+
+	for (int i = 0 ; i < 4 ; i++) {
+		L::Gp::Func::set(cmd, setting->gpn_func[i], i);
+		L::Gp::Direction::set(cmd, setting->gpn_gpio_direction[i], i);
+		L::Gp::Value::set(cmd, setting->gpn_gpio_value[i], i);
+	}
+}
+
+// 0x60 altering only the ADC voltage reference (ADCReference)
+constexpr void encode_set_adc_reference(uint8_t *cmd, int reference) {
+	typedef layout::SetSram L;
+
+	clear_report(cmd);
+
+	layout::Code::set(cmd, L::code);
+
+	L::AlterAdcReference::set(cmd, 1);
+	L::AdcReference::set(cmd, reference);
+	L::AdcReferenceVrm::set(cmd, reference != ADC_REF_VDD);
+}
+
+// 0x60 altering only the interrupt of GP1
+// the edge detection (InterruptEdge) is altered only if alter_edge, a clear alone leaves it as it is
+constexpr void encode_set_interrupt(uint8_t *cmd, int alter_edge, int edge, int clear) {
+	typedef layout::SetSram L;
+
+	clear_report(cmd);
+
+	layout::Code::set(cmd, L::code);
+
+	L::AlterInterrupt::set(cmd, 1);
+	L::AlterRising::set(cmd, alter_edge);
+	L::Rising::set(cmd, alter_edge & edge);
+	L::AlterFalling::set(cmd, alter_edge);
+	L::Falling::set(cmd, alter_edge & (edge >> 1));
+	L::ClearInterrupt::set(cmd, clear);
+}
+
+constexpr void encode_get_sram_setting(uint8_t *cmd) {
+	clear_report(cmd);
+
+	layout::Code::set(cmd, layout::GetSram::code);
+}
+
+// Read Flash Data (0xB0)
+constexpr void encode_read_flash_data(uint8_t *cmd, int section) {
+	clear_report(cmd);
+
+	layout::Code::set(cmd, layout::ReadFlash::code);
+	layout::ReadFlash::Section::set(cmd, section);
+}
+
+// Write Flash Data (0xB1)
+inline void encode_write_flash_data(uint8_t *cmd, int section, const uint8_t *data, int length) {
+	clear_report(cmd);
+
+	layout::Code::set(cmd, layout::WriteFlash::code);
+	layout::WriteFlash::Section::set(cmd, section);
+	memcpy(cmd + layout::WriteFlash::data, data, length);
+}
+
+// Status / Set Parameters (0x10)
+constexpr void encode_status(uint8_t *cmd, int cancel, int speed_divider) {
+	typedef layout::Status L;
+
+	clear_report(cmd);
+
+	layout::Code::set(cmd, L::code);
+	L::Cancel::set(cmd, cancel != 0);
+	L::SetSpeed::set(cmd, speed_divider != 0);
+	L::SpeedDivider::set(cmd, speed_divider);
+}
+
+// I2C Write Data (0x90 / 0x92 / 0x94), data is one chunk of the transfer
+inline void encode_i2c_write(uint8_t *cmd, int type, int address, int length, const uint8_t *data, int chunk) {
+	typedef layout::I2CTransfer L;
+
+	clear_report(cmd);
+
+	layout::Code::set(cmd, type);
+	L::Length::set(cmd, length);
+	L::Address::set(cmd, address);
+	memcpy(cmd + L::data, data, chunk);
+}
+
+// I2C Read Data (0x91 / 0x93)
+constexpr void encode_i2c_read(uint8_t *cmd, int type, int address, int length) {
+	typedef layout::I2CTransfer L;
+
+	clear_report(cmd);
+
+	layout::Code::set(cmd, type);
+	L::Length::set(cmd, length);
+	L::Address::set(cmd, address);
+	L::Read::set(cmd, 1);
+}
+
+// Get I2C Data (0x40)
+constexpr void encode_i2c_get_data(uint8_t *cmd) {
+	clear_report(cmd);
+
+	layout::Code::set(cmd, layout::I2CGetData::code);
+}
+
+// ----- views : decode a response (64 bytes) without copying it -----
+
+// Get GPIO Values (0x51)
+class GpioInputView {
+public:
+	constexpr explicit GpioInputView(const uint8_t *buf) : buf_(buf) {}
+
+	typedef layout::GetGpioValues L;
+
+	constexpr bool ok() const {
+		return layout::Code::get(buf_) == L::code && layout::Result::get(buf_) == 0;
+	}
+
+	// GPIO_VALUE_MAX / GPIO_DIR_MAX if the port is not set for GPIO
+	constexpr GPIOValue value(int port) const {
+		int v = L::Value::get(buf_, port);
+		return v == L::not_gpio_value ? GPIO_VALUE_MAX : (GPIOValue)v;
+	}
+
+	constexpr GPIODirection direction(int port) const {
+		int v = L::Direction::get(buf_, port);
+		return v == L::not_gpio_direction ? GPIO_DIR_MAX : (GPIODirection)v;
+	}
+
+	void snapshot(GPIOSnapshot *snapshot) const {
+		for (int i = 0 ; i < 4 ; i++) {
+			snapshot->value[i]     = value(i);
+			snapshot->direction[i] = direction(i);
+		}
+	}
+
+private:
+	const uint8_t *buf_;
+};
+
+// Get SRAM Settings (0x61)
+class SramView {
+public:
+	constexpr explicit SramView(const uint8_t *buf) : buf_(buf) {}
+
+	typedef layout::GetSram L;
+
+	constexpr bool ok() const {
+		return layout::Code::get(buf_) == L::code && layout::Result::get(buf_) == 0;
+	}
+
+	constexpr int adc_reference() const {
+		return L::AdcReferenceVrm::get(buf_) ? L::AdcReference::get(buf_) : ADC_REF_VDD;
+	}
+
+	constexpr int gp_func(int port) const {
+		return L::Gp::Func::get(buf_, port);
+	}
+
+	constexpr int gp_direction(int port) const {
+		return L::Gp::Direction::get(buf_, port);
+	}
+
+	constexpr int gp_value(int port) const {
+		return L::Gp::Value::get(buf_, port);
+	}
+
+	// enable_* fields are left untouched
+	void setting(SRAMSetting *setting) const {
+		for (int i = 0 ; i < 4 ; i++) {
+			setting->gpn_func[i]           = gp_func(i);
+			setting->gpn_gpio_direction[i] = gp_direction(i);
+			setting->gpn_gpio_value[i]     = gp_value(i);
+		}
+	}
+
+private:
+	const uint8_t *buf_;
+};
+
+// Status / Set Parameters (0x10)
+class StatusView {
+public:
+	constexpr explicit StatusView(const uint8_t *buf) : buf_(buf) {}
+
+	typedef layout::Status L;
+
+	constexpr bool ok() const {
+		return layout::Code::get(buf_) == L::code && layout::Result::get(buf_) == 0;
+	}
+
+	constexpr int cancel_status() const      { return L::CancelStatus::get(buf_); }
+	constexpr int speed_status() const       { return L::SpeedStatus::get(buf_); }
+	constexpr int i2c_state() const          { return L::I2CState::get(buf_); }
+	constexpr int requested_length() const   { return L::RequestedLength::get(buf_); }
+	constexpr int transferred_length() const { return L::TransferredLength::get(buf_); }
+	constexpr int speed_divider() const      { return L::CurrentDivider::get(buf_); }
+	constexpr int i2c_address() const        { return L::I2CAddress::get(buf_); }
+	constexpr int scl() const                { return L::SCL::get(buf_); }
+	constexpr int sda() const                { return L::SDA::get(buf_); }
+	constexpr int address_nack() const       { return L::AddressNack::get(buf_); }
+	constexpr int interrupt() const          { return L::Interrupt::get(buf_); }	// edge latched on GP1
+	constexpr int read_pending() const       { return L::ReadPending::get(buf_); }
+
+	// 10bit conversion result of ADC1 - ADC3 (channel 0 - 2)
+	constexpr int adc(int channel) const {
+		return L::Adc::get(buf_, channel);
+	}
+
+private:
+	const uint8_t *buf_;
+};
+
+// ----- deadlines -----
+
+// Operation budget of the calling thread while the object lives (see mcp2221_begin_budget).
+//
+//   {
+//       mcp2221::Budget budget(5000);
+//       mcp2221_set_gpio_value(handle, 0, GPIO_VALUE_H);
+//       mcp2221_get_gpio_value(handle, 0, &value);	// both within 5ms
+//   }
+class Budget {
+public:
+	explicit Budget(int budget_us) : token_(mcp2221_begin_budget(budget_us)) {}
+
+	~Budget() {
+		mcp2221_end_budget(token_);
+	}
+
+	Budget(const Budget &) = delete;
+	Budget &operator=(const Budget &) = delete;
+
+private:
+	uint64_t token_;
+};
+
+// ----- device -----
+
+// Move-only owner of an open handle and its report buffers.
+// The buffers are allocated once by open(), commands are then issued without copies or allocations.
+//
+//   mcp2221::Device dev;
+//   if (dev.open() != STATUS_OK) ...
+//   mcp2221::encode_get_gpio_input(dev.command());
+//   if (dev.transfer() == STATUS_OK && dev.gpio_input().ok()) ...
+class Device {
+public:
+	Device() : state_(NULL) {}
+
+	~Device() {
+		close();
+	}
+
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+
+	Device(Device &&other) noexcept : state_(other.state_) {
+		other.state_ = NULL;
+	}
+
+	Device &operator=(Device &&other) noexcept {
+		if (this != &other) {
+			close();
+			state_       = other.state_;
+			other.state_ = NULL;
+		}
+		return *this;
+	}
+
+	int open() {
+		return open_with([](MCP2221Handle *handle) { return mcp2221_init(handle); });
+	}
+
+	int open_serial(const char *serial) {
+		return open_with([serial](MCP2221Handle *handle) { return mcp2221_init_by_serial(handle, serial); });
+	}
+
+	int open_path(const char *path) {
+		return open_with([path](MCP2221Handle *handle) { return mcp2221_init_by_path(handle, path); });
+	}
+
+	int open_transport(const MCP2221Transport *transport) {
+		return open_with([transport](MCP2221Handle *handle) { return mcp2221_init_with_transport(handle, transport); });
+	}
+
+	void close() {
+		if (state_ != NULL) {
+			mcp2221_destroy(&state_->handle);
+			delete state_;
+			state_ = NULL;
+		}
+	}
+
+	bool is_open() const {
+		return state_ != NULL;
+	}
+
+	// for the C api (the handle does not move with the Device)
+	MCP2221Handle *handle() {
+		return &state_->handle;
+	}
+
+	// Encode the next command here.
+	uint8_t *command() {
+		return state_->tx.command();
+	}
+
+	// Send command() and receive the response into response().
+	int transfer() {
+		return mcp2221_issue_report(&state_->handle, state_->tx.wire, state_->rx);
+	}
+
+	const uint8_t *response() const {
+		return state_->rx;
+	}
+
+	GpioInputView gpio_input() const { return GpioInputView(state_->rx); }
+	SramView      sram() const       { return SramView(state_->rx); }
+	StatusView    status() const     { return StatusView(state_->rx); }
+
+	int get_gpio_snapshot(GPIOSnapshot *snapshot) {
+		encode_get_gpio_input(command());
+
+		if (transfer() != STATUS_OK || !gpio_input().ok()) {
+			return STATUS_IO_ERROR;
+		}
+
+		gpio_input().snapshot(snapshot);
+
+		return STATUS_OK;
+	}
+
+	int read_adc(int value[3]) {
+		encode_status(command(), 0, 0);
+
+		if (transfer() != STATUS_OK || !status().ok()) {
+			return STATUS_IO_ERROR;
+		}
+
+		for (int i = 0 ; i < 3 ; i++) {
+			value[i] = status().adc(i);
+		}
+
+		return STATUS_OK;
+	}
+
+private:
+	struct State {
+		MCP2221Handle handle;
+		Report        tx;
+		alignas(16) uint8_t rx[64];
+	};
+
+	template <typename Init>
+	int open_with(Init init) {
+		close();
+
+		State *state = new (std::nothrow) State;
+		if (state == NULL) {
+			return STATUS_IO_ERROR;
+		}
+
+		int ret = init(&state->handle);
+		if (ret != STATUS_OK) {
+			delete state;
+			return ret;
+		}
+
+		state_ = state;
+
+		return STATUS_OK;
+	}
+
+	State *state_;
+};
+
+} // namespace mcp2221
+
+#endif
@@ -0,0 +1,233 @@
+
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <thread>
+
+#include "mcp2221.h"
+#include "mcp2221.hpp"
+#include "mcp2221_adc.h"
+#include "mcp2221_i2c.h"
+#include "mcp2221_private.h"
+
+struct _ADCStream {
+	MCP2221Handle *handle;
+	int interval_us;
+
+	// ring buffer, capacity is a power of two
+	ADCSample *samples;
+	uint64_t   capacity;
+
+	// written by the producer / the consumer only
+	alignas(64) std::atomic<uint64_t> head;
+	alignas(64) std::atomic<uint64_t> tail;
+
+	alignas(64) std::atomic<uint64_t> dropped;
+	std::atomic<uint64_t> errors;
+	std::atomic<int>      stop;
+
+	std::thread thread;
+};
+
+// Change only the ADC voltage reference, compared with the shadow of the handle.
+int mcp2221_set_adc_reference(MCP2221Handle *handle, ADCReference reference) {
+	if (reference < 0 || ADC_REF_MAX <= reference) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	ADCReference current;
+
+	int ret = mcp2221_get_adc_reference(handle, &current);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+	if (current == reference) {
+		return STATUS_OK;
+	}
+
+	mcp2221::Report report;
+
+	mcp2221::encode_set_adc_reference(report.command(), reference);
+
+	ret = mcp2221_issue_set_sram(handle, report.wire);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	mcp2221_state_lock(handle);
+	handle->adc_reference = reference;
+	mcp2221_state_unlock(handle);
+
+	return STATUS_OK;
+}
+
+// From the shadow, the device is read once when the shadow is not valid.
+int mcp2221_get_adc_reference(MCP2221Handle *handle, ADCReference *reference) {
+	mcp2221_state_lock(handle);
+	int valid = handle->setting_valid;
+	*reference = (ADCReference)handle->adc_reference;
+	mcp2221_state_unlock(handle);
+
+	if (!valid) {
+		SRAMSetting setting;
+
+		int ret = mcp2221_read_sram_setting(handle, &setting);
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		mcp2221_state_lock(handle);
+		*reference = (ADCReference)handle->adc_reference;
+		mcp2221_state_unlock(handle);
+	}
+
+	return STATUS_OK;
+}
+
+// The conversion result of all channels is part of the status report.
+int mcp2221_read_adc(MCP2221Handle *handle, ADCSample *sample) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	mcp2221_command_status(cmd, 0, 0);
+
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	mcp2221::StatusView view(buf);
+
+	if (!view.ok()) {
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+		return STATUS_IO_ERROR;
+	}
+
+	sample->timestamp_us = mcp2221_get_time_us();
+
+	for (int i = 0 ; i < 3 ; i++) {
+		sample->value[i] = view.adc(i);
+	}
+
+	return STATUS_OK;
+}
+
+static void mcp2221_adc_stream_run(ADCStream *stream) {
+	uint64_t next = mcp2221_get_time_us();
+
+	while (!stream->stop.load(std::memory_order_acquire)) {
+		ADCSample sample;
+
+		if (mcp2221_read_adc(stream->handle, &sample) != STATUS_OK) {
+			stream->errors.fetch_add(1, std::memory_order_relaxed);
+		} else {
+			uint64_t head = stream->head.load(std::memory_order_relaxed);
+			uint64_t tail = stream->tail.load(std::memory_order_acquire);
+
+			if (head - tail == stream->capacity) {
+				// the consumer is behind, keep the older samples
+				stream->dropped.fetch_add(1, std::memory_order_relaxed);
+			} else {
+				stream->samples[head & (stream->capacity - 1)] = sample;
+				stream->head.store(head + 1, std::memory_order_release);
+			}
+		}
+
+		// absolute deadlines, a slow round trip does not shift the following samples
+		next += stream->interval_us;
+
+		uint64_t now = mcp2221_get_time_us();
+		if (next < now) {
+			next = now;
+			continue;
+		}
+
+		struct timespec ts;
+		ts.tv_sec  = next / 1000000;
+		ts.tv_nsec = (next % 1000000) * 1000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+}
+
+// @param interval_us polling period
+// @param capacity number of samples buffered (rounded up to a power of two)
+int mcp2221_adc_stream_start(ADCStream **stream, MCP2221Handle *handle, int interval_us, int capacity) {
+	if (stream == NULL || interval_us <= 0 || capacity <= 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	uint64_t size = 1;
+	while (size < (uint64_t)capacity) {
+		size <<= 1;
+	}
+
+	ADCStream *s = new ADCStream;
+
+	s->handle      = handle;
+	s->interval_us = interval_us;
+	s->samples     = new ADCSample[size];
+	s->capacity    = size;
+	s->head.store(0);
+	s->tail.store(0);
+	s->dropped.store(0);
+	s->errors.store(0);
+	s->stop.store(0);
+
+	s->thread = std::thread(mcp2221_adc_stream_run, s);
+
+	*stream = s;
+
+	return STATUS_OK;
+}
+
+// Take up to max samples, oldest first. Never blocks.
+int mcp2221_adc_stream_read(ADCStream *stream, ADCSample *samples, int max, int *count) {
+	if (samples == NULL || max < 0 || count == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	uint64_t tail = stream->tail.load(std::memory_order_relaxed);
+	uint64_t head = stream->head.load(std::memory_order_acquire);
+
+	uint64_t n = head - tail;
+	if ((uint64_t)max < n) {
+		n = max;
+	}
+
+	for (uint64_t i = 0 ; i < n ; i++) {
+		samples[i] = stream->samples[(tail + i) & (stream->capacity - 1)];
+	}
+
+	stream->tail.store(tail + n, std::memory_order_release);
+
+	*count = n;
+
+	return STATUS_OK;
+}
+
+// Samples lost because the ring buffer was full.
+uint64_t mcp2221_adc_stream_dropped(ADCStream *stream) {
+	return stream->dropped.load(std::memory_order_relaxed);
+}
+
+// Polls which failed.
+uint64_t mcp2221_adc_stream_errors(ADCStream *stream) {
+	return stream->errors.load(std::memory_order_relaxed);
+}
+
+// Stop the thread and release the stream.
+int mcp2221_adc_stream_stop(ADCStream *stream) {
+	if (stream == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	stream->stop.store(1, std::memory_order_release);
+	stream->thread.join();
+
+	delete[] stream->samples;
+	delete stream;
+
+	return STATUS_OK;
+}
@@ -0,0 +1,41 @@
+#ifndef __MCP2221_ADC_H__
+#define __MCP2221_ADC_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ADC (10bit) on GP1 (ADC1), GP2 (ADC2) and GP3 (ADC3).
+// The port has to be set to the ADC function with mcp2221_write_sram_setting.
+
+typedef struct _ADCSample {
+	uint64_t timestamp_us;	// CLOCK_MONOTONIC
+	uint16_t value[3];		// ADC1, ADC2, ADC3
+} ADCSample;
+
+// Background acquisition.
+// A thread polls the status report and pushes the samples into a single producer / single consumer ring buffer.
+// The handle may be used by other threads while the stream runs.
+typedef struct _ADCStream ADCStream;
+
+// The ADC reference is kept out of SRAMSetting, mcp2221_write_sram_setting never alters it.
+// mcp2221_set_adc_reference sends nothing when the reference is already selected.
+int mcp2221_set_adc_reference(MCP2221Handle *handle, ADCReference reference);
+int mcp2221_get_adc_reference(MCP2221Handle *handle, ADCReference *reference);
+int mcp2221_read_adc(MCP2221Handle *handle, ADCSample *sample);
+
+int mcp2221_adc_stream_start(ADCStream **stream, MCP2221Handle *handle, int interval_us, int capacity);
+int mcp2221_adc_stream_read(ADCStream *stream, ADCSample *samples, int max, int *count);
+uint64_t mcp2221_adc_stream_dropped(ADCStream *stream);
+uint64_t mcp2221_adc_stream_errors(ADCStream *stream);
+int mcp2221_adc_stream_stop(ADCStream *stream);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+
+#include <string.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "mcp2221.h"
+#include "mcp2221_async.h"
+#include "mcp2221_private.h"
+
+#define ASYNC_MAX_IN_FLIGHT (8)
+
+struct _MCP2221Async {
+	MCP2221Handle *handle;
+	int max_in_flight;
+
+	// submitted, not yet taken by the I/O thread (lock-free stack, newest first)
+	MCP2221Request *submitted;
+	int stop;
+
+	// the I/O thread sleeps only while it has nothing to do
+	int                     sleeping;
+	std::mutex              mutex;
+	std::condition_variable wake;
+
+	std::thread     thread;
+	std::thread::id thread_id;
+};
+
+static void mcp2221_async_complete(MCP2221Async *async, MCP2221Request *request, int status) {
+	request->status = status;
+
+	if (request->callback != NULL) {
+		request->callback(request, request->user);
+	}
+
+	// the submitter may release the request as soon as done is set
+	mcp2221_completion_signal(&request->done);
+}
+
+static int mcp2221_async_in_flight(MCP2221Request **in_flight, int head, int count, uint8_t code) {
+	for (int i = 0 ; i < count ; i++) {
+		if (in_flight[(head + i) % ASYNC_MAX_IN_FLIGHT]->cmd[0] == code) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void mcp2221_async_run(MCP2221Async *async) {
+	MCP2221Handle *handle = async->handle;
+
+	// taken from the submitted stack, not yet sent (oldest first)
+	MCP2221Request *queue = NULL;
+
+	// sent, waiting for the response (oldest first)
+	MCP2221Request *in_flight[ASYNC_MAX_IN_FLIGHT];
+	int in_flight_head  = 0;
+	int in_flight_count = 0;
+
+	for (;;) {
+		if (queue == NULL) {
+			queue = mcp2221_mpsc_take_all(&async->submitted);
+		}
+
+		if (queue == NULL && in_flight_count == 0) {
+			if (__atomic_load_n(&async->stop, __ATOMIC_SEQ_CST)) {
+				// pushed just before stop was set
+				queue = mcp2221_mpsc_take_all(&async->submitted);
+				if (queue == NULL) {
+					break;
+				}
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(async->mutex);
+
+			__atomic_store_n(&async->sleeping, 1, __ATOMIC_SEQ_CST);
+
+			async->wake.wait(lock, [async] {
+				return __atomic_load_n(&async->submitted, __ATOMIC_SEQ_CST) != NULL || __atomic_load_n(&async->stop, __ATOMIC_SEQ_CST);
+			});
+
+			__atomic_store_n(&async->sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		// late responses of abandoned commands, they would be taken for the next ones
+		if (handle->drain_pending && in_flight_count == 0) {
+			mcp2221_drain_responses(handle);
+		}
+
+		// keep the device busy with the next commands
+		while (in_flight_count < async->max_in_flight && queue != NULL) {
+			MCP2221Request *request = queue;
+
+			// responses are told apart by the echoed command code only : a command waits until
+			// no other one with its code is in flight, or a lost response would shift the rest by one
+			if (mcp2221_async_in_flight(in_flight, in_flight_head, in_flight_count, request->cmd[0])) {
+				break;
+			}
+
+			queue = request->next;
+
+			if (mcp2221_lowlevel_send(&handle->transport, request->cmd, 64) != STATUS_OK) {
+				mcp2221_async_complete(async, request, STATUS_IO_ERROR);
+			} else {
+				in_flight[(in_flight_head + in_flight_count) % ASYNC_MAX_IN_FLIGHT] = request;
+				in_flight_count++;
+			}
+		}
+
+		if (in_flight_count == 0) {
+			continue;
+		}
+
+		// the device answers in order
+		MCP2221Request *request = in_flight[in_flight_head];
+
+		int ret = mcp2221_lowlevel_recv(&handle->transport, request->resp, 64, handle->recv_timeout_ms);
+
+		if (ret != STATUS_OK) {
+			// the pairing of the remaining responses is lost
+			if (ret == STATUS_RECV_TIMEOUT) {
+				mcp2221_count_response(&handle->response_stats.recv_timeouts);
+				handle->drain_pending = 1;
+			}
+
+			while (in_flight_count > 0) {
+				mcp2221_async_complete(async, in_flight[in_flight_head], ret == STATUS_RECV_TIMEOUT ? ret : STATUS_IO_ERROR);
+				in_flight_head = (in_flight_head + 1) % ASYNC_MAX_IN_FLIGHT;
+				in_flight_count--;
+			}
+			continue;
+		}
+
+		if (request->resp[0] != request->cmd[0]) {
+			// the response of the oldest command was lost if a later one answered,
+			// otherwise the report is a late response of an abandoned command
+			int k = 1;
+
+			while (k < in_flight_count && in_flight[(in_flight_head + k) % ASYNC_MAX_IN_FLIGHT]->cmd[0] != request->resp[0]) {
+				k++;
+			}
+
+			mcp2221_count_response(&handle->response_stats.mismatched);
+
+			if (k == in_flight_count) {
+				continue;
+			}
+
+			MCP2221Request *answered = in_flight[(in_flight_head + k) % ASYNC_MAX_IN_FLIGHT];
+
+			memcpy(answered->resp, request->resp, 64);
+
+			for (int i = 0 ; i < k ; i++) {
+				mcp2221_count_response(&handle->response_stats.recv_timeouts);
+				mcp2221_async_complete(async, in_flight[in_flight_head], STATUS_RECV_TIMEOUT);
+				in_flight_head = (in_flight_head + 1) % ASYNC_MAX_IN_FLIGHT;
+				in_flight_count--;
+			}
+
+			request = answered;
+		}
+
+		in_flight_head = (in_flight_head + 1) % ASYNC_MAX_IN_FLIGHT;
+		in_flight_count--;
+
+		mcp2221_async_complete(async, request, STATUS_OK);
+	}
+}
+
+// Start the I/O thread of the handle.
+// @param max_in_flight commands sent before the oldest response is received (1 - 8)
+int mcp2221_async_start(MCP2221Handle *handle, int max_in_flight) {
+	if (max_in_flight < 1 || ASYNC_MAX_IN_FLIGHT < max_in_flight) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (handle->async != NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	MCP2221Async *async = new MCP2221Async;
+
+	async->handle        = handle;
+	async->max_in_flight = max_in_flight;
+	async->submitted     = NULL;
+	async->stop          = 0;
+	async->sleeping      = 0;
+
+	async->thread    = std::thread(mcp2221_async_run, async);
+	async->thread_id = async->thread.get_id();
+
+	handle->async = async;
+
+	return STATUS_OK;
+}
+
+// Complete every submitted request, then stop the I/O thread.
+int mcp2221_async_stop(MCP2221Handle *handle) {
+	MCP2221Async *async = handle->async;
+
+	if (async == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	__atomic_store_n(&async->stop, 1, __ATOMIC_SEQ_CST);
+
+	{
+		std::lock_guard<std::mutex> lock(async->mutex);
+		async->wake.notify_one();
+	}
+
+	async->thread.join();
+
+	handle->async = NULL;
+	delete async;
+
+	return STATUS_OK;
+}
+
+// Queue a request. It must stay valid until it is completed.
+// Any number of threads may submit at the same time, submitting takes no lock.
+int mcp2221_async_submit(MCP2221Handle *handle, MCP2221Request *request) {
+	MCP2221Async *async = handle->async;
+
+	if (async == NULL || request == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (__atomic_load_n(&async->stop, __ATOMIC_RELAXED)) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	request->status = STATUS_IO_ERROR;
+	request->done   = 0;
+
+	mcp2221_mpsc_push(&async->submitted, request);
+
+	// the I/O thread looks at the stack again after setting sleeping, no wakeup is lost
+	if (__atomic_load_n(&async->sleeping, __ATOMIC_SEQ_CST)) {
+		std::lock_guard<std::mutex> lock(async->mutex);
+		async->wake.notify_one();
+	}
+
+	return STATUS_OK;
+}
+
+// Wait for the completion of a request.
+// @param timeout_ms < 0 : wait forever
+// @return status of the request, or STATUS_TIMEOUT
+int mcp2221_async_wait(MCP2221Handle *handle, MCP2221Request *request, int timeout_ms) {
+	MCP2221Async *async = handle->async;
+
+	if (async == NULL || request == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (mcp2221_async_is_io_thread(handle)) {
+		// would never complete
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (mcp2221_completion_wait(&request->done, timeout_ms) != STATUS_OK) {
+		return STATUS_TIMEOUT;
+	}
+
+	return request->status;
+}
+
+int mcp2221_async_is_done(MCP2221Handle *handle, MCP2221Request *request) {
+	return __atomic_load_n(&request->done, __ATOMIC_ACQUIRE) == 1;
+}
+
+// ----- used by mcp2221_issue_command -----
+int mcp2221_async_is_io_thread(MCP2221Handle *handle) {
+	return handle->async != NULL && std::this_thread::get_id() == handle->async->thread_id;
+}
+
+int mcp2221_async_issue(MCP2221Handle *handle, uint8_t send_cmd[64], uint8_t recv_buf[64]) {
+	int ret;
+	MCP2221Request request;
+
+	memcpy(request.cmd, send_cmd, 64);
+	request.callback = NULL;
+	request.user     = NULL;
+
+	ret = mcp2221_async_submit(handle, &request);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	ret = mcp2221_async_wait(handle, &request, -1);
+
+	memcpy(recv_buf, request.resp, 64);
+
+	return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef __MCP2221_ASYNC_H__
+#define __MCP2221_ASYNC_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Command pipeline
+//
+// Commands are queued to an I/O thread owned by the handle and completed in submission order.
+// The caller keeps computing while the report is on the wire.
+// While the pipeline runs, the blocking api of the handle goes through the same queue.
+// Requests are submitted through a lock-free queue, from any number of threads.
+// Responses are paired by the echoed command code, so commands with the same code are not
+// pipelined : one of them is in flight at a time, the others wait for its response.
+
+typedef struct _MCP2221Request MCP2221Request;
+
+// Called on the I/O thread. It must not use the blocking api of the same handle.
+typedef void (*MCP2221Callback)(MCP2221Request *request, void *user);
+
+struct _MCP2221Request {
+	uint8_t cmd[64];
+	uint8_t resp[64];
+	int     status;
+
+	MCP2221Callback callback;	// may be NULL
+	void           *user;
+
+	// owned by the pipeline between submit and completion
+	int             done;	// 1 : completed
+	MCP2221Request *next;
+};
+
+int mcp2221_async_start(MCP2221Handle *handle, int max_in_flight);
+int mcp2221_async_stop(MCP2221Handle *handle);
+int mcp2221_async_submit(MCP2221Handle *handle, MCP2221Request *request);
+int mcp2221_async_wait(MCP2221Handle *handle, MCP2221Request *request, int timeout_ms);
+int mcp2221_async_is_done(MCP2221Handle *handle, MCP2221Request *request);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
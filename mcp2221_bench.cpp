@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "mcp2221.h"
+#include "mcp2221_async.h"
+#include "mcp2221_i2c.h"
+#include "mcp2221_sequence.h"
+#include "mcp2221_sim.h"
+
+// ----- allocation counter -----
+// every allocation (including operator new) goes through malloc on glibc
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static std::atomic<uint64_t> alloc_count(0);
+
+extern "C" void *malloc(size_t size) {
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+	alloc_count.fetch_add(1, std::memory_order_relaxed);
+	return __libc_realloc(ptr, size);
+}
+
+// ----- loopback transport -----
+// The simulator model answers immediately, no clock and no sleep.
+typedef struct _Loopback {
+	MCP2221Sim sim;
+	uint8_t    resp[64];
+} Loopback;
+
+static int loopback_send(void *context, const uint8_t *data, int length) {
+	Loopback *lb = (Loopback *)context;
+	uint8_t cmd[64] = {0};
+
+	memcpy(cmd, data, length);
+	mcp2221_sim_process(&lb->sim, cmd, lb->resp);
+
+	return STATUS_OK;
+}
+
+static int loopback_recv(void *context, uint8_t *data, int length, int timeout_ms) {
+	Loopback *lb = (Loopback *)context;
+
+	memcpy(data, lb->resp, length);
+
+	return STATUS_OK;
+}
+
+static int loopback_init(Loopback *lb, MCP2221Handle *handle) {
+	MCP2221Transport transport;
+
+	mcp2221_sim_init(&lb->sim, NULL);
+	mcp2221_sim_set_i2c_slave(&lb->sim, 0x50);
+
+	transport.context = lb;
+	transport.open    = NULL;
+	transport.close   = NULL;
+	transport.send    = loopback_send;
+	transport.recv    = loopback_recv;
+
+	return mcp2221_init_with_transport(handle, &transport);
+}
+
+// ----- benchmark runner -----
+static inline uint64_t now_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void clobber(void *p) {
+	asm volatile("" : : "r"(p) : "memory");
+}
+
+typedef struct _BenchContext {
+	MCP2221Handle handle;
+	Loopback      loopback;
+	GPIOSetting   gpio[4];
+	SRAMSetting   setting;
+	uint8_t       cmd[64];
+	uint8_t       buf[64];
+	uint8_t       data[1024];
+} BenchContext;
+
+typedef struct _Bench {
+	const char *name;
+	// ops run by one call of fn
+	int batch;
+	void (*fn)(BenchContext *ctx);
+} Bench;
+
+static void bench_command_set_gpio_output(BenchContext *ctx) {
+	for (int i = 0 ; i < 64 ; i++) {
+		mcp2221_command_set_gpio_output(ctx->cmd, &ctx->gpio[0], &ctx->gpio[1], &ctx->gpio[2], &ctx->gpio[3]);
+		clobber(ctx->cmd);
+	}
+}
+
+static void bench_command_set_sram_settings(BenchContext *ctx) {
+	for (int i = 0 ; i < 64 ; i++) {
+		mcp2221_command_set_sram_settings(ctx->cmd, &ctx->setting);
+		clobber(ctx->cmd);
+	}
+}
+
+static void bench_read_sram_setting(BenchContext *ctx) {
+	mcp2221_read_sram_setting(&ctx->handle, &ctx->setting);
+	clobber(&ctx->setting);
+}
+
+static void bench_issue_command(BenchContext *ctx) {
+	mcp2221_command_get_gpio_input(ctx->cmd);
+	mcp2221_issue_command(&ctx->handle, ctx->cmd, ctx->buf);
+	clobber(ctx->buf);
+}
+
+static void bench_get_gpio_snapshot(BenchContext *ctx) {
+	GPIOSnapshot snapshot;
+
+	mcp2221_get_gpio_snapshot(&ctx->handle, &snapshot);
+	clobber(&snapshot);
+}
+
+static void bench_set_gpio_values(BenchContext *ctx) {
+	mcp2221_set_gpio_values(&ctx->handle, GPIO_PORT_MASK_ALL, 0x5);
+}
+
+static void bench_i2c_write_256(BenchContext *ctx) {
+	mcp2221_i2c_write(&ctx->handle, 0x50, ctx->data, 256);
+}
+
+static void bench_i2c_read_256(BenchContext *ctx) {
+	mcp2221_i2c_read(&ctx->handle, 0x50, ctx->data, 256);
+	clobber(ctx->data);
+}
+
+static const Bench benches[] = {
+	{ "command_set_gpio_output",   64, bench_command_set_gpio_output },
+	{ "command_set_sram_settings", 64, bench_command_set_sram_settings },
+	{ "read_sram_setting",          1, bench_read_sram_setting },
+	{ "issue_command",              1, bench_issue_command },
+	{ "get_gpio_snapshot",          1, bench_get_gpio_snapshot },
+	{ "set_gpio_values",            1, bench_set_gpio_values },
+	{ "i2c_write_256",              1, bench_i2c_write_256 },
+	{ "i2c_read_256",               1, bench_i2c_read_256 },
+};
+
+static uint64_t percentile(const uint64_t *sorted, int n, double p) {
+	int idx = (int)(p * (n - 1));
+	return sorted[idx];
+}
+
+static void print_histogram(const uint64_t *sorted, int n) {
+	// power of two buckets [2^k, 2^(k+1)) ns
+	int k = 0;
+	int i = 0;
+
+	while (i < n) {
+		uint64_t limit = (uint64_t)1 << (k + 1);
+		int count = 0;
+
+		while (i < n && sorted[i] < limit) {
+			count++;
+			i++;
+		}
+
+		if (count > 0) {
+			printf("    [%10llu, %10llu) ns : %d\n", (unsigned long long)(limit >> 1), (unsigned long long)limit, count);
+		}
+		k++;
+	}
+}
+
+static void run_bench(const Bench *bench, BenchContext *ctx, int iterations, uint64_t *samples, int verbose) {
+	// warm up
+	for (int i = 0 ; i < iterations / 10 + 1 ; i++) {
+		bench->fn(ctx);
+	}
+
+	uint64_t allocs_begin = alloc_count.load();
+	uint64_t total_begin  = now_ns();
+
+	for (int i = 0 ; i < iterations ; i++) {
+		uint64_t begin = now_ns();
+		bench->fn(ctx);
+		samples[i] = (now_ns() - begin) / bench->batch;
+	}
+
+	uint64_t total  = now_ns() - total_begin;
+	uint64_t allocs = alloc_count.load() - allocs_begin;
+	uint64_t ops    = (uint64_t)iterations * bench->batch;
+
+	std::sort(samples, samples + iterations);
+
+	printf("%-28s %10.1f %10.3f %8llu %8llu %8llu\n",
+			bench->name,
+			(double)total / ops,
+			(double)allocs / ops,
+			(unsigned long long)percentile(samples, iterations, 0.50),
+			(unsigned long long)percentile(samples, iterations, 0.99),
+			(unsigned long long)percentile(samples, iterations, 0.999));
+
+	if (verbose) {
+		print_histogram(samples, iterations);
+	}
+}
+
+// ----- I2C throughput -----
+// Transfers over the simulator with a USB latency model.
+typedef int (*I2CTransfer)(MCP2221Handle *handle, uint8_t *data, int length);
+
+static int i2c_write(MCP2221Handle *handle, uint8_t *data, int length) {
+	return mcp2221_i2c_write(handle, 0x50, data, length);
+}
+
+static int i2c_read(MCP2221Handle *handle, uint8_t *data, int length) {
+	return mcp2221_i2c_read(handle, 0x50, data, length);
+}
+
+static int i2c_write_read(MCP2221Handle *handle, uint8_t *data, int length) {
+	uint8_t reg = 0;
+	return mcp2221_i2c_write_read(handle, 0x50, &reg, 1, data, length);
+}
+
+static int run_i2c_throughput(int latency_us, int frame_us, int iterations) {
+	static MCP2221Sim sim;
+	MCP2221SimConfig config;
+	MCP2221Transport transport;
+	MCP2221Handle handle;
+	uint8_t data[1024] = {0};
+
+	const struct { const char *name; I2CTransfer fn; } transfers[] = {
+		{ "write",      i2c_write },
+		{ "read",       i2c_read },
+		{ "write_read", i2c_write_read },
+	};
+	const int lengths[] = { 1, 16, 60, 61, 256, 1024 };
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = latency_us;
+	config.frame_us   = frame_us;
+
+	mcp2221_sim_init(&sim, &config);
+	mcp2221_sim_set_i2c_slave(&sim, 0x50);
+	mcp2221_sim_get_transport(&sim, &transport);
+
+	if (mcp2221_init_with_transport(&handle, &transport) != STATUS_OK) {
+		printf("mcp2221_init_with_transport error.\n");
+		return 1;
+	}
+
+	printf("I2C over simulator (latency %d us, frame %d us)\n", latency_us, frame_us);
+	printf("%-12s %8s %12s %12s %14s\n", "transfer", "bytes", "reports/op", "us/op", "bytes/s");
+
+	for (size_t t = 0 ; t < sizeof(transfers) / sizeof(transfers[0]) ; t++) {
+		for (size_t l = 0 ; l < sizeof(lengths) / sizeof(lengths[0]) ; l++) {
+			uint64_t reports = sim.command_count;
+			uint64_t begin   = now_ns();
+
+			for (int i = 0 ; i < iterations ; i++) {
+				if (transfers[t].fn(&handle, data, lengths[l]) != STATUS_OK) {
+					printf("%s error.\n", transfers[t].name);
+					return 1;
+				}
+			}
+
+			uint64_t elapsed = now_ns() - begin;
+			reports = sim.command_count - reports;
+
+			printf("%-12s %8d %12.1f %12.1f %14.0f\n",
+					transfers[t].name,
+					lengths[l],
+					(double)reports / iterations,
+					(double)elapsed / iterations / 1000,
+					(double)lengths[l] * iterations * 1000000000 / elapsed);
+		}
+	}
+
+	mcp2221_destroy(&handle);
+
+	return 0;
+}
+
+// ----- shared handle -----
+// Producer threads issue commands on one handle over the simulator with a USB latency model.
+// Each thread uses its own command code, a response paired with the wrong caller is counted as an error.
+static void stress_producer(MCP2221Handle *handle, uint8_t code, int iterations, std::atomic<int> *errors) {
+	uint8_t cmd[64];
+	uint8_t buf[64];
+
+	for (int i = 0 ; i < iterations ; i++) {
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = code;
+
+		if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK || buf[0] != code) {
+			errors->fetch_add(1);
+		}
+	}
+}
+
+// The device answers one report per frame : with framing the pipeline can't go above 1 / frame_us,
+// it hides the latency (--latency-us 2000 : ~333 ops/s direct, ~500 - 850 ops/s pipelined from 4 - 16
+// threads). The threads use 3 command codes and only one command per code is in flight.
+static int run_threads(int latency_us, int frame_us, int iterations) {
+	static MCP2221Sim sim;
+	MCP2221SimConfig config;
+	MCP2221Transport transport;
+	MCP2221Handle handle;
+
+	const uint8_t codes[] = { 0x10, 0x51, 0x61 };
+	const int producers[] = { 1, 2, 4, 8, 16 };
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = latency_us;
+	config.frame_us   = frame_us;
+
+	mcp2221_sim_init(&sim, &config);
+	mcp2221_sim_get_transport(&sim, &transport);
+
+	if (mcp2221_init_with_transport(&handle, &transport) != STATUS_OK) {
+		printf("mcp2221_init_with_transport error.\n");
+		return 1;
+	}
+
+	printf("Shared handle over simulator (latency %d us, frame %d us), %d commands per thread\n", latency_us, frame_us, iterations);
+	printf("%-10s %8s %12s %12s %8s\n", "mode", "threads", "ops/s", "us/op", "errors");
+
+	// direct : one caller at a time owns the handle, pipeline : up to 8 commands in flight
+	for (int pipeline = 0 ; pipeline < 2 ; pipeline++) {
+		if (pipeline && mcp2221_async_start(&handle, 8) != STATUS_OK) {
+			printf("mcp2221_async_start error.\n");
+			return 1;
+		}
+
+		for (size_t p = 0 ; p < sizeof(producers) / sizeof(producers[0]) ; p++) {
+			std::atomic<int> errors(0);
+			std::thread threads[16];
+
+			uint64_t begin = now_ns();
+
+			for (int i = 0 ; i < producers[p] ; i++) {
+				threads[i] = std::thread(stress_producer, &handle, codes[i % 3], iterations, &errors);
+			}
+			for (int i = 0 ; i < producers[p] ; i++) {
+				threads[i].join();
+			}
+
+			uint64_t elapsed = now_ns() - begin;
+			uint64_t ops     = (uint64_t)producers[p] * iterations;
+
+			printf("%-10s %8d %12.0f %12.2f %8d\n",
+					pipeline ? "pipeline" : "direct",
+					producers[p],
+					(double)ops * 1000000000 / elapsed,
+					(double)elapsed / ops / 1000,
+					errors.load());
+		}
+
+		if (pipeline) {
+			mcp2221_async_stop(&handle);
+		}
+	}
+
+	mcp2221_destroy(&handle);
+
+	return 0;
+}
+
+// ----- GPIO sequence -----
+// GP0 square waves of shrinking period over the simulator, to find the highest rate that keeps its deadlines.
+static int run_sequence(int latency_us, int frame_us, int iterations) {
+	static MCP2221Sim sim;
+	MCP2221SimConfig config;
+	MCP2221Transport transport;
+	MCP2221Handle handle;
+	SRAMSetting setting;
+
+	const int periods_us[] = { 8000, 4000, 2000, 1000, 500, 250, 0 };
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = latency_us;
+	config.frame_us   = frame_us;
+
+	mcp2221_sim_init(&sim, &config);
+	mcp2221_sim_get_transport(&sim, &transport);
+
+	if (mcp2221_init_with_transport(&handle, &transport) != STATUS_OK) {
+		printf("mcp2221_init_with_transport error.\n");
+		return 1;
+	}
+
+	memset(&setting, 0, sizeof(setting));
+	setting.enable_gpio_config = 1;
+
+	if (mcp2221_write_sram_setting(&handle, &setting) != STATUS_OK) {
+		printf("mcp2221_write_sram_setting error.\n");
+		return 1;
+	}
+
+	GPIOStep *steps = new GPIOStep[iterations];
+
+	printf("GPIO sequence over simulator (latency %d us, frame %d us), %d steps\n", latency_us, frame_us, iterations);
+	printf("%10s %12s %10s %10s %10s %10s %8s\n", "step us", "reports/s", "err min", "err mean", "err p99", "err max", "rt");
+
+	for (size_t p = 0 ; p < sizeof(periods_us) / sizeof(periods_us[0]) ; p++) {
+		GPIOSequence *sequence;
+		GPIOSequenceStats stats;
+
+		for (int i = 0 ; i < iterations ; i++) {
+			steps[i].time_us        = (uint64_t)periods_us[p] * i;
+			steps[i].value_mask     = 0x1;
+			steps[i].values         = i % 2;
+			steps[i].direction_mask = 0;
+			steps[i].directions     = 0;
+
+			if (periods_us[p] == 0) {
+				// as fast as possible : 1 us apart, the same instant would be merged
+				steps[i].time_us = i;
+			}
+		}
+
+		if (mcp2221_sequence_compile(&sequence, steps, iterations) != STATUS_OK) {
+			printf("mcp2221_sequence_compile error.\n");
+			return 1;
+		}
+
+		if (mcp2221_sequence_play(&handle, sequence, &stats, NULL) != STATUS_OK) {
+			printf("mcp2221_sequence_play error.\n");
+			return 1;
+		}
+
+		printf("%10d %12.0f %10lld %10.1f %10lld %10lld %8d\n",
+				periods_us[p],
+				stats.rate_hz,
+				(long long)stats.error_min_us,
+				stats.error_mean_us,
+				(long long)stats.error_p99_us,
+				(long long)stats.error_max_us,
+				stats.realtime);
+
+		mcp2221_sequence_free(sequence);
+	}
+
+	delete[] steps;
+
+	mcp2221_destroy(&handle);
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = 0;
+	int verbose = 0;
+	int i2c = 0;
+	int threads = 0;
+	int sequence = 0;
+	int latency_us = 0;
+	int frame_us = 1000;
+	const char *filter = NULL;
+
+	for (int i = 1 ; i < argc ; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-v") == 0) {
+			verbose = 1;
+		} else if (strcmp(argv[i], "--i2c") == 0) {
+			i2c = 1;
+		} else if (strcmp(argv[i], "--sequence") == 0) {
+			sequence = 1;
+		} else if (strcmp(argv[i], "--threads") == 0) {
+			threads = 1;
+		} else if (strcmp(argv[i], "--latency-us") == 0 && i + 1 < argc) {
+			latency_us = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--frame-us") == 0 && i + 1 < argc) {
+			frame_us = atoi(argv[++i]);
+		} else if (argv[i][0] != '-') {
+			filter = argv[i];
+		} else {
+			printf("usage : ./mcp2221_bench [-n iterations] [-v] [name filter]\n");
+			printf("        ./mcp2221_bench --i2c [-n iterations] [--latency-us us] [--frame-us us]\n");
+			printf("        ./mcp2221_bench --threads [-n iterations] [--latency-us us] [--frame-us us]\n");
+			printf("        ./mcp2221_bench --sequence [-n steps] [--latency-us us] [--frame-us us]\n");
+			return 1;
+		}
+	}
+
+	if (iterations == 0) {
+		// transfers over the latency model take milliseconds
+		iterations = i2c || threads || sequence ? 100 : 100000;
+	}
+	if (iterations < 0) {
+		printf("invalid iterations.\n");
+		return 1;
+	}
+
+	if (i2c) {
+		return run_i2c_throughput(latency_us, frame_us, iterations);
+	}
+	if (threads) {
+		return run_threads(latency_us, frame_us, iterations);
+	}
+	if (sequence) {
+		return run_sequence(latency_us, frame_us, iterations);
+	}
+
+	static BenchContext ctx;
+
+	if (loopback_init(&ctx.loopback, &ctx.handle) != STATUS_OK) {
+		printf("loopback_init error.\n");
+		return 1;
+	}
+
+	for (int i = 0 ; i < 4 ; i++) {
+		ctx.gpio[i].enable_value     = 1;
+		ctx.gpio[i].value            = GPIO_VALUE_H;
+		ctx.gpio[i].enable_direction = 1;
+		ctx.gpio[i].direction        = GPIO_DIR_OUT;
+
+		ctx.setting.gpn_func[i]           = 0;
+		ctx.setting.gpn_gpio_direction[i] = GPIO_DIR_OUT;
+		ctx.setting.gpn_gpio_value[i]     = GPIO_VALUE_L;
+	}
+	ctx.setting.enable_gpio_config = 1;
+
+	if (mcp2221_write_sram_setting(&ctx.handle, &ctx.setting) != STATUS_OK) {
+		printf("mcp2221_write_sram_setting error.\n");
+		return 1;
+	}
+
+	// preallocated so that the runner itself does not allocate
+	uint64_t *samples = new uint64_t[iterations];
+
+	printf("%-28s %10s %10s %8s %8s %8s\n", "benchmark", "ns/op", "allocs/op", "p50", "p99", "p999");
+
+	for (size_t i = 0 ; i < sizeof(benches) / sizeof(benches[0]) ; i++) {
+		if (filter != NULL && strstr(benches[i].name, filter) == NULL) {
+			continue;
+		}
+
+		run_bench(&benches[i], &ctx, iterations, samples, verbose);
+	}
+
+	delete[] samples;
+
+	mcp2221_destroy(&ctx.handle);
+
+	return 0;
+}
@@ -0,0 +1,135 @@
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mcp2221.h"
+#include "mcp2221_client.h"
+#include "mcp2221_daemon.h"
+
+static int mcp2221_client_call(MCP2221Client *client, DaemonRequest *request, DaemonResponse *response) {
+	if (send(client->fd, request, sizeof(DaemonRequest), MSG_NOSIGNAL) != sizeof(DaemonRequest)) {
+		return STATUS_IO_ERROR;
+	}
+
+	if (recv(client->fd, response, sizeof(DaemonResponse), 0) != sizeof(DaemonResponse)) {
+		return STATUS_IO_ERROR;
+	}
+
+	return response->status;
+}
+
+// @param path NULL : mcp2221_daemon_default_socket
+int mcp2221_client_connect(MCP2221Client *client, const char *path) {
+	struct sockaddr_un addr;
+	char default_path[sizeof(addr.sun_path)];
+
+	if (path == NULL) {
+		if (mcp2221_daemon_default_socket(default_path, sizeof(default_path)) != STATUS_OK) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+		path = default_path;
+	}
+	if (sizeof(addr.sun_path) <= strlen(path)) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (client->fd < 0) {
+		return STATUS_IO_ERROR;
+	}
+
+	if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		close(client->fd);
+		client->fd = -1;
+		return STATUS_IO_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+int mcp2221_client_close(MCP2221Client *client) {
+	if (client->fd < 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	close(client->fd);
+	client->fd = -1;
+
+	return STATUS_OK;
+}
+
+// Pass a report through the daemon, like mcp2221_issue_command.
+int mcp2221_client_issue_command(MCP2221Client *client, uint8_t send_cmd[64], uint8_t recv_buf[64]) {
+	DaemonRequest  request;
+	DaemonResponse response;
+	int ret;
+
+	memset(&request, 0, sizeof(request));
+
+	request.op = DAEMON_OP_COMMAND;
+	memcpy(request.report, send_cmd, 64);
+
+	ret = mcp2221_client_call(client, &request, &response);
+
+	// the report is not valid after a failure, recv_buf is left untouched
+	if (ret == STATUS_OK) {
+		memcpy(recv_buf, response.report, 64);
+	}
+
+	return ret;
+}
+
+// Set the values / directions of the ports selected by the masks (bit n : GPn, direction 1 : input).
+// The daemon may send it in one report together with the writes of other clients.
+int mcp2221_client_set_gpio(MCP2221Client *client, int value_mask, int values, int direction_mask, int directions) {
+	DaemonRequest  request;
+	DaemonResponse response;
+
+	if ((value_mask | direction_mask) & ~GPIO_PORT_MASK_ALL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	memset(&request, 0, sizeof(request));
+
+	request.op             = DAEMON_OP_SET_GPIO;
+	request.value_mask     = value_mask;
+	request.values         = values & GPIO_PORT_MASK_ALL;
+	request.direction_mask = direction_mask;
+	request.directions     = directions & GPIO_PORT_MASK_ALL;
+
+	return mcp2221_client_call(client, &request, &response);
+}
+
+// @param max_age_us a snapshot up to this age is accepted, 0 : read the device
+int mcp2221_client_get_gpio(MCP2221Client *client, GPIOSnapshot *snapshot, int max_age_us) {
+	DaemonRequest  request;
+	DaemonResponse response;
+	int ret;
+
+	if (max_age_us < 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	memset(&request, 0, sizeof(request));
+
+	request.op         = DAEMON_OP_GET_GPIO;
+	request.max_age_us = max_age_us;
+
+	ret = mcp2221_client_call(client, &request, &response);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	for (int i = 0 ; i < 4 ; i++) {
+		snapshot->value[i]     = (GPIOValue)response.value[i];
+		snapshot->direction[i] = (GPIODirection)response.direction[i];
+	}
+
+	return STATUS_OK;
+}
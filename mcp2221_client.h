@@ -0,0 +1,29 @@
+#ifndef __MCP2221_CLIENT_H__
+#define __MCP2221_CLIENT_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Client of the multiplexing daemon (see mcp2221_daemon.h).
+// Every call sends one request and waits for its response.
+
+typedef struct _MCP2221Client {
+	int fd;
+} MCP2221Client;
+
+int mcp2221_client_connect(MCP2221Client *client, const char *path);
+int mcp2221_client_close(MCP2221Client *client);
+int mcp2221_client_issue_command(MCP2221Client *client, uint8_t send_cmd[64], uint8_t recv_buf[64]);
+int mcp2221_client_set_gpio(MCP2221Client *client, int value_mask, int values, int direction_mask, int directions);
+int mcp2221_client_get_gpio(MCP2221Client *client, GPIOSnapshot *snapshot, int max_age_us);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,11 +3,20 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+
+#include <thread>
+#include <vector>
 
 #include "hidapi.h"
+#include "mcp2221.h"
+#include "mcp2221_metrics.h"
+#include "mcp2221_trace.h"
 
 #define READ_TIMEOUT_MS (1000)
 
+#define SCRIPT_LINE_MAX (1024)
+
 int mcp2221_send(hid_device *dev, uint8_t *data, int length) {
 	if (length < 0 || 64 < length) {
 		return -1;
@@ -55,7 +64,7 @@ int mcp2221_init(hid_device **dev) {
 	}
 
 	*dev = hid_open(0x04d8, 0x00dd, NULL);
-	if (dev == NULL) {
+	if (*dev == NULL) {
 		printf("hid_open error.\n");
 		return 1;
 	}
@@ -77,15 +86,637 @@ int mcp2221_destroy(hid_device *dev) {
 	return 0;
 }
 
+// ----- batch mode -----
+//
+// One command per line, all sent over the same open device :
+//
+//   # comment
+//   <byte> ... [= <byte | *> ...] [x<count>]
+//   delay <ms>
+//
+// The bytes before "=" are the command (the rest of the report is 0). The bytes after "=" are
+// compared with the response from byte 0, "*" matches any value. x<count> sends the line count times.
+// One result per command is printed, tab separated :
+//   <line> <iteration> <ok | mismatch | timeout | error> <latency us> <response bytes in hex>
+
+typedef struct _ScriptLine {
+	uint8_t cmd[64];
+	int     cmd_length;
+	int     expect[64];	// -1 : any
+	int     expect_length;
+	int     count;
+	int     delay_ms;	// delay line if > 0
+} ScriptLine;
+
+static uint64_t now_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// @return 1 : command / delay, 0 : blank or comment, -1 : syntax error
+static int parse_script_line(char *text, ScriptLine *line) {
+	char *comment = strchr(text, '#');
+	if (comment != NULL) {
+		*comment = '\0';
+	}
+
+	memset(line, 0, sizeof(ScriptLine));
+	line->count = 1;
+
+	int expecting = 0;
+	int tokens    = 0;
+	char *save;
+
+	for (char *token = strtok_r(text, " \t\r\n", &save) ; token != NULL ; token = strtok_r(NULL, " \t\r\n", &save)) {
+		char *end;
+
+		tokens++;
+
+		if (strcmp(token, "delay") == 0) {
+			char *ms = strtok_r(NULL, " \t\r\n", &save);
+
+			if (line->cmd_length != 0 || ms == NULL || (line->delay_ms = strtol(ms, &end, 0)) <= 0 || *end != '\0') {
+				return -1;
+			}
+			continue;
+		}
+		if (strcmp(token, "=") == 0) {
+			if (expecting || line->cmd_length == 0) {
+				return -1;
+			}
+			expecting = 1;
+			continue;
+		}
+		if (token[0] == 'x') {
+			if ((line->count = strtol(token + 1, &end, 10)) <= 0 || *end != '\0') {
+				return -1;
+			}
+			continue;
+		}
+
+		int value = -1;
+
+		if (!(expecting && strcmp(token, "*") == 0)) {
+			value = strtol(token, &end, 0);
+			if (*end != '\0' || value < 0 || 0xFF < value) {
+				return -1;
+			}
+		}
+
+		if (expecting) {
+			if (line->expect_length == 64) {
+				return -1;
+			}
+			line->expect[line->expect_length++] = value;
+		} else {
+			if (line->cmd_length == 64 || line->delay_ms > 0) {
+				return -1;
+			}
+			line->cmd[line->cmd_length++] = value;
+		}
+	}
+
+	if (line->delay_ms > 0) {
+		return line->cmd_length == 0 && line->expect_length == 0 ? 1 : -1;
+	}
+
+	if (line->cmd_length == 0) {
+		return tokens == 0 ? 0 : -1;
+	}
+
+	return 1;
+}
+
+// Send one 64 byte report and wait for the report echoing its code.
+// A report of another command is the late answer of a command which timed out, it is skipped.
+// @return STATUS_OK, STATUS_IO_ERROR or STATUS_RECV_TIMEOUT
+static int exchange(hid_device *dev, uint8_t send_data[64], uint8_t recv_data[64]) {
+	if (mcp2221_send(dev, send_data, 64) < 0) {
+		return STATUS_IO_ERROR;
+	}
+
+	uint64_t deadline = now_us() + READ_TIMEOUT_MS * 1000;
+
+	for (;;) {
+		uint64_t now = now_us();
+		if (now >= deadline) {
+			return STATUS_RECV_TIMEOUT;
+		}
+
+		int ret = hid_read_timeout(dev, recv_data, 64, (int)((deadline - now + 999) / 1000));
+		if (ret < 0) {
+			return STATUS_IO_ERROR;
+		}
+		if (ret == 0) {
+			return STATUS_RECV_TIMEOUT;
+		}
+		if (recv_data[0] == send_data[0]) {
+			return STATUS_OK;
+		}
+	}
+}
+
+static const char *run_script_command(hid_device *dev, const ScriptLine *line, uint8_t recv_data[64]) {
+	uint8_t send_data[64] = {0};
+
+	memcpy(send_data, line->cmd, line->cmd_length);
+
+	int ret = exchange(dev, send_data, recv_data);
+	if (ret == STATUS_RECV_TIMEOUT) {
+		return "timeout";
+	}
+	if (ret != STATUS_OK) {
+		return "error";
+	}
+
+	for (int i = 0 ; i < line->expect_length ; i++) {
+		if (line->expect[i] >= 0 && recv_data[i] != line->expect[i]) {
+			return "mismatch";
+		}
+	}
+
+	return "ok";
+}
+
+// @param keep_going continue after a failed command
+// @return 0 if every command succeeded
+static int run_script(hid_device *dev, FILE *fp, int keep_going) {
+	char text[SCRIPT_LINE_MAX];
+	ScriptLine line;
+	int number   = 0;
+	int commands = 0;
+	int failures = 0;
+
+	uint64_t start = now_us();
+
+	printf("# line\titeration\tresult\tlatency_us\tresponse\n");
+
+	while (fgets(text, sizeof(text), fp) != NULL) {
+		number++;
+
+		int ret = parse_script_line(text, &line);
+		if (ret < 0) {
+			fprintf(stderr, "line %d : syntax error\n", number);
+			return 1;
+		}
+		if (ret == 0) {
+			continue;
+		}
+
+		if (line.delay_ms > 0) {
+			struct timespec ts;
+			ts.tv_sec  = line.delay_ms / 1000;
+			ts.tv_nsec = (line.delay_ms % 1000) * 1000000L;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		for (int i = 0 ; i < line.count ; i++) {
+			uint8_t recv_data[64] = {0};
+
+			uint64_t sent = now_us();
+			const char *result = run_script_command(dev, &line, recv_data);
+			uint64_t latency = now_us() - sent;
+
+			printf("%d\t%d\t%s\t%llu\t", number, i, result, (unsigned long long)latency);
+			for (int j = 0 ; j < 64 ; j++) {
+				printf("%02x", recv_data[j]);
+			}
+			printf("\n");
+
+			commands++;
+
+			if (strcmp(result, "ok") != 0) {
+				failures++;
+
+				if (!keep_going) {
+					fprintf(stderr, "line %d : %s, stopped\n", number, result);
+					return 1;
+				}
+			}
+		}
+	}
+
+	uint64_t elapsed = now_us() - start;
+
+	fprintf(stderr, "%d commands, %d failed, %llu ms\n", commands, failures, (unsigned long long)(elapsed / 1000));
+
+	return failures == 0 ? 0 : 1;
+}
+
+// ----- replay mode -----
+//
+// Sends the command reports of a capture again, from one thread per device.
+// Two capture formats are read :
+//   - a capture file of the packet tracer (mcp2221_trace.h), its send records are replayed
+//   - text, one report per line : <time us> <report bytes in hex>, "#" starts a comment
+// The response of each command is awaited before the next one is sent.
+// By default the commands keep their original spacing (a late command is sent at once, the lag
+// is not caught up), with -a they are sent as fast as possible.
+
+typedef struct _ReplayCommand {
+	uint64_t offset_us;	// from the first command
+	uint8_t  data[64];
+} ReplayCommand;
+
+typedef struct _ReplayWorker {
+	hid_device *dev;
+	const std::vector<ReplayCommand> *commands;
+	int      loops;
+	int      as_fast;
+	uint64_t sent;
+	uint64_t failed;
+} ReplayWorker;
+
+// @return 1 : report, 0 : blank or comment, -1 : syntax error
+static int parse_replay_line(char *text, ReplayCommand *command) {
+	char *comment = strchr(text, '#');
+	if (comment != NULL) {
+		*comment = '\0';
+	}
+
+	memset(command, 0, sizeof(ReplayCommand));
+
+	char *save;
+	char *offset = strtok_r(text, " \t\r\n", &save);
+	if (offset == NULL) {
+		return 0;
+	}
+
+	char *hex = strtok_r(NULL, " \t\r\n", &save);
+	char *end;
+
+	command->offset_us = strtoull(offset, &end, 10);
+	if (*end != '\0' || hex == NULL || strtok_r(NULL, " \t\r\n", &save) != NULL) {
+		return -1;
+	}
+
+	int length = strlen(hex);
+	if (length == 0 || length % 2 != 0 || 128 < length) {
+		return -1;
+	}
+
+	for (int i = 0 ; i < length / 2 ; i++) {
+		char byte[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+
+		command->data[i] = strtol(byte, &end, 16);
+		if (*end != '\0') {
+			return -1;
+		}
+	}
+
+	return 1;
+}
+
+// @return 0 on success
+static int load_replay(const char *path, std::vector<ReplayCommand> *commands) {
+	char magic[4] = {0};
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("can not open %s.\n", path);
+		return 1;
+	}
+
+	if (fread(magic, sizeof(magic), 1, fp) == 1 && memcmp(magic, MCP2221_TRACE_MAGIC, 4) == 0) {
+		fclose(fp);
+
+		MCP2221TraceRecord *records;
+		int count;
+
+		if (mcp2221_trace_load(path, &records, &count) != STATUS_OK) {
+			return 1;
+		}
+
+		for (int i = 0 ; i < count ; i++) {
+			if (records[i].direction != MCP2221_TRACE_SEND || records[i].length == 0) {
+				continue;
+			}
+
+			ReplayCommand command = {};
+
+			// the offsets are rebased below
+			command.offset_us = records[i].timestamp_ns / 1000;
+			memcpy(command.data, records[i].data, records[i].length);
+			commands->push_back(command);
+		}
+
+		delete[] records;
+	} else {
+		char text[SCRIPT_LINE_MAX];
+		int number = 0;
+
+		rewind(fp);
+
+		while (fgets(text, sizeof(text), fp) != NULL) {
+			ReplayCommand command;
+
+			number++;
+
+			int ret = parse_replay_line(text, &command);
+			if (ret < 0) {
+				printf("%s line %d : syntax error\n", path, number);
+				fclose(fp);
+				return 1;
+			}
+			if (ret > 0) {
+				commands->push_back(command);
+			}
+		}
+
+		fclose(fp);
+	}
+
+	if (commands->empty()) {
+		printf("%s has no command.\n", path);
+		return 1;
+	}
+
+	uint64_t first    = (*commands)[0].offset_us;
+	uint64_t previous = first;
+
+	for (size_t i = 0 ; i < commands->size() ; i++) {
+		ReplayCommand *command = &(*commands)[i];
+
+		if (command->offset_us < previous) {
+			printf("%s : the times are not in order (command %d).\n", path, (int)i + 1);
+			return 1;
+		}
+		previous = command->offset_us;
+		command->offset_us -= first;
+	}
+
+	return 0;
+}
+
+static void sleep_until_us(uint64_t deadline) {
+	uint64_t now = now_us();
+
+	if (now < deadline) {
+		struct timespec ts;
+		ts.tv_sec  = (deadline - now) / 1000000;
+		ts.tv_nsec = ((deadline - now) % 1000000) * 1000;
+		nanosleep(&ts, NULL);
+	}
+}
+
+static void replay_worker(ReplayWorker *worker) {
+	const std::vector<ReplayCommand> &commands = *worker->commands;
+
+	for (int loop = 0 ; loop < worker->loops ; loop++) {
+		uint64_t start = now_us();
+
+		for (size_t i = 0 ; i < commands.size() ; i++) {
+			uint8_t send_data[64];
+			uint8_t recv_data[64];
+
+			if (!worker->as_fast) {
+				sleep_until_us(start + commands[i].offset_us);
+			}
+
+			memcpy(send_data, commands[i].data, 64);
+
+			uint64_t sent = now_us();
+			int ret = exchange(worker->dev, send_data, recv_data);
+
+			mcp2221_metrics_command(send_data[0], ret, now_us() - sent);
+
+			worker->sent++;
+			if (ret != STATUS_OK) {
+				worker->failed++;
+			}
+		}
+	}
+}
+
+static void print_replay_report(const MCP2221Metrics *metrics) {
+	printf("opcode\tcommand\tcount\terrors\ttimeouts\tmean_us\tp50_us\tp90_us\tp99_us\n");
+
+	for (int op = 0 ; op < 256 ; op++) {
+		const MCP2221OpcodeMetrics *m = &metrics->opcode[op];
+
+		if (m->commands == 0) {
+			continue;
+		}
+
+		printf("0x%02x\t%s\t%llu\t%llu\t%llu\t%.0f\t%.0f\t%.0f\t%.0f\n",
+				op, mcp2221_opcode_name(op),
+				(unsigned long long)m->commands, (unsigned long long)m->errors, (unsigned long long)m->timeouts,
+				(double)m->latency_sum_us / m->commands,
+				mcp2221_metrics_quantile_us(m, 0.50),
+				mcp2221_metrics_quantile_us(m, 0.90),
+				mcp2221_metrics_quantile_us(m, 0.99));
+
+		// histogram, empty buckets are left out
+		for (int i = 0 ; i < MCP2221_METRICS_BUCKETS ; i++) {
+			if (m->latency_bucket[i] == 0) {
+				continue;
+			}
+
+			if (i < MCP2221_METRICS_BUCKETS - 1) {
+				printf("\t<= %u us\t%llu\n", mcp2221_metrics_bucket_us[i], (unsigned long long)m->latency_bucket[i]);
+			} else {
+				printf("\t>  %u us\t%llu\n", mcp2221_metrics_bucket_us[i - 1], (unsigned long long)m->latency_bucket[i]);
+			}
+		}
+	}
+}
+
+// @param devices   number of devices, one thread each, every thread replays the whole capture
+// @param loops     times the capture is replayed
+// @param as_fast   ignore the recorded timing
+// @param metrics_path Prometheus text file written at the end, may be NULL
+// @return 0 if every command succeeded
+static int run_replay(const char *path, int devices, int loops, int as_fast, const char *metrics_path) {
+	std::vector<ReplayCommand> commands;
+
+	if (load_replay(path, &commands) != 0) {
+		return 1;
+	}
+
+	if (hid_init() != 0) {
+		printf("hid_init error.\n");
+		return 1;
+	}
+
+	std::vector<ReplayWorker> workers;
+
+	struct hid_device_info *devs = hid_enumerate(0x04d8, 0x00dd);
+
+	for (struct hid_device_info *info = devs ; info != NULL && (int)workers.size() < devices ; info = info->next) {
+		ReplayWorker worker = {};
+
+		worker.dev = hid_open_path(info->path);
+		if (worker.dev == NULL) {
+			printf("can not open %s.\n", info->path);
+			continue;
+		}
+		worker.commands = &commands;
+		worker.loops    = loops;
+		worker.as_fast  = as_fast;
+		workers.push_back(worker);
+
+		printf("# device %d : %s\n", (int)workers.size() - 1, info->path);
+	}
+
+	hid_free_enumeration(devs);
+
+	if ((int)workers.size() < devices) {
+		printf("%d devices requested, %d opened.\n", devices, (int)workers.size());
+
+		for (size_t i = 0 ; i < workers.size() ; i++) {
+			hid_close(workers[i].dev);
+		}
+		hid_exit();
+		return 1;
+	}
+
+	mcp2221_metrics_start();
+
+	std::vector<std::thread> threads;
+	uint64_t start = now_us();
+
+	for (size_t i = 0 ; i < workers.size() ; i++) {
+		threads.push_back(std::thread(replay_worker, &workers[i]));
+	}
+	for (size_t i = 0 ; i < threads.size() ; i++) {
+		threads[i].join();
+	}
+
+	uint64_t elapsed = now_us() - start;
+
+	mcp2221_metrics_stop();
+
+	uint64_t sent   = 0;
+	uint64_t failed = 0;
+
+	for (size_t i = 0 ; i < workers.size() ; i++) {
+		printf("# device %d : %llu commands, %llu failed\n", (int)i, (unsigned long long)workers[i].sent, (unsigned long long)workers[i].failed);
+
+		sent   += workers[i].sent;
+		failed += workers[i].failed;
+
+		hid_close(workers[i].dev);
+	}
+
+	hid_exit();
+
+	printf("# %llu commands, %llu failed, %llu ms, %.1f commands/s\n",
+			(unsigned long long)sent, (unsigned long long)failed, (unsigned long long)(elapsed / 1000),
+			elapsed > 0 ? sent * 1e6 / elapsed : 0.0);
+
+	MCP2221Metrics *metrics = new MCP2221Metrics;
+	mcp2221_metrics_snapshot(metrics);
+
+	print_replay_report(metrics);
+
+	int ret = failed == 0 ? 0 : 1;
+
+	if (metrics_path != NULL) {
+		FILE *fp = fopen(metrics_path, "w");
+
+		if (fp == NULL || mcp2221_metrics_write_prometheus(fp, metrics) != STATUS_OK) {
+			printf("can not write %s.\n", metrics_path);
+			ret = 1;
+		}
+		if (fp != NULL) {
+			fclose(fp);
+		}
+	}
+
+	delete metrics;
+
+	return ret;
+}
+
+static void usage() {
+	printf("usage : ./mcp2221_cmd <byte1> <byte2> ...\n");
+	printf("        ./mcp2221_cmd -f <script | -> [-k]\n");
+	printf("          -f : run the commands of the script (- : stdin) over one open device\n");
+	printf("          -k : keep going after a failed command\n");
+	printf("        ./mcp2221_cmd -r <capture> [-a] [-n <devices>] [-l <loops>] [-m <file>]\n");
+	printf("          -r : replay the commands of a capture (trace file or text) and report the latencies\n");
+	printf("          -a : as fast as possible instead of the recorded timing\n");
+	printf("          -n : replay on this many devices at once, one thread each (default 1)\n");
+	printf("          -l : replay the capture this many times (default 1)\n");
+	printf("          -m : write the metrics in the Prometheus text format to file\n");
+}
+
 int main(int argc, char *argv[]) {
 	int ret;
 	hid_device *dev;
 
 	if (argc < 2) {
-		printf("usage : ./main <param1> <param2> ...\n");
+		usage();
 		return 1;
 	}
 
+	if (strcmp(argv[1], "-r") == 0) {
+		const char *metrics_path = NULL;
+		int devices = 1;
+		int loops   = 1;
+		int as_fast = 0;
+
+		if (argc < 3) {
+			usage();
+			return 1;
+		}
+
+		for (int i = 3 ; i < argc ; i++) {
+			if (strcmp(argv[i], "-a") == 0) {
+				as_fast = 1;
+			} else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+				devices = atoi(argv[++i]);
+			} else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+				loops = atoi(argv[++i]);
+			} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+				metrics_path = argv[++i];
+			} else {
+				usage();
+				return 1;
+			}
+		}
+
+		if (devices <= 0 || loops <= 0) {
+			usage();
+			return 1;
+		}
+
+		return run_replay(argv[2], devices, loops, as_fast, metrics_path);
+	}
+
+	if (strcmp(argv[1], "-f") == 0) {
+		if (argc < 3 || (argc == 4 && strcmp(argv[3], "-k") != 0) || 4 < argc) {
+			usage();
+			return 1;
+		}
+
+		FILE *fp = strcmp(argv[2], "-") == 0 ? stdin : fopen(argv[2], "r");
+		if (fp == NULL) {
+			printf("can not open %s.\n", argv[2]);
+			return 1;
+		}
+
+		ret = mcp2221_init(&dev);
+		if (ret != 0) {
+			printf("mcp2221_init error.\n");
+			return 1;
+		}
+
+		ret = run_script(dev, fp, argc == 4);
+
+		if (fp != stdin) {
+			fclose(fp);
+		}
+
+		mcp2221_destroy(dev);
+
+		return ret;
+	}
+
 	ret = mcp2221_init(&dev);
 	if (ret < 0) {
 		printf("mcp2221_init error.\n");
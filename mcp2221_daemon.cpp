@@ -0,0 +1,477 @@
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <thread>
+
+#include "mcp2221.h"
+#include "mcp2221_daemon.h"
+#include "mcp2221_private.h"
+
+#define DAEMON_MAX_CLIENTS (64)
+#define DAEMON_MAX_BATCH   (256)
+
+typedef struct _DaemonPending {
+	int            fd;
+	DaemonRequest  request;
+	DaemonResponse response;
+} DaemonPending;
+
+struct _MCP2221Daemon {
+	MCP2221Handle *handle;
+	int batch_window_us;
+
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int  listen_fd;
+	int  wake[2];
+
+	int clients[DAEMON_MAX_CLIENTS];
+	int client_count;
+
+	// requests of the current round
+	DaemonPending pending[DAEMON_MAX_BATCH];
+
+	std::atomic<uint64_t> stat_clients;
+	std::atomic<uint64_t> stat_requests;
+	std::atomic<uint64_t> stat_reports;
+	std::atomic<uint64_t> stat_coalesced;
+	std::atomic<uint64_t> stat_snapshot_hits;
+
+	std::thread thread;
+};
+
+// GPIO writes merged into the next 0x50 report
+typedef struct _DaemonGPIOBatch {
+	GPIOSetting gpio[4];
+	int         members[DAEMON_MAX_BATCH];
+	int         count;
+} DaemonGPIOBatch;
+
+static void mcp2221_daemon_count(std::atomic<uint64_t> *stat, uint64_t n) {
+	stat->fetch_add(n, std::memory_order_relaxed);
+}
+
+static void mcp2221_daemon_accept(MCP2221Daemon *daemon) {
+	int fd = accept4(daemon->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (fd < 0) {
+		return;
+	}
+
+	if (daemon->client_count == DAEMON_MAX_CLIENTS) {
+		close(fd);
+		return;
+	}
+
+	daemon->clients[daemon->client_count++] = fd;
+	mcp2221_daemon_count(&daemon->stat_clients, 1);
+}
+
+// Take the requests already queued on the client sockets.
+// A client which went away is closed after the responses of this round are sent.
+static void mcp2221_daemon_collect(MCP2221Daemon *daemon, struct pollfd *fds, DaemonPending *pending, int *count, int *closed) {
+	for (int i = 0 ; i < daemon->client_count ; i++) {
+		if (fds[i].revents == 0 || closed[i]) {
+			continue;
+		}
+
+		while (*count < DAEMON_MAX_BATCH) {
+			DaemonPending *p = &pending[*count];
+			ssize_t n = recv(daemon->clients[i], &p->request, sizeof(p->request), MSG_DONTWAIT);
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				break;
+			}
+			if (n <= 0) {
+				closed[i] = 1;
+				fds[i].fd = -1;
+				break;
+			}
+
+			memset(&p->response, 0, sizeof(p->response));
+			p->fd = daemon->clients[i];
+
+			if (n != sizeof(p->request)) {
+				// answered with STATUS_ARGUMENT_ERROR
+				p->request.op = 0;
+			}
+
+			(*count)++;
+		}
+	}
+}
+
+static int mcp2221_daemon_gpio_conflict(DaemonGPIOBatch *batch, DaemonRequest *request) {
+	for (int i = 0 ; i < 4 ; i++) {
+		GPIOSetting *gpio = &batch->gpio[i];
+
+		if (
+				(request->value_mask & GPIO_PORT_MASK(i)) &&
+				gpio->enable_value &&
+				gpio->value != ((request->values & GPIO_PORT_MASK(i)) ? GPIO_VALUE_H : GPIO_VALUE_L)
+		) {
+			return 1;
+		}
+		if (
+				(request->direction_mask & GPIO_PORT_MASK(i)) &&
+				gpio->enable_direction &&
+				gpio->direction != ((request->directions & GPIO_PORT_MASK(i)) ? GPIO_DIR_IN : GPIO_DIR_OUT)
+		) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void mcp2221_daemon_gpio_merge(DaemonGPIOBatch *batch, DaemonRequest *request) {
+	for (int i = 0 ; i < 4 ; i++) {
+		if (request->value_mask & GPIO_PORT_MASK(i)) {
+			batch->gpio[i].enable_value = 1;
+			batch->gpio[i].value        = (request->values & GPIO_PORT_MASK(i)) ? GPIO_VALUE_H : GPIO_VALUE_L;
+		}
+		if (request->direction_mask & GPIO_PORT_MASK(i)) {
+			batch->gpio[i].enable_direction = 1;
+			batch->gpio[i].direction        = (request->directions & GPIO_PORT_MASK(i)) ? GPIO_DIR_IN : GPIO_DIR_OUT;
+		}
+	}
+}
+
+// One report for every write of the batch. They share its status.
+static void mcp2221_daemon_gpio_flush(MCP2221Daemon *daemon, DaemonGPIOBatch *batch, DaemonPending *pending) {
+	if (batch->count == 0) {
+		return;
+	}
+
+	int status = mcp2221_set_gpio_output(daemon->handle, batch->gpio);
+
+	mcp2221_daemon_count(&daemon->stat_reports, 1);
+	mcp2221_daemon_count(&daemon->stat_coalesced, batch->count - 1);
+
+	for (int i = 0 ; i < batch->count ; i++) {
+		pending[batch->members[i]].response.status = status;
+	}
+
+	memset(batch, 0, sizeof(DaemonGPIOBatch));
+}
+
+static void mcp2221_daemon_get_gpio(MCP2221Daemon *daemon, DaemonPending *p) {
+	MCP2221Handle *handle = daemon->handle;
+	GPIOSnapshot snapshot;
+	int hit = 0;
+
+	if (p->request.max_age_us > 0) {
+		mcp2221_state_lock(handle);
+
+		// no write since the snapshot, it was invalidated otherwise
+		if (handle->gpio_cache_valid && mcp2221_get_time_us() - handle->gpio_cache_time_us <= p->request.max_age_us) {
+			snapshot = handle->gpio_cache;
+			hit = 1;
+		}
+
+		mcp2221_state_unlock(handle);
+	}
+
+	if (hit) {
+		mcp2221_daemon_count(&daemon->stat_snapshot_hits, 1);
+	} else {
+		p->response.status = mcp2221_get_gpio_snapshot(handle, &snapshot);
+		mcp2221_daemon_count(&daemon->stat_reports, 1);
+
+		if (p->response.status != STATUS_OK) {
+			return;
+		}
+	}
+
+	for (int i = 0 ; i < 4 ; i++) {
+		p->response.value[i]     = snapshot.value[i];
+		p->response.direction[i] = snapshot.direction[i];
+	}
+}
+
+// Run the requests in arrival order. Consecutive compatible GPIO writes share one report,
+// any other request first sends the pending writes so that every client sees its own writes.
+static void mcp2221_daemon_execute(MCP2221Daemon *daemon, DaemonPending *pending, int count) {
+	DaemonGPIOBatch batch;
+
+	memset(&batch, 0, sizeof(batch));
+
+	for (int i = 0 ; i < count ; i++) {
+		DaemonPending *p = &pending[i];
+		DaemonRequest *request = &p->request;
+
+		switch (request->op) {
+			case DAEMON_OP_SET_GPIO:
+				if ((request->value_mask | request->direction_mask) & ~GPIO_PORT_MASK_ALL) {
+					p->response.status = STATUS_ARGUMENT_ERROR;
+					break;
+				}
+				if (mcp2221_daemon_gpio_conflict(&batch, request)) {
+					mcp2221_daemon_gpio_flush(daemon, &batch, pending);
+				}
+				mcp2221_daemon_gpio_merge(&batch, request);
+				batch.members[batch.count++] = i;
+				break;
+
+			case DAEMON_OP_GET_GPIO:
+				mcp2221_daemon_gpio_flush(daemon, &batch, pending);
+				mcp2221_daemon_get_gpio(daemon, p);
+				break;
+
+			case DAEMON_OP_COMMAND:
+				mcp2221_daemon_gpio_flush(daemon, &batch, pending);
+				p->response.status = mcp2221_issue_command(daemon->handle, request->report, p->response.report);
+				mcp2221_daemon_count(&daemon->stat_reports, 1);
+
+				// the command may have changed anything
+				mcp2221_invalidate_gpio_cache(daemon->handle);
+				mcp2221_invalidate_setting(daemon->handle);
+				break;
+
+			default:
+				p->response.status = STATUS_ARGUMENT_ERROR;
+				break;
+		}
+	}
+
+	mcp2221_daemon_gpio_flush(daemon, &batch, pending);
+}
+
+// fds[0] : wake pipe, fds[1] : listening socket, fds[2 + i] : clients[i]
+#define DAEMON_FD_WAKE   (0)
+#define DAEMON_FD_LISTEN (1)
+#define DAEMON_FD_CLIENT (2)
+
+static void mcp2221_daemon_run(MCP2221Daemon *daemon) {
+	DaemonPending *pending = daemon->pending;
+	struct pollfd fds[DAEMON_FD_CLIENT + DAEMON_MAX_CLIENTS];
+	int closed[DAEMON_MAX_CLIENTS];
+
+	fds[DAEMON_FD_WAKE].fd       = daemon->wake[0];
+	fds[DAEMON_FD_WAKE].events   = POLLIN;
+	fds[DAEMON_FD_LISTEN].fd     = daemon->listen_fd;
+	fds[DAEMON_FD_LISTEN].events = POLLIN;
+
+	for (;;) {
+		for (int i = 0 ; i < daemon->client_count ; i++) {
+			fds[DAEMON_FD_CLIENT + i].fd     = daemon->clients[i];
+			fds[DAEMON_FD_CLIENT + i].events = POLLIN;
+		}
+
+		if (poll(fds, DAEMON_FD_CLIENT + daemon->client_count, -1) < 0) {
+			continue;
+		}
+
+		if (fds[DAEMON_FD_WAKE].revents != 0) {
+			break;
+		}
+
+		int count = 0;
+		memset(closed, 0, sizeof(closed));
+
+		mcp2221_daemon_collect(daemon, fds + DAEMON_FD_CLIENT, pending, &count, closed);
+
+		// give the other clients (also the ones connecting now) a chance to join the batch
+		if (count > 0 && daemon->batch_window_us > 0) {
+			uint64_t deadline = mcp2221_get_time_us() + daemon->batch_window_us;
+
+			for (uint64_t now = mcp2221_get_time_us() ; now < deadline && count < DAEMON_MAX_BATCH ; now = mcp2221_get_time_us()) {
+				int timeout_ms = (deadline - now + 999) / 1000;
+
+				if (fds[DAEMON_FD_LISTEN].revents & POLLIN) {
+					int n = daemon->client_count;
+
+					mcp2221_daemon_accept(daemon);
+
+					if (n < daemon->client_count) {
+						fds[DAEMON_FD_CLIENT + n].fd      = daemon->clients[n];
+						fds[DAEMON_FD_CLIENT + n].events  = POLLIN;
+						fds[DAEMON_FD_CLIENT + n].revents = 0;
+					}
+				}
+
+				if (poll(fds + DAEMON_FD_LISTEN, 1 + daemon->client_count, timeout_ms) <= 0) {
+					break;
+				}
+				mcp2221_daemon_collect(daemon, fds + DAEMON_FD_CLIENT, pending, &count, closed);
+			}
+		}
+
+		mcp2221_daemon_count(&daemon->stat_requests, count);
+
+		mcp2221_daemon_execute(daemon, pending, count);
+
+		for (int i = 0 ; i < count ; i++) {
+			send(pending[i].fd, &pending[i].response, sizeof(DaemonResponse), MSG_NOSIGNAL);
+		}
+
+		// drop the clients which went away
+		int kept = 0;
+		for (int i = 0 ; i < daemon->client_count ; i++) {
+			if (closed[i]) {
+				close(daemon->clients[i]);
+			} else {
+				daemon->clients[kept++] = daemon->clients[i];
+			}
+		}
+		daemon->client_count = kept;
+
+		if (fds[DAEMON_FD_LISTEN].revents & POLLIN) {
+			mcp2221_daemon_accept(daemon);
+		}
+	}
+}
+
+// Write the default socket path (see MCP2221_DAEMON_SOCKET) to path.
+int mcp2221_daemon_default_socket(char *path, int size) {
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	int n;
+
+	if (path == NULL || size <= 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (runtime_dir != NULL && runtime_dir[0] == '/') {
+		n = snprintf(path, size, "%s/%s", runtime_dir, MCP2221_DAEMON_SOCKET_NAME);
+	} else {
+		n = snprintf(path, size, "%s", MCP2221_DAEMON_SOCKET);
+	}
+
+	return (0 <= n && n < size) ? STATUS_OK : STATUS_ARGUMENT_ERROR;
+}
+
+// Serve the handle on the socket at path (NULL : mcp2221_daemon_default_socket).
+// The handle is used only by the daemon thread until mcp2221_daemon_stop.
+// @param batch_window_us time to wait for more requests once one arrived, 0 : only the ones already queued
+int mcp2221_daemon_start(MCP2221Daemon **daemon, MCP2221Handle *handle, const char *path, int batch_window_us) {
+	struct sockaddr_un addr;
+	char default_path[sizeof(addr.sun_path)];
+
+	if (daemon == NULL || handle == NULL || batch_window_us < 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (path == NULL) {
+		if (mcp2221_daemon_default_socket(default_path, sizeof(default_path)) != STATUS_OK) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+		path = default_path;
+	}
+	if (sizeof(addr.sun_path) <= strlen(path)) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		printf("[ERROR] socket error.\n");
+		return STATUS_IO_ERROR;
+	}
+
+	// A socket file left by a previous daemon is removed, one which is still served is not taken over.
+	int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (probe < 0) {
+		printf("[ERROR] socket error.\n");
+		close(fd);
+		return STATUS_IO_ERROR;
+	}
+
+	int connected = connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	int stale     = !connected && errno == ECONNREFUSED;
+
+	close(probe);
+
+	if (connected) {
+		printf("[ERROR] a daemon is already serving %s.\n", path);
+		close(fd);
+		return STATUS_IO_ERROR;
+	}
+	if (stale) {
+		unlink(path);
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		printf("[ERROR] cannot listen on %s.\n", path);
+		close(fd);
+		return STATUS_IO_ERROR;
+	}
+
+	// nobody can connect before listen, the mode is set by then
+	if (chmod(path, MCP2221_DAEMON_SOCKET_MODE) != 0 || listen(fd, 16) != 0) {
+		printf("[ERROR] cannot listen on %s.\n", path);
+		close(fd);
+		unlink(path);
+		return STATUS_IO_ERROR;
+	}
+
+	MCP2221Daemon *d = new MCP2221Daemon;
+
+	if (pipe2(d->wake, O_CLOEXEC) != 0) {
+		close(fd);
+		unlink(path);
+		delete d;
+		return STATUS_IO_ERROR;
+	}
+
+	d->handle          = handle;
+	d->batch_window_us = batch_window_us;
+	d->listen_fd       = fd;
+	d->client_count    = 0;
+	strcpy(d->path, path);
+
+	d->stat_clients.store(0);
+	d->stat_requests.store(0);
+	d->stat_reports.store(0);
+	d->stat_coalesced.store(0);
+	d->stat_snapshot_hits.store(0);
+
+	d->thread = std::thread(mcp2221_daemon_run, d);
+
+	*daemon = d;
+
+	return STATUS_OK;
+}
+
+// Disconnect every client and remove the socket. The handle stays open.
+int mcp2221_daemon_stop(MCP2221Daemon *daemon) {
+	char c = 0;
+
+	if (daemon == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (write(daemon->wake[1], &c, 1) != 1) {
+		return STATUS_IO_ERROR;
+	}
+	daemon->thread.join();
+
+	for (int i = 0 ; i < daemon->client_count ; i++) {
+		close(daemon->clients[i]);
+	}
+	close(daemon->listen_fd);
+	close(daemon->wake[0]);
+	close(daemon->wake[1]);
+	unlink(daemon->path);
+
+	delete daemon;
+
+	return STATUS_OK;
+}
+
+void mcp2221_daemon_get_stats(MCP2221Daemon *daemon, DaemonStats *stats) {
+	stats->clients       = daemon->stat_clients.load(std::memory_order_relaxed);
+	stats->requests      = daemon->stat_requests.load(std::memory_order_relaxed);
+	stats->reports       = daemon->stat_reports.load(std::memory_order_relaxed);
+	stats->coalesced     = daemon->stat_coalesced.load(std::memory_order_relaxed);
+	stats->snapshot_hits = daemon->stat_snapshot_hits.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,72 @@
+#ifndef __MCP2221_DAEMON_H__
+#define __MCP2221_DAEMON_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Multiplexing daemon
+//
+// One process keeps the handle open and serves local clients over a Unix domain socket
+// (SOCK_SEQPACKET, one fixed size message per request / response).
+// GPIO writes of different clients which are pending at the same time are merged into one 0x50
+// report, GPIO reads are answered from the last 0x51 snapshot if it is young enough for the client.
+// Requests of one client are executed in order. See mcp2221_client.h for the client side.
+
+// Default socket: $XDG_RUNTIME_DIR/mcp2221.sock when it is set, MCP2221_DAEMON_SOCKET otherwise.
+// Both directories are writable only by their owner, nobody else can take the name first.
+#define MCP2221_DAEMON_SOCKET      "/run/mcp2221.sock"
+#define MCP2221_DAEMON_SOCKET_NAME "mcp2221.sock"
+// the socket is chmod'ed to this after bind, whatever the umask
+#define MCP2221_DAEMON_SOCKET_MODE (0660)
+
+#define DAEMON_OP_COMMAND  (0x01)	// pass a 64 byte report through
+#define DAEMON_OP_SET_GPIO (0x02)
+#define DAEMON_OP_GET_GPIO (0x03)
+
+typedef struct _DaemonRequest {
+	uint8_t  op;
+	// DAEMON_OP_SET_GPIO : bit n selects / holds GPn
+	uint8_t  value_mask;
+	uint8_t  values;
+	uint8_t  direction_mask;
+	uint8_t  directions;
+	uint8_t  reserved[3];
+	// DAEMON_OP_GET_GPIO : accepted age of the snapshot, 0 : read the device
+	uint32_t max_age_us;
+	// DAEMON_OP_COMMAND
+	uint8_t  report[64];
+} DaemonRequest;
+
+typedef struct _DaemonResponse {
+	uint8_t status;		// STATUS_*
+	uint8_t value[4];	// DAEMON_OP_GET_GPIO, GPIOValue
+	uint8_t direction[4];	// DAEMON_OP_GET_GPIO, GPIODirection
+	uint8_t reserved[3];
+	uint8_t report[64];	// DAEMON_OP_COMMAND
+} DaemonResponse;
+
+typedef struct _DaemonStats {
+	uint64_t clients;
+	uint64_t requests;
+	uint64_t reports;		// reports sent to the device
+	uint64_t coalesced;		// GPIO writes merged into a report of another request
+	uint64_t snapshot_hits;		// GPIO reads answered without a report
+} DaemonStats;
+
+typedef struct _MCP2221Daemon MCP2221Daemon;
+
+int mcp2221_daemon_default_socket(char *path, int size);
+int mcp2221_daemon_start(MCP2221Daemon **daemon, MCP2221Handle *handle, const char *path, int batch_window_us);
+int mcp2221_daemon_stop(MCP2221Daemon *daemon);
+void mcp2221_daemon_get_stats(MCP2221Daemon *daemon, DaemonStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,143 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/un.h>
+
+#include "mcp2221.h"
+#include "mcp2221_daemon.h"
+#include "mcp2221_metrics.h"
+#include "mcp2221_sim.h"
+
+static void usage() {
+	printf("usage : ./mcp2221_daemon [-s <socket>] [-w <batch window us>] [-m <metrics file>] [--serial <serial> | --path <hid path> | --sim]\n");
+	printf("        default socket : $XDG_RUNTIME_DIR/%s, %s without it\n", MCP2221_DAEMON_SOCKET_NAME, MCP2221_DAEMON_SOCKET);
+	printf("        SIGUSR1 writes the metrics file (Prometheus text format)\n");
+}
+
+static void write_metrics(const char *path) {
+	static MCP2221Metrics metrics;
+
+	mcp2221_metrics_snapshot(&metrics);
+
+	// replaced at once, a collector never reads a partial file
+	char tmp[4096];
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	FILE *fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		printf("[ERROR] can not open %s.\n", tmp);
+		return;
+	}
+
+	int ret = mcp2221_metrics_write_prometheus(fp, &metrics);
+
+	if (fclose(fp) != 0 || ret != STATUS_OK || rename(tmp, path) != 0) {
+		printf("[ERROR] can not write %s.\n", path);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int ret;
+	const char *socket_path  = NULL;
+	const char *serial       = NULL;
+	const char *hid_path     = NULL;
+	const char *metrics_path = NULL;
+	int batch_window_us      = 0;
+	int use_sim              = 0;
+
+	for (int i = 1 ; i < argc ; i++) {
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+			socket_path = argv[++i];
+		} else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			batch_window_us = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+			metrics_path = argv[++i];
+		} else if (strcmp(argv[i], "--serial") == 0 && i + 1 < argc) {
+			serial = argv[++i];
+		} else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+			hid_path = argv[++i];
+		} else if (strcmp(argv[i], "--sim") == 0) {
+			use_sim = 1;
+		} else {
+			usage();
+			return 1;
+		}
+	}
+
+	MCP2221Handle handle;
+	static MCP2221Sim sim;
+
+	if (use_sim) {
+		MCP2221Transport transport;
+
+		mcp2221_sim_init(&sim, NULL);
+		mcp2221_sim_get_transport(&sim, &transport);
+
+		ret = mcp2221_init_with_transport(&handle, &transport);
+	} else if (serial != NULL) {
+		ret = mcp2221_init_by_serial(&handle, serial);
+	} else if (hid_path != NULL) {
+		ret = mcp2221_init_by_path(&handle, hid_path);
+	} else {
+		ret = mcp2221_init(&handle);
+	}
+	if (ret != STATUS_OK) {
+		return 1;
+	}
+
+	// handled by sigwait, the daemon thread inherits the mask
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	if (metrics_path != NULL) {
+		mcp2221_metrics_start();
+	}
+
+	MCP2221Daemon *daemon;
+	char default_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+	if (socket_path == NULL) {
+		if (mcp2221_daemon_default_socket(default_path, sizeof(default_path)) != STATUS_OK) {
+			printf("[ERROR] the default socket path is too long, use -s.\n");
+			mcp2221_destroy(&handle);
+			return 1;
+		}
+		socket_path = default_path;
+	}
+
+	ret = mcp2221_daemon_start(&daemon, &handle, socket_path, batch_window_us);
+	if (ret != STATUS_OK) {
+		mcp2221_destroy(&handle);
+		return 1;
+	}
+
+	printf("listening on %s\n", socket_path);
+
+	int sig;
+	while (sigwait(&signals, &sig) == 0 && sig == SIGUSR1) {
+		if (metrics_path != NULL) {
+			write_metrics(metrics_path);
+		}
+	}
+
+	DaemonStats stats;
+	mcp2221_daemon_get_stats(daemon, &stats);
+	mcp2221_daemon_stop(daemon);
+
+	printf("clients %llu, requests %llu, reports %llu, coalesced %llu, snapshot hits %llu\n",
+			(unsigned long long)stats.clients, (unsigned long long)stats.requests, (unsigned long long)stats.reports,
+			(unsigned long long)stats.coalesced, (unsigned long long)stats.snapshot_hits);
+
+	if (metrics_path != NULL) {
+		write_metrics(metrics_path);
+	}
+
+	mcp2221_destroy(&handle);
+
+	return 0;
+}
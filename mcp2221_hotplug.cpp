@@ -0,0 +1,445 @@
+
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <libudev.h>
+
+#include "mcp2221.h"
+#include "mcp2221_hotplug.h"
+#include "mcp2221_private.h"
+
+// reopen attempts after an arrival, the delay doubles after every failed open
+#define HOTPLUG_REOPEN_BACKOFF_US     (10000)
+#define HOTPLUG_REOPEN_BACKOFF_MAX_US (1000000)
+
+// Installed as the transport of the handle : the events are applied before a report is sent
+// and the reports fail while the device is gone, whatever the transport below.
+struct _MCP2221Hotplug {
+	MCP2221Handle   *handle;
+	MCP2221Transport inner;
+	int (*inner_send_report)(MCP2221Handle *handle, uint8_t report[65]);
+	int              monitored;	// registered with the udev monitor
+
+	char serial[64];
+
+	// hidraw node of the opened device
+	char path[256];
+
+	// HOTPLUG_EVENT_*, taken by the thread doing the I/O
+	std::atomic<int> event;
+	char added_path[256];
+
+	// cleared by a removal, set by a successful reopen
+	std::atomic<int> connected;
+
+	// an arrival whose node could not be opened yet, used by the I/O thread only
+	int      reopen_pending;
+	uint64_t reopen_next_us;
+	int      reopen_backoff_us;
+
+	MCP2221Hotplug *next;
+};
+
+// start / stop of the monitor
+static std::mutex hotplug_lifecycle_mutex;
+static int        hotplug_users = 0;
+
+// registered handles, shared with the monitor thread
+static std::mutex      hotplug_mutex;
+static MCP2221Hotplug *hotplug_head = NULL;
+
+static struct udev         *hotplug_udev    = NULL;
+static struct udev_monitor *hotplug_monitor = NULL;
+static int                  hotplug_wake[2] = {-1, -1};
+static std::thread          hotplug_thread;
+
+// called with hotplug_mutex held
+static void mcp2221_hotplug_post_locked(MCP2221Hotplug *hotplug, int event, const char *path) {
+	if (event == HOTPLUG_EVENT_ADDED) {
+		snprintf(hotplug->added_path, sizeof(hotplug->added_path), "%s", path != NULL ? path : "");
+	}
+	hotplug->event.store(event, std::memory_order_release);
+}
+
+static void mcp2221_hotplug_dispatch(struct udev_device *dev) {
+	const char *action  = udev_device_get_action(dev);
+	const char *devnode = udev_device_get_devnode(dev);
+
+	if (action == NULL || devnode == NULL) {
+		return;
+	}
+
+	if (strcmp(action, "remove") == 0) {
+		std::lock_guard<std::mutex> lock(hotplug_mutex);
+
+		for (MCP2221Hotplug *cur = hotplug_head ; cur != NULL ; cur = cur->next) {
+			if (cur->monitored && strcmp(cur->path, devnode) == 0) {
+				mcp2221_hotplug_post_locked(cur, HOTPLUG_EVENT_REMOVED, NULL);
+			}
+		}
+	} else if (strcmp(action, "add") == 0) {
+		struct udev_device *usb = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
+		if (usb == NULL) {
+			return;
+		}
+
+		const char *vid    = udev_device_get_sysattr_value(usb, "idVendor");
+		const char *pid    = udev_device_get_sysattr_value(usb, "idProduct");
+		const char *serial = udev_device_get_sysattr_value(usb, "serial");
+
+		if (vid == NULL || pid == NULL || serial == NULL) {
+			return;
+		}
+		if (strcmp(vid, "04d8") != 0 || strcmp(pid, "00dd") != 0) {
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(hotplug_mutex);
+
+		for (MCP2221Hotplug *cur = hotplug_head ; cur != NULL ; cur = cur->next) {
+			if (cur->monitored && strcmp(cur->serial, serial) == 0) {
+				mcp2221_hotplug_post_locked(cur, HOTPLUG_EVENT_ADDED, devnode);
+			}
+		}
+	}
+}
+
+static void mcp2221_hotplug_run() {
+	struct pollfd fds[2];
+
+	fds[0].fd     = udev_monitor_get_fd(hotplug_monitor);
+	fds[0].events = POLLIN;
+	fds[1].fd     = hotplug_wake[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			continue;
+		}
+
+		if (fds[1].revents != 0) {
+			break;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			struct udev_device *dev = udev_monitor_receive_device(hotplug_monitor);
+
+			if (dev != NULL) {
+				mcp2221_hotplug_dispatch(dev);
+				udev_device_unref(dev);
+			}
+		}
+	}
+}
+
+static void mcp2221_hotplug_release_monitor() {
+	if (hotplug_monitor != NULL) {
+		udev_monitor_unref(hotplug_monitor);
+		hotplug_monitor = NULL;
+	}
+	if (hotplug_udev != NULL) {
+		udev_unref(hotplug_udev);
+		hotplug_udev = NULL;
+	}
+	if (hotplug_wake[0] >= 0) {
+		close(hotplug_wake[0]);
+		close(hotplug_wake[1]);
+		hotplug_wake[0] = -1;
+		hotplug_wake[1] = -1;
+	}
+}
+
+static int mcp2221_hotplug_start_monitor() {
+	hotplug_udev = udev_new();
+	if (hotplug_udev == NULL) {
+		printf("[ERROR] udev_new error.\n");
+		return STATUS_IO_ERROR;
+	}
+
+	// events after the udev rules ran, the node has its final permissions
+	hotplug_monitor = udev_monitor_new_from_netlink(hotplug_udev, "udev");
+	if (hotplug_monitor == NULL) {
+		printf("[ERROR] udev_monitor_new_from_netlink error.\n");
+		mcp2221_hotplug_release_monitor();
+		return STATUS_IO_ERROR;
+	}
+
+	if (udev_monitor_filter_add_match_subsystem_devtype(hotplug_monitor, "hidraw", NULL) < 0 ||
+	    udev_monitor_enable_receiving(hotplug_monitor) < 0 ||
+	    pipe(hotplug_wake) != 0) {
+		printf("[ERROR] udev monitor error.\n");
+		mcp2221_hotplug_release_monitor();
+		return STATUS_IO_ERROR;
+	}
+
+	hotplug_thread = std::thread(mcp2221_hotplug_run);
+
+	return STATUS_OK;
+}
+
+static void mcp2221_hotplug_stop_monitor() {
+	char c = 0;
+
+	if (write(hotplug_wake[1], &c, 1) != 1) {
+		printf("[ERROR] hotplug wake error.\n");
+	}
+
+	hotplug_thread.join();
+
+	mcp2221_hotplug_release_monitor();
+}
+
+static int mcp2221_hotplug_take_event(MCP2221Hotplug *hotplug, char path[256]) {
+	if (hotplug->event.load(std::memory_order_acquire) == HOTPLUG_EVENT_NONE) {
+		return HOTPLUG_EVENT_NONE;
+	}
+
+	std::lock_guard<std::mutex> lock(hotplug_mutex);
+
+	int event = hotplug->event.exchange(HOTPLUG_EVENT_NONE);
+
+	if (event == HOTPLUG_EVENT_ADDED) {
+		memcpy(path, hotplug->added_path, 256);
+		if (path[0] != '\0') {
+			memcpy(hotplug->path, hotplug->added_path, sizeof(hotplug->path));
+		}
+	}
+
+	return event;
+}
+
+static void mcp2221_hotplug_close_inner(MCP2221Hotplug *hotplug) {
+	if (hotplug->connected.load(std::memory_order_relaxed) && hotplug->inner.close != NULL) {
+		hotplug->inner.close(hotplug->inner.context);
+	}
+	hotplug->connected.store(0, std::memory_order_release);
+}
+
+// Apply the hotplug events received since the last report (on the thread doing the I/O).
+// The node of an arrival may not be usable yet (udev rules, permissions) : it is kept and
+// opened again by the next reports, with a growing delay between the attempts.
+// @return STATUS_OK if the device is open
+static int mcp2221_hotplug_update(MCP2221Hotplug *hotplug) {
+	MCP2221Handle *handle = hotplug->handle;
+	char path[256];
+
+	switch (mcp2221_hotplug_take_event(hotplug, path)) {
+	case HOTPLUG_EVENT_REMOVED:
+		mcp2221_hotplug_close_inner(hotplug);
+		hotplug->reopen_pending = 0;
+		break;
+
+	case HOTPLUG_EVENT_ADDED:
+		mcp2221_hotplug_close_inner(hotplug);
+		if (path[0] != '\0') {
+			// the hid transport opens hid_path
+			memcpy(handle->hid_path, path, sizeof(handle->hid_path));
+		}
+
+		hotplug->reopen_pending    = 1;
+		hotplug->reopen_next_us    = 0;
+		hotplug->reopen_backoff_us = HOTPLUG_REOPEN_BACKOFF_US;
+		break;
+	}
+
+	if (!hotplug->reopen_pending) {
+		return hotplug->connected.load(std::memory_order_relaxed) ? STATUS_OK : STATUS_IO_ERROR;
+	}
+
+	uint64_t now = mcp2221_get_time_us();
+
+	if (now < hotplug->reopen_next_us) {
+		return STATUS_IO_ERROR;
+	}
+
+	if (hotplug->inner.open != NULL && hotplug->inner.open(hotplug->inner.context) != STATUS_OK) {
+		hotplug->reopen_next_us    = now + hotplug->reopen_backoff_us;
+		hotplug->reopen_backoff_us = std::min(2 * hotplug->reopen_backoff_us, HOTPLUG_REOPEN_BACKOFF_MAX_US);
+		return STATUS_IO_ERROR;
+	}
+
+	hotplug->reopen_pending = 0;
+	hotplug->connected.store(1, std::memory_order_release);
+
+	// the device came back with its power-on settings
+	mcp2221_state_lock(handle);
+	handle->gpio_cache_valid = 0;
+	handle->setting_valid    = 0;
+	mcp2221_state_unlock(handle);
+
+	return STATUS_OK;
+}
+
+// ----- transport of a handle with hotplug -----
+static int mcp2221_hotplug_open(void *context) {
+	MCP2221Hotplug *hotplug = (MCP2221Hotplug *)context;
+
+	return hotplug->inner.open != NULL ? hotplug->inner.open(hotplug->inner.context) : STATUS_OK;
+}
+
+static int mcp2221_hotplug_close(void *context) {
+	MCP2221Hotplug *hotplug = (MCP2221Hotplug *)context;
+
+	return hotplug->inner.close != NULL ? hotplug->inner.close(hotplug->inner.context) : STATUS_OK;
+}
+
+static int mcp2221_hotplug_send(void *context, const uint8_t *data, int length) {
+	MCP2221Hotplug *hotplug = (MCP2221Hotplug *)context;
+
+	if (mcp2221_hotplug_update(hotplug) != STATUS_OK) {
+		// disconnected
+		return STATUS_IO_ERROR;
+	}
+
+	return hotplug->inner.send(hotplug->inner.context, data, length);
+}
+
+static int mcp2221_hotplug_send_report(MCP2221Handle *handle, uint8_t report[65]) {
+	MCP2221Hotplug *hotplug = handle->hotplug;
+
+	if (mcp2221_hotplug_update(hotplug) != STATUS_OK) {
+		return STATUS_IO_ERROR;
+	}
+
+	return hotplug->inner_send_report(handle, report);
+}
+
+static int mcp2221_hotplug_recv(void *context, uint8_t *data, int length, int timeout_ms) {
+	MCP2221Hotplug *hotplug = (MCP2221Hotplug *)context;
+
+	if (!hotplug->connected.load(std::memory_order_relaxed)) {
+		return STATUS_IO_ERROR;
+	}
+
+	return hotplug->inner.recv(hotplug->inner.context, data, length, timeout_ms);
+}
+
+// called with hotplug_lifecycle_mutex held
+static void mcp2221_hotplug_attach_locked(MCP2221Handle *handle, int monitored) {
+	MCP2221Hotplug *hotplug = new MCP2221Hotplug;
+
+	hotplug->handle    = handle;
+	hotplug->inner     = handle->transport;
+
+	hotplug->inner_send_report = handle->send_report;
+	hotplug->monitored = monitored;
+
+	memcpy(hotplug->serial, handle->hid_serial, sizeof(hotplug->serial));
+	memcpy(hotplug->path, handle->hid_path, sizeof(hotplug->path));
+	hotplug->event.store(HOTPLUG_EVENT_NONE);
+	hotplug->added_path[0] = '\0';
+
+	hotplug->connected.store(1);
+
+	hotplug->reopen_pending    = 0;
+	hotplug->reopen_next_us    = 0;
+	hotplug->reopen_backoff_us = HOTPLUG_REOPEN_BACKOFF_US;
+
+	handle->transport.context = hotplug;
+	handle->transport.open    = mcp2221_hotplug_open;
+	handle->transport.close   = mcp2221_hotplug_close;
+	handle->transport.send    = mcp2221_hotplug_send;
+	handle->transport.recv    = mcp2221_hotplug_recv;
+
+	handle->send_report = hotplug->inner_send_report != NULL ? mcp2221_hotplug_send_report : NULL;
+
+	std::lock_guard<std::mutex> lock(hotplug_mutex);
+
+	hotplug->next = hotplug_head;
+	hotplug_head  = hotplug;
+
+	handle->hotplug = hotplug;
+}
+
+// Reopen the device when it comes back (hidraw backend).
+int mcp2221_set_auto_reopen(MCP2221Handle *handle, int enable) {
+	std::lock_guard<std::mutex> lifecycle(hotplug_lifecycle_mutex);
+
+	if (enable) {
+		if (handle->hotplug != NULL) {
+			return STATUS_OK;
+		}
+		if (handle->hid_serial[0] == '\0') {
+			// no way to recognize the device
+			return STATUS_ARGUMENT_ERROR;
+		}
+
+		if (hotplug_users == 0 && mcp2221_hotplug_start_monitor() != STATUS_OK) {
+			return STATUS_IO_ERROR;
+		}
+		hotplug_users++;
+
+		mcp2221_hotplug_attach_locked(handle, 1);
+	} else {
+		MCP2221Hotplug *hotplug = handle->hotplug;
+
+		if (hotplug == NULL) {
+			return STATUS_OK;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(hotplug_mutex);
+
+			for (MCP2221Hotplug **cur = &hotplug_head ; *cur != NULL ; cur = &(*cur)->next) {
+				if (*cur == hotplug) {
+					*cur = hotplug->next;
+					break;
+				}
+			}
+		}
+
+		// a device still gone stays closed, its close is a no-op for mcp2221_destroy
+		handle->transport   = hotplug->inner;
+		handle->send_report = hotplug->inner_send_report;
+		handle->hotplug     = NULL;
+
+		int monitored = hotplug->monitored;
+
+		delete hotplug;
+
+		if (monitored) {
+			hotplug_users--;
+			if (hotplug_users == 0) {
+				mcp2221_hotplug_stop_monitor();
+			}
+		}
+	}
+
+	return STATUS_OK;
+}
+
+// 0 between the removal of the device and its reopen.
+int mcp2221_is_connected(MCP2221Handle *handle) {
+	if (handle->hotplug != NULL) {
+		return handle->hotplug->event.load(std::memory_order_acquire) != HOTPLUG_EVENT_REMOVED &&
+		       handle->hotplug->connected.load(std::memory_order_acquire);
+	}
+
+	// a sim handle has no hid device
+	return handle->dev != NULL || handle->hid_path[0] == '\0';
+}
+
+// ----- events without udev -----
+int mcp2221_hotplug_attach(MCP2221Handle *handle) {
+	std::lock_guard<std::mutex> lifecycle(hotplug_lifecycle_mutex);
+
+	if (handle->hotplug == NULL) {
+		mcp2221_hotplug_attach_locked(handle, 0);
+	}
+
+	return STATUS_OK;
+}
+
+void mcp2221_hotplug_post(MCP2221Handle *handle, int event, const char *path) {
+	std::lock_guard<std::mutex> lock(hotplug_mutex);
+
+	if (handle->hotplug != NULL) {
+		mcp2221_hotplug_post_locked(handle->hotplug, event, path);
+	}
+}
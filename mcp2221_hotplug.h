@@ -0,0 +1,28 @@
+#ifndef __MCP2221_HOTPLUG_H__
+#define __MCP2221_HOTPLUG_H__
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Hotplug reopen
+//
+// A udev monitor thread (shared by every handle) watches hidraw devices.
+// When the device of a handle is removed, the commands fail with STATUS_IO_ERROR without
+// touching the stale file descriptor. When a device with the same serial number comes back,
+// the next commands reopen it (again after a growing delay while its node can't be opened yet),
+// so the handle recovers without a process restart.
+// The device comes back with its power-on settings, set up the GPIO again.
+//
+// Only handles whose device reports a serial number can be reopened.
+
+int mcp2221_set_auto_reopen(MCP2221Handle *handle, int enable);
+int mcp2221_is_connected(MCP2221Handle *handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,331 @@
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mcp2221.h"
+#include "mcp2221.hpp"
+#include "mcp2221_i2c.h"
+#include "mcp2221_private.h"
+
+// Number of reports answered with "busy" / "no data" before a transfer is given up.
+// Every retry is a full USB round trip, so no extra wait is needed.
+#define I2C_RETRY_MAX (100)
+
+#define I2C_READ_PARTIAL  (0x54)
+#define I2C_READ_COMPLETE (0x55)
+#define I2C_READ_ERROR    (127)
+
+// ----- command api -----
+
+// Status / Set Parameters
+// @param cancel 1 : cancel the current I2C transfer
+// @param speed_divider 0 : don't change the speed
+void mcp2221_command_status(uint8_t cmd[64], int cancel, int speed_divider) {
+	mcp2221::encode_status(cmd, cancel, speed_divider);
+}
+
+// I2C Write Data (0x90 / 0x92 / 0x94)
+// Every chunk carries the length of the whole transfer.
+void mcp2221_command_i2c_write(uint8_t cmd[64], int type, int address, int length, const uint8_t *data, int chunk) {
+	mcp2221::encode_i2c_write(cmd, type, address, length, data, chunk);
+}
+
+// I2C Read Data (0x91 / 0x93)
+void mcp2221_command_i2c_read(uint8_t cmd[64], int type, int address, int length) {
+	mcp2221::encode_i2c_read(cmd, type, address, length);
+}
+
+// Get I2C Data
+void mcp2221_command_i2c_get_data(uint8_t cmd[64]) {
+	mcp2221::encode_i2c_get_data(cmd);
+}
+
+// ----- helper api -----
+static int mcp2221_i2c_validate(int address, int length) {
+	if (address < 0 || 0x7F < address) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (length <= 0 || I2C_MAX_LENGTH < length) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+// Issue a command the I2C engine may refuse with "busy" (byte 1 != 0).
+static int mcp2221_i2c_issue_retry(MCP2221Handle *handle, mcp2221::Report *report, uint8_t buf[64]) {
+	const uint8_t *cmd = report->command();
+
+	for (int retry = 0 ; retry < I2C_RETRY_MAX ; retry++) {
+		int ret = mcp2221_issue_report(handle, report->wire, buf);
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		if (buf[0] != cmd[0]) {
+			PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+			return STATUS_IO_ERROR;
+		}
+
+		if (buf[1] == 0) {
+			return STATUS_OK;
+		}
+	}
+
+	return STATUS_IO_ERROR;
+}
+
+// Poll the status until the engine has sent everything or the slave did not answer.
+static int mcp2221_i2c_wait_write(MCP2221Handle *handle, int length) {
+	I2CStatus status;
+
+	for (int retry = 0 ; retry < I2C_RETRY_MAX ; retry++) {
+		int ret = mcp2221_i2c_get_status(handle, &status);
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		if (status.address_nack) {
+			mcp2221_i2c_cancel(handle);
+			return STATUS_I2C_NACK;
+		}
+
+		if (status.state == 0 || status.transferred_length == length) {
+			return STATUS_OK;
+		}
+	}
+
+	mcp2221_i2c_cancel(handle);
+	return STATUS_IO_ERROR;
+}
+
+static int mcp2221_i2c_write_transfer(MCP2221Handle *handle, int type, int address, const uint8_t *data, int length) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	if (mcp2221_i2c_validate(address, length) != STATUS_OK || data == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	for (int sent = 0 ; sent < length ; ) {
+		int chunk = length - sent < I2C_CHUNK_SIZE ? length - sent : I2C_CHUNK_SIZE;
+
+		mcp2221_command_i2c_write(cmd, type, address, length, data + sent, chunk);
+
+		int ret = mcp2221_i2c_issue_retry(handle, &report, buf);
+		if (ret != STATUS_OK) {
+			mcp2221_i2c_cancel(handle);
+			return ret;
+		}
+
+		sent += chunk;
+	}
+
+	return mcp2221_i2c_wait_write(handle, length);
+}
+
+static int mcp2221_i2c_read_transfer(MCP2221Handle *handle, int type, int address, uint8_t *data, int length) {
+	typedef mcp2221::layout::I2CGetData L;
+
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+	int retry = 0;
+
+	if (mcp2221_i2c_validate(address, length) != STATUS_OK || data == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	mcp2221_command_i2c_read(cmd, type, address, length);
+
+	int ret = mcp2221_i2c_issue_retry(handle, &report, buf);
+	if (ret != STATUS_OK) {
+		mcp2221_i2c_cancel(handle);
+		return ret;
+	}
+
+	mcp2221_command_i2c_get_data(cmd);
+
+	for (int received = 0 ; received < length ; ) {
+		ret = mcp2221_issue_report(handle, report.wire, buf);
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		if (buf[0] != L::code) {
+			PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+			return STATUS_IO_ERROR;
+		}
+
+		int state = L::State::get(buf);
+		int chunk = L::Length::get(buf);
+		int ready = buf[1] == 0 && (state == I2C_READ_PARTIAL || state == I2C_READ_COMPLETE);
+
+		if (!ready || chunk == 0) {
+			// no data yet, find out whether the slave answered at all
+			I2CStatus status;
+
+			ret = mcp2221_i2c_get_status(handle, &status);
+			if (ret != STATUS_OK) {
+				return ret;
+			}
+			if (status.address_nack) {
+				mcp2221_i2c_cancel(handle);
+				return STATUS_I2C_NACK;
+			}
+			if (++retry >= I2C_RETRY_MAX) {
+				mcp2221_i2c_cancel(handle);
+				return STATUS_IO_ERROR;
+			}
+			continue;
+		}
+
+		if (chunk == I2C_READ_ERROR || I2C_CHUNK_SIZE < chunk || length - received < chunk) {
+			mcp2221_i2c_cancel(handle);
+			return STATUS_IO_ERROR;
+		}
+
+		memcpy(data + received, buf + L::data, chunk);
+		received += chunk;
+		retry = 0;
+	}
+
+	return STATUS_OK;
+}
+
+// ----- high layer api -----
+int mcp2221_i2c_get_status(MCP2221Handle *handle, I2CStatus *status) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	mcp2221_command_status(cmd, 0, 0);
+
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	mcp2221::StatusView view(buf);
+
+	if (!view.ok()) {
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+		return STATUS_IO_ERROR;
+	}
+
+	status->cancel_status      = view.cancel_status();
+	status->speed_status       = view.speed_status();
+	status->state              = view.i2c_state();
+	status->requested_length   = view.requested_length();
+	status->transferred_length = view.transferred_length();
+	status->speed_divider      = view.speed_divider();
+	status->address            = view.i2c_address();
+	status->address_nack       = view.address_nack();
+	status->scl                = view.scl();
+	status->sda                = view.sda();
+	status->read_pending       = view.read_pending();
+
+	return STATUS_OK;
+}
+
+// Abort the current transfer and release the bus.
+// Sent even if the operation budget of the caller is spent, the bus must not stay busy.
+int mcp2221_i2c_cancel(MCP2221Handle *handle) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	mcp2221_command_status(cmd, 1, 0);
+
+	uint64_t budget = mcp2221_begin_budget(-1);
+	int ret = mcp2221_issue_report(handle, report.wire, buf);
+	mcp2221_end_budget(budget);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	if (buf[0] != 0x10 || buf[1] != 0) {
+		PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+		return STATUS_IO_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+static int mcp2221_i2c_set_speed_locked(MCP2221Handle *handle, int hz) {
+	mcp2221::Report report;
+	uint8_t *cmd = report.command();
+	uint8_t buf[64];
+
+	if (hz <= 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	int divider = 12000000 / hz - 3;
+	if (divider < 1 || 255 < divider) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	mcp2221_command_status(cmd, 0, divider);
+
+	for (int retry = 0 ; retry < 2 ; retry++) {
+		int ret = mcp2221_issue_report(handle, report.wire, buf);
+		if (ret != STATUS_OK) {
+			return ret;
+		}
+
+		if (buf[0] != 0x10 || buf[1] != 0) {
+			PRINT_DEBUG("[ERROR] ret = 0x%x\n", buf[0]);
+			return STATUS_IO_ERROR;
+		}
+
+		if (mcp2221::StatusView(buf).speed_status() == mcp2221::layout::Status::speed_applied) {
+			return STATUS_OK;
+		}
+
+		// a transfer is in progress, the speed can not be changed
+		mcp2221_i2c_cancel(handle);
+	}
+
+	return STATUS_IO_ERROR;
+}
+
+// Waits for a transfer of another thread on the handle instead of cancelling it.
+int mcp2221_i2c_set_speed(MCP2221Handle *handle, int hz) {
+	mcp2221_transaction_lock(handle);
+	int ret = mcp2221_i2c_set_speed_locked(handle, hz);
+	mcp2221_transaction_unlock(handle);
+
+	return ret;
+}
+
+int mcp2221_i2c_write(MCP2221Handle *handle, int address, const uint8_t *data, int length) {
+	mcp2221_transaction_lock(handle);
+	int ret = mcp2221_i2c_write_transfer(handle, I2C_CMD_WRITE, address, data, length);
+	mcp2221_transaction_unlock(handle);
+
+	return ret;
+}
+
+int mcp2221_i2c_read(MCP2221Handle *handle, int address, uint8_t *data, int length) {
+	mcp2221_transaction_lock(handle);
+	int ret = mcp2221_i2c_read_transfer(handle, I2C_CMD_READ, address, data, length);
+	mcp2221_transaction_unlock(handle);
+
+	return ret;
+}
+
+// Write without stop, then read after a repeated start.
+int mcp2221_i2c_write_read(MCP2221Handle *handle, int address, const uint8_t *wdata, int wlength, uint8_t *rdata, int rlength) {
+	mcp2221_transaction_lock(handle);
+
+	int ret = mcp2221_i2c_write_transfer(handle, I2C_CMD_WRITE_NO_STOP, address, wdata, wlength);
+	if (ret == STATUS_OK) {
+		ret = mcp2221_i2c_read_transfer(handle, I2C_CMD_READ_REPEATED_START, address, rdata, rlength);
+	}
+
+	mcp2221_transaction_unlock(handle);
+
+	return ret;
+}
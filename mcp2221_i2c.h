@@ -0,0 +1,59 @@
+#ifndef __MCP2221_I2C_H__
+#define __MCP2221_I2C_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// I2C master
+// Transfers longer than one report are split into 60 byte chunks.
+// address is the 7bit slave address.
+
+#define I2C_CHUNK_SIZE   (60)
+#define I2C_MAX_LENGTH   (65535)
+
+// I2C commands
+#define I2C_CMD_WRITE                 (0x90)
+#define I2C_CMD_READ                  (0x91)
+#define I2C_CMD_WRITE_REPEATED_START  (0x92)
+#define I2C_CMD_READ_REPEATED_START   (0x93)
+#define I2C_CMD_WRITE_NO_STOP         (0x94)
+
+typedef struct _I2CStatus {
+	// byte 2 : 0x10 marked for cancellation, 0x11 already idle
+	int cancel_status;
+	// byte 3 : 0x20 new speed applied, 0x21 not applied (transfer in progress)
+	int speed_status;
+	// byte 8 : internal state machine (0 : idle)
+	int state;
+	int requested_length;
+	int transferred_length;
+	int speed_divider;
+	int address;
+	int scl;
+	int sda;
+	int address_nack;
+	int read_pending;
+} I2CStatus;
+
+void mcp2221_command_status(uint8_t cmd[64], int cancel, int speed_divider);
+void mcp2221_command_i2c_write(uint8_t cmd[64], int type, int address, int length, const uint8_t *data, int chunk);
+void mcp2221_command_i2c_read(uint8_t cmd[64], int type, int address, int length);
+void mcp2221_command_i2c_get_data(uint8_t cmd[64]);
+
+int mcp2221_i2c_get_status(MCP2221Handle *handle, I2CStatus *status);
+int mcp2221_i2c_cancel(MCP2221Handle *handle);
+int mcp2221_i2c_set_speed(MCP2221Handle *handle, int hz);
+int mcp2221_i2c_write(MCP2221Handle *handle, int address, const uint8_t *data, int length);
+int mcp2221_i2c_read(MCP2221Handle *handle, int address, uint8_t *data, int length);
+int mcp2221_i2c_write_read(MCP2221Handle *handle, int address, const uint8_t *wdata, int wlength, uint8_t *rdata, int rlength);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
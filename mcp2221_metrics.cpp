@@ -0,0 +1,252 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+#include "mcp2221.h"
+#include "mcp2221_metrics.h"
+#include "mcp2221_trace.h"
+
+const uint32_t mcp2221_metrics_bucket_us[MCP2221_METRICS_BUCKETS - 1] = {
+	25, 50, 100, 200, 300, 500, 750, 1000, 1250, 1500,
+	2000, 2500, 3000, 4000, 5000, 7500, 10000, 25000, 100000, 1000000,
+};
+
+typedef struct _MetricsShard {
+	// written by the owning thread only, read by snapshots
+	MCP2221Metrics metrics;
+
+	int                   in_use;	// guarded by metrics_mutex
+	struct _MetricsShard *next;
+} MetricsShard;
+
+// releases the shard when its thread exits, the counts stay in the shard
+typedef struct _MetricsShardOwner {
+	MetricsShard *shard;
+
+	~_MetricsShardOwner();
+} MetricsShardOwner;
+
+int mcp2221_metrics_enabled_flag = 0;
+
+// shards are never freed, a new thread takes over a released one
+static std::atomic<MetricsShard *> metrics_shards(NULL);
+static std::mutex metrics_mutex;
+
+static thread_local MetricsShardOwner metrics_owner = { NULL };
+
+_MetricsShardOwner::~_MetricsShardOwner() {
+	if (shard != NULL) {
+		std::lock_guard<std::mutex> lock(metrics_mutex);
+		shard->in_use = 0;
+	}
+}
+
+static MetricsShard *mcp2221_metrics_shard() {
+	if (metrics_owner.shard != NULL) {
+		return metrics_owner.shard;
+	}
+
+	std::lock_guard<std::mutex> lock(metrics_mutex);
+
+	MetricsShard *shard = metrics_shards.load(std::memory_order_relaxed);
+
+	while (shard != NULL && shard->in_use) {
+		shard = shard->next;
+	}
+
+	if (shard == NULL) {
+		shard = new MetricsShard;
+		memset(&shard->metrics, 0, sizeof(shard->metrics));
+		shard->next = metrics_shards.load(std::memory_order_relaxed);
+		metrics_shards.store(shard, std::memory_order_release);
+	}
+
+	shard->in_use = 1;
+	metrics_owner.shard = shard;
+
+	return shard;
+}
+
+// single writer : a plain read-modify-write, atomic only towards the readers
+static inline void mcp2221_metrics_add(uint64_t *counter, uint64_t value) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+// Start recording. The counts of a previous run are kept.
+void mcp2221_metrics_start() {
+	__atomic_store_n(&mcp2221_metrics_enabled_flag, 1, __ATOMIC_RELEASE);
+}
+
+void mcp2221_metrics_stop() {
+	__atomic_store_n(&mcp2221_metrics_enabled_flag, 0, __ATOMIC_RELEASE);
+}
+
+void mcp2221_metrics_command(uint8_t opcode, int status, uint64_t latency_us) {
+	MCP2221OpcodeMetrics *m = &mcp2221_metrics_shard()->metrics.opcode[opcode];
+
+	int bucket = 0;
+	while (bucket < MCP2221_METRICS_BUCKETS - 1 && latency_us > mcp2221_metrics_bucket_us[bucket]) {
+		bucket++;
+	}
+
+	mcp2221_metrics_add(&m->commands, 1);
+	mcp2221_metrics_add(&m->latency_sum_us, latency_us);
+	mcp2221_metrics_add(&m->latency_bucket[bucket], 1);
+
+	if (status == STATUS_SEND_TIMEOUT || status == STATUS_RECV_TIMEOUT) {
+		mcp2221_metrics_add(&m->timeouts, 1);
+	} else if (status != STATUS_OK) {
+		mcp2221_metrics_add(&m->errors, 1);
+	}
+}
+
+void mcp2221_metrics_send(uint8_t opcode, int length, int status) {
+	MCP2221OpcodeMetrics *m = &mcp2221_metrics_shard()->metrics.opcode[opcode];
+
+	if (status == STATUS_OK) {
+		mcp2221_metrics_add(&m->sent_reports, 1);
+		mcp2221_metrics_add(&m->sent_bytes, length);
+	} else {
+		mcp2221_metrics_add(&m->send_errors, 1);
+	}
+}
+
+void mcp2221_metrics_recv(const uint8_t *data, int length, int status, int timeout_ms) {
+	MCP2221Metrics *metrics = &mcp2221_metrics_shard()->metrics;
+
+	if (status == STATUS_OK) {
+		MCP2221OpcodeMetrics *m = &metrics->opcode[length > 0 ? data[0] : 0];
+
+		mcp2221_metrics_add(&m->recv_reports, 1);
+		mcp2221_metrics_add(&m->recv_bytes, length);
+	} else if (status == STATUS_RECV_TIMEOUT) {
+		if (timeout_ms > 0) {
+			mcp2221_metrics_add(&metrics->recv_timeouts, 1);
+		}
+	} else {
+		mcp2221_metrics_add(&metrics->recv_errors, 1);
+	}
+}
+
+// Sum of the shards of all threads.
+// The counts of one command may be split between two snapshots (no global ordering).
+void mcp2221_metrics_snapshot(MCP2221Metrics *metrics) {
+	memset(metrics, 0, sizeof(MCP2221Metrics));
+
+	const int n = sizeof(MCP2221Metrics) / sizeof(uint64_t);
+	uint64_t *sum = (uint64_t *)metrics;
+
+	for (MetricsShard *shard = metrics_shards.load(std::memory_order_acquire) ; shard != NULL ; shard = shard->next) {
+		uint64_t *counter = (uint64_t *)&shard->metrics;
+
+		for (int i = 0 ; i < n ; i++) {
+			sum[i] += __atomic_load_n(&counter[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+// Latency below which a fraction q of the commands completed, interpolated within its bucket.
+// @return 0 if there is no command, the last bound if q falls into the +Inf bucket
+double mcp2221_metrics_quantile_us(const MCP2221OpcodeMetrics *metrics, double q) {
+	uint64_t count = 0;
+
+	for (int i = 0 ; i < MCP2221_METRICS_BUCKETS ; i++) {
+		count += metrics->latency_bucket[i];
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	double   rank       = q * count;
+	uint64_t cumulative = 0;
+
+	for (int i = 0 ; i < MCP2221_METRICS_BUCKETS - 1 ; i++) {
+		uint64_t in_bucket = metrics->latency_bucket[i];
+
+		if (in_bucket > 0 && cumulative + in_bucket >= rank) {
+			double lower = i > 0 ? mcp2221_metrics_bucket_us[i - 1] : 0;
+			double upper = mcp2221_metrics_bucket_us[i];
+
+			return lower + (upper - lower) * (rank - cumulative) / in_bucket;
+		}
+
+		cumulative += in_bucket;
+	}
+
+	return mcp2221_metrics_bucket_us[MCP2221_METRICS_BUCKETS - 2];
+}
+
+static void mcp2221_metrics_write_counter(FILE *fp, const MCP2221Metrics *metrics, const char *name, const char *help, size_t offset) {
+	fprintf(fp, "# HELP mcp2221_%s %s\n", name, help);
+	fprintf(fp, "# TYPE mcp2221_%s counter\n", name);
+
+	for (int op = 0 ; op < 256 ; op++) {
+		const MCP2221OpcodeMetrics *m = &metrics->opcode[op];
+
+		if (m->commands == 0 && m->sent_reports == 0 && m->send_errors == 0 && m->recv_reports == 0) {
+			continue;
+		}
+
+		uint64_t value = *(const uint64_t *)((const uint8_t *)m + offset);
+
+		fprintf(fp, "mcp2221_%s{opcode=\"0x%02x\",command=\"%s\"} %llu\n", name, op, mcp2221_opcode_name(op), (unsigned long long)value);
+	}
+}
+
+// Write the metrics in the Prometheus text exposition format.
+// Only the command codes which were used are listed.
+int mcp2221_metrics_write_prometheus(FILE *fp, const MCP2221Metrics *metrics) {
+	if (fp == NULL || metrics == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	mcp2221_metrics_write_counter(fp, metrics, "commands_total", "Commands issued through the blocking api.", offsetof(MCP2221OpcodeMetrics, commands));
+	mcp2221_metrics_write_counter(fp, metrics, "command_errors_total", "Commands which failed, timeouts excluded.", offsetof(MCP2221OpcodeMetrics, errors));
+	mcp2221_metrics_write_counter(fp, metrics, "command_timeouts_total", "Commands which hit a send or receive timeout.", offsetof(MCP2221OpcodeMetrics, timeouts));
+	mcp2221_metrics_write_counter(fp, metrics, "reports_sent_total", "Reports sent to the device.", offsetof(MCP2221OpcodeMetrics, sent_reports));
+	mcp2221_metrics_write_counter(fp, metrics, "bytes_sent_total", "Bytes sent to the device.", offsetof(MCP2221OpcodeMetrics, sent_bytes));
+	mcp2221_metrics_write_counter(fp, metrics, "send_errors_total", "Reports which could not be sent.", offsetof(MCP2221OpcodeMetrics, send_errors));
+	mcp2221_metrics_write_counter(fp, metrics, "reports_received_total", "Reports received, by echoed command code.", offsetof(MCP2221OpcodeMetrics, recv_reports));
+	mcp2221_metrics_write_counter(fp, metrics, "bytes_received_total", "Bytes received from the device.", offsetof(MCP2221OpcodeMetrics, recv_bytes));
+
+	fprintf(fp, "# HELP mcp2221_command_latency_seconds Time from issuing a command to its response.\n");
+	fprintf(fp, "# TYPE mcp2221_command_latency_seconds histogram\n");
+
+	for (int op = 0 ; op < 256 ; op++) {
+		const MCP2221OpcodeMetrics *m = &metrics->opcode[op];
+
+		if (m->commands == 0) {
+			continue;
+		}
+
+		const char *name = mcp2221_opcode_name(op);
+		uint64_t cumulative = 0;
+
+		for (int i = 0 ; i < MCP2221_METRICS_BUCKETS ; i++) {
+			cumulative += m->latency_bucket[i];
+
+			if (i < MCP2221_METRICS_BUCKETS - 1) {
+				fprintf(fp, "mcp2221_command_latency_seconds_bucket{opcode=\"0x%02x\",command=\"%s\",le=\"%g\"} %llu\n",
+						op, name, mcp2221_metrics_bucket_us[i] / 1e6, (unsigned long long)cumulative);
+			} else {
+				fprintf(fp, "mcp2221_command_latency_seconds_bucket{opcode=\"0x%02x\",command=\"%s\",le=\"+Inf\"} %llu\n",
+						op, name, (unsigned long long)cumulative);
+			}
+		}
+
+		fprintf(fp, "mcp2221_command_latency_seconds_sum{opcode=\"0x%02x\",command=\"%s\"} %g\n", op, name, m->latency_sum_us / 1e6);
+		fprintf(fp, "mcp2221_command_latency_seconds_count{opcode=\"0x%02x\",command=\"%s\"} %llu\n", op, name, (unsigned long long)cumulative);
+	}
+
+	fprintf(fp, "# HELP mcp2221_recv_errors_total Transport errors while receiving.\n");
+	fprintf(fp, "# TYPE mcp2221_recv_errors_total counter\n");
+	fprintf(fp, "mcp2221_recv_errors_total %llu\n", (unsigned long long)metrics->recv_errors);
+	fprintf(fp, "# HELP mcp2221_recv_timeouts_total Receive calls which timed out.\n");
+	fprintf(fp, "# TYPE mcp2221_recv_timeouts_total counter\n");
+	fprintf(fp, "mcp2221_recv_timeouts_total %llu\n", (unsigned long long)metrics->recv_timeouts);
+
+	return ferror(fp) ? STATUS_IO_ERROR : STATUS_OK;
+}
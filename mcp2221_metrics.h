@@ -0,0 +1,64 @@
+#ifndef __MCP2221_METRICS_H__
+#define __MCP2221_METRICS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Metrics
+//
+// Per command code counters and latency histograms of the library, for all handles.
+// Every thread records into its own shard without locks (its first record registers the shard),
+// a snapshot merges the shards. While the metrics are stopped the cost is a single branch.
+//
+// The command latency is measured around mcp2221_issue_command / mcp2221_issue_report,
+// including the time spent queued behind other threads and the retries.
+
+// upper bounds of the latency buckets [us], the last bucket has no bound (+Inf)
+#define MCP2221_METRICS_BUCKETS (21)
+
+extern const uint32_t mcp2221_metrics_bucket_us[MCP2221_METRICS_BUCKETS - 1];
+
+typedef struct _MCP2221OpcodeMetrics {
+	uint64_t commands;	// issued through the blocking api
+	uint64_t errors;	// failed commands, timeouts excluded
+	uint64_t timeouts;	// STATUS_SEND_TIMEOUT or STATUS_RECV_TIMEOUT
+	uint64_t sent_reports;
+	uint64_t sent_bytes;
+	uint64_t send_errors;
+	uint64_t recv_reports;	// by the command code echoed in byte 0
+	uint64_t recv_bytes;
+	uint64_t latency_sum_us;
+	uint64_t latency_bucket[MCP2221_METRICS_BUCKETS];	// commands per bucket, not cumulative
+} MCP2221OpcodeMetrics;
+
+typedef struct _MCP2221Metrics {
+	MCP2221OpcodeMetrics opcode[256];
+	uint64_t recv_errors;	// transport errors of recv
+	uint64_t recv_timeouts;	// recv calls which timed out (the polls of a drain are not counted)
+} MCP2221Metrics;
+
+// set by start / stop, read with __atomic builtins so the header stays usable from C
+extern int mcp2221_metrics_enabled_flag;
+
+static inline int mcp2221_metrics_enabled() {
+	return __atomic_load_n(&mcp2221_metrics_enabled_flag, __ATOMIC_RELAXED);
+}
+
+void mcp2221_metrics_start();
+void mcp2221_metrics_stop();
+void mcp2221_metrics_command(uint8_t opcode, int status, uint64_t latency_us);
+void mcp2221_metrics_send(uint8_t opcode, int length, int status);
+void mcp2221_metrics_recv(const uint8_t *data, int length, int status, int timeout_ms);
+void mcp2221_metrics_snapshot(MCP2221Metrics *metrics);
+double mcp2221_metrics_quantile_us(const MCP2221OpcodeMetrics *metrics, double q);
+int mcp2221_metrics_write_prometheus(FILE *fp, const MCP2221Metrics *metrics);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "mcp2221.h"
+#include "mcp2221_poller.h"
+
+struct _GPIOPoller {
+	MCP2221Handle *handle;
+	int mask;
+	int min_interval_us;
+	int max_interval_us;
+
+	GPIOChangeCallback callback;
+	void              *user;
+
+	// guards the fields below
+	std::mutex              mutex;
+	std::condition_variable wake;
+	int stop;
+
+	int          state_valid;
+	GPIOSnapshot state;
+	GPIOPollerStats stats;
+
+	std::thread thread;
+};
+
+static void mcp2221_gpio_poller_run(GPIOPoller *poller) {
+	GPIOSnapshot previous;
+	GPIOSnapshot current;
+	int valid    = 0;
+	int interval = poller->min_interval_us;
+
+	auto next = std::chrono::steady_clock::now();
+
+	for (;;) {
+		int ret = mcp2221_get_gpio_snapshot(poller->handle, &current);
+		int changed = 0;
+
+		if (ret == STATUS_OK) {
+			for (int i = 0 ; i < 4 && valid ; i++) {
+				if (!(poller->mask & (1 << i))) {
+					continue;
+				}
+				if (current.value[i] == previous.value[i] && current.direction[i] == previous.direction[i]) {
+					continue;
+				}
+
+				changed++;
+
+				if (poller->callback != NULL) {
+					poller->callback(i, current.value[i], current.direction[i], poller->user);
+				}
+			}
+
+			// the first poll is the reference
+			previous = current;
+			valid    = 1;
+		}
+
+		if (changed) {
+			interval = poller->min_interval_us;
+		} else if (interval < poller->max_interval_us) {
+			interval = interval * 2 < poller->max_interval_us ? interval * 2 : poller->max_interval_us;
+		}
+
+		std::unique_lock<std::mutex> lock(poller->mutex);
+
+		poller->stats.polls++;
+		poller->stats.changes    += changed;
+		poller->stats.errors     += ret != STATUS_OK;
+		poller->stats.interval_us = interval;
+
+		if (ret == STATUS_OK) {
+			poller->state       = current;
+			poller->state_valid = 1;
+		}
+
+		// absolute deadlines, the time of the poll itself is not added to the interval
+		// (a late poll is not caught up with a burst)
+		next = std::max(next + std::chrono::microseconds(interval), std::chrono::steady_clock::now());
+
+		if (poller->wake.wait_until(lock, next, [poller] { return poller->stop != 0; })) {
+			break;
+		}
+	}
+}
+
+// @param mask pins reported to the callback (bit n : GPn)
+// @param min_interval_us interval after a change
+// @param max_interval_us interval when idle
+// @param callback may be NULL, the state is then read with mcp2221_gpio_poller_get_state
+int mcp2221_gpio_poller_start(GPIOPoller **poller, MCP2221Handle *handle, int mask, int min_interval_us, int max_interval_us, GPIOChangeCallback callback, void *user) {
+	if (poller == NULL || handle == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (mask & ~GPIO_PORT_MASK_ALL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (min_interval_us <= 0 || max_interval_us < min_interval_us) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	GPIOPoller *p = new GPIOPoller;
+
+	p->handle          = handle;
+	p->mask            = mask;
+	p->min_interval_us = min_interval_us;
+	p->max_interval_us = max_interval_us;
+	p->callback        = callback;
+	p->user            = user;
+	p->stop            = 0;
+	p->state_valid     = 0;
+
+	memset(&p->stats, 0, sizeof(p->stats));
+	p->stats.interval_us = min_interval_us;
+
+	p->thread = std::thread(mcp2221_gpio_poller_run, p);
+
+	*poller = p;
+
+	return STATUS_OK;
+}
+
+// State of the last successful poll.
+// @return STATUS_IO_ERROR if no poll succeeded yet
+int mcp2221_gpio_poller_get_state(GPIOPoller *poller, GPIOSnapshot *snapshot) {
+	std::lock_guard<std::mutex> lock(poller->mutex);
+
+	if (!poller->state_valid) {
+		return STATUS_IO_ERROR;
+	}
+
+	*snapshot = poller->state;
+
+	return STATUS_OK;
+}
+
+void mcp2221_gpio_poller_get_stats(GPIOPoller *poller, GPIOPollerStats *stats) {
+	std::lock_guard<std::mutex> lock(poller->mutex);
+
+	*stats = poller->stats;
+}
+
+// Stop the thread and release the poller. Must not be called from the callback.
+int mcp2221_gpio_poller_stop(GPIOPoller *poller) {
+	if (poller == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(poller->mutex);
+		poller->stop = 1;
+		poller->wake.notify_one();
+	}
+
+	poller->thread.join();
+
+	delete poller;
+
+	return STATUS_OK;
+}
@@ -0,0 +1,40 @@
+#ifndef __MCP2221_POLLER_H__
+#define __MCP2221_POLLER_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// GPIO input poller
+//
+// A thread reads all four pins with one 0x51 report per poll and calls the callback for each
+// watched pin whose value or direction changed since the previous poll.
+// The interval drops to min_interval_us after a change and doubles on every quiet poll,
+// up to max_interval_us. The polls refresh the gpio cache of the handle (mcp2221_set_gpio_cache).
+
+typedef struct _GPIOPoller GPIOPoller;
+
+// Called on the poller thread, it may use the handle.
+typedef void (*GPIOChangeCallback)(int port, GPIOValue value, GPIODirection direction, void *user);
+
+typedef struct _GPIOPollerStats {
+	uint64_t polls;
+	uint64_t changes;	// callbacks
+	uint64_t errors;	// polls which failed
+	int      interval_us;	// current interval
+} GPIOPollerStats;
+
+int mcp2221_gpio_poller_start(GPIOPoller **poller, MCP2221Handle *handle, int mask, int min_interval_us, int max_interval_us, GPIOChangeCallback callback, void *user);
+int mcp2221_gpio_poller_get_state(GPIOPoller *poller, GPIOSnapshot *snapshot);
+void mcp2221_gpio_poller_get_stats(GPIOPoller *poller, GPIOPollerStats *stats);
+int mcp2221_gpio_poller_stop(GPIOPoller *poller);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
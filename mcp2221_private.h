@@ -0,0 +1,99 @@
+#ifndef __MCP2221_PRIVATE_H__
+#define __MCP2221_PRIVATE_H__
+
+// Helpers shared by the library sources. Not part of the public api.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifdef ENABLE_DEBUG
+#define PRINT_DEBUG(x, ...) printf(x, __VA_ARGS__) 
+#else
+#define PRINT_DEBUG(x, ...) {}
+#endif
+
+struct _MCP2221Handle;
+struct _MCP2221Transport;
+
+int mcp2221_lowlevel_send(struct _MCP2221Transport *transport, uint8_t *data, int length);
+int mcp2221_lowlevel_recv(struct _MCP2221Transport *transport, uint8_t *data, int length, int timeout_ms);
+int mcp2221_lowlevel_send_report(struct _MCP2221Handle *handle, uint8_t report[65]);
+int mcp2221_issue_command_direct(struct _MCP2221Handle *handle, uint8_t send_cmd[64], uint8_t recv_buf[64]);
+
+// response correlation of the thread sending the commands of the handle (mcp2221.cpp)
+int mcp2221_recv_response(struct _MCP2221Handle *handle, const uint8_t *cmd, uint8_t *buf, int timeout_ms);
+void mcp2221_drain_responses(struct _MCP2221Handle *handle);
+void mcp2221_count_response(uint64_t *counter);
+
+// state_lock of the handle (mcp2221.cpp)
+void mcp2221_state_lock(struct _MCP2221Handle *handle);
+void mcp2221_state_unlock(struct _MCP2221Handle *handle);
+
+// transaction_lock of the handle, waiters sleep (mcp2221.cpp)
+void mcp2221_transaction_lock(struct _MCP2221Handle *handle);
+void mcp2221_transaction_unlock(struct _MCP2221Handle *handle);
+
+// Completion of a queued command, shared by the submitter and the thread sending it.
+// done : 0 pending, 1 completed, 2 pending with a sleeping waiter (mcp2221.cpp)
+int mcp2221_completion_wait(int *done, int timeout_ms);
+void mcp2221_completion_signal(int *done);
+
+// Lock-free multi producer / single consumer queue of nodes with a next pointer.
+// Producers push onto a stack, the consumer takes the whole stack at once.
+template <typename T>
+static inline void mcp2221_mpsc_push(T **head, T *node) {
+	T *old = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+	do {
+		node->next = old;
+	} while (!__atomic_compare_exchange_n(head, &old, node, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+}
+
+// @return the pushed nodes, oldest first
+template <typename T>
+static inline T *mcp2221_mpsc_take_all(T **head) {
+	T *node = __atomic_exchange_n(head, (T *)NULL, __ATOMIC_SEQ_CST);
+	T *list = NULL;
+
+	while (node != NULL) {
+		T *next = node->next;
+
+		node->next = list;
+		list       = node;
+		node       = next;
+	}
+
+	return list;
+}
+
+// Set SRAM Settings report with the answer checked, invalidates the shadow on failure (mcp2221.cpp)
+int mcp2221_issue_set_sram(struct _MCP2221Handle *handle, uint8_t report[65]);
+
+// command pipeline (mcp2221_async.cpp)
+int mcp2221_async_is_io_thread(struct _MCP2221Handle *handle);
+int mcp2221_async_issue(struct _MCP2221Handle *handle, uint8_t send_cmd[64], uint8_t recv_buf[64]);
+
+// hid library lifetime shared by every handle (mcp2221.cpp)
+int mcp2221_hid_acquire();
+void mcp2221_hid_release();
+
+// hotplug events of a handle (mcp2221_hotplug.cpp)
+#define HOTPLUG_EVENT_NONE    (0)
+#define HOTPLUG_EVENT_REMOVED (1)
+#define HOTPLUG_EVENT_ADDED   (2)
+
+// reopen on the events posted with mcp2221_hotplug_post only, without the udev monitor
+int mcp2221_hotplug_attach(struct _MCP2221Handle *handle);
+// an event as the udev monitor posts it, path is the node to open (NULL : reopen the current one)
+void mcp2221_hotplug_post(struct _MCP2221Handle *handle, int event, const char *path);
+
+static inline uint64_t mcp2221_get_time_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#endif
@@ -0,0 +1,174 @@
+
+#include <string.h>
+
+#include "mcp2221.h"
+#include "mcp2221_i2c.h"
+#include "mcp2221_regcache.h"
+
+static int mcp2221_regcache_is_volatile(I2CRegCache *cache, int reg) {
+	for (int i = 0 ; i < cache->volatile_count ; i++) {
+		if (cache->volatile_begin[i] <= reg && reg <= cache->volatile_end[i]) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int mcp2221_regcache_validate(int reg, int count) {
+	if (reg < 0 || 256 <= reg) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (count <= 0 || 256 < reg + count) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	return STATUS_OK;
+}
+
+// Store registers read from / written to the slave.
+static void mcp2221_regcache_fill(I2CRegCache *cache, int reg, const uint8_t *values, int count) {
+	for (int i = 0 ; i < count ; i++) {
+		if (mcp2221_regcache_is_volatile(cache, reg + i)) {
+			continue;
+		}
+
+		cache->value[reg + i] = values[i];
+		cache->valid[reg + i] = 1;
+	}
+}
+
+int mcp2221_regcache_init(I2CRegCache *cache, MCP2221Handle *handle, int address) {
+	if (address < 0 || 0x7F < address) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	memset(cache, 0, sizeof(I2CRegCache));
+
+	cache->handle  = handle;
+	cache->address = address;
+
+	return STATUS_OK;
+}
+
+// Registers in [begin, end] are always read from the slave.
+int mcp2221_regcache_add_volatile(I2CRegCache *cache, int begin, int end) {
+	if (begin < 0 || end < begin || 256 <= end) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (cache->volatile_count == REGCACHE_MAX_VOLATILE_RANGES) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	cache->volatile_begin[cache->volatile_count] = begin;
+	cache->volatile_end[cache->volatile_count]   = end;
+	cache->volatile_count++;
+
+	mcp2221_regcache_invalidate(cache, begin, end);
+
+	return STATUS_OK;
+}
+
+int mcp2221_regcache_read(I2CRegCache *cache, int reg, uint8_t *value) {
+	return mcp2221_regcache_read_block(cache, reg, value, 1);
+}
+
+// Answer from the cache if every register is cached, otherwise read the whole block with one transfer.
+int mcp2221_regcache_read_block(I2CRegCache *cache, int reg, uint8_t *values, int count) {
+	int ret;
+
+	if (mcp2221_regcache_validate(reg, count) != STATUS_OK || values == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	int cached = 1;
+	for (int i = 0 ; i < count ; i++) {
+		if (!cache->valid[reg + i]) {
+			cached = 0;
+			break;
+		}
+	}
+
+	if (cached) {
+		memcpy(values, cache->value + reg, count);
+		cache->hits += count;
+		return STATUS_OK;
+	}
+
+	uint8_t addr = reg;
+
+	ret = mcp2221_i2c_write_read(cache->handle, cache->address, &addr, 1, values, count);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	cache->misses += count;
+	cache->bus_reads++;
+
+	mcp2221_regcache_fill(cache, reg, values, count);
+
+	return STATUS_OK;
+}
+
+int mcp2221_regcache_write(I2CRegCache *cache, int reg, uint8_t value) {
+	return mcp2221_regcache_write_block(cache, reg, &value, 1);
+}
+
+// Write to the slave, the cache is updated only when the slave accepted the data.
+int mcp2221_regcache_write_block(I2CRegCache *cache, int reg, const uint8_t *values, int count) {
+	int ret;
+	uint8_t data[257];
+
+	if (mcp2221_regcache_validate(reg, count) != STATUS_OK || values == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	data[0] = reg;
+	memcpy(data + 1, values, count);
+
+	ret = mcp2221_i2c_write(cache->handle, cache->address, data, count + 1);
+	if (ret != STATUS_OK) {
+		// the slave may have taken a part of the data
+		mcp2221_regcache_invalidate(cache, reg, reg + count - 1);
+		return ret;
+	}
+
+	cache->bus_writes++;
+
+	mcp2221_regcache_fill(cache, reg, values, count);
+
+	return STATUS_OK;
+}
+
+// Read-modify-write. Nothing is written if the bits already have the value.
+int mcp2221_regcache_update_bits(I2CRegCache *cache, int reg, uint8_t mask, uint8_t value) {
+	int ret;
+	uint8_t old;
+
+	ret = mcp2221_regcache_read(cache, reg, &old);
+	if (ret != STATUS_OK) {
+		return ret;
+	}
+
+	uint8_t val = (old & ~mask) | (value & mask);
+	if (val == old && !mcp2221_regcache_is_volatile(cache, reg)) {
+		return STATUS_OK;
+	}
+
+	return mcp2221_regcache_write(cache, reg, val);
+}
+
+int mcp2221_regcache_invalidate(I2CRegCache *cache, int begin, int end) {
+	if (begin < 0 || end < begin || 256 <= end) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	memset(cache->valid + begin, 0, end - begin + 1);
+
+	return STATUS_OK;
+}
+
+// e.g. after a reset of the slave
+void mcp2221_regcache_invalidate_all(I2CRegCache *cache) {
+	memset(cache->valid, 0, sizeof(cache->valid));
+}
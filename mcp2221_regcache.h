@@ -0,0 +1,51 @@
+#ifndef __MCP2221_REGCACHE_H__
+#define __MCP2221_REGCACHE_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Write-through register cache of an I2C slave with 8bit register addresses.
+// The slave has to auto-increment the register address on block access.
+// Volatile registers (status, data, ...) are never cached.
+
+#define REGCACHE_MAX_VOLATILE_RANGES (8)
+
+typedef struct _I2CRegCache {
+	MCP2221Handle *handle;
+	int address;	// 7bit slave address
+
+	uint8_t value[256];
+	uint8_t valid[256];
+
+	// [begin, end] register ranges
+	int volatile_count;
+	int volatile_begin[REGCACHE_MAX_VOLATILE_RANGES];
+	int volatile_end[REGCACHE_MAX_VOLATILE_RANGES];
+
+	// statistics (per register)
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t bus_reads;
+	uint64_t bus_writes;
+} I2CRegCache;
+
+int mcp2221_regcache_init(I2CRegCache *cache, MCP2221Handle *handle, int address);
+int mcp2221_regcache_add_volatile(I2CRegCache *cache, int begin, int end);
+int mcp2221_regcache_read(I2CRegCache *cache, int reg, uint8_t *value);
+int mcp2221_regcache_read_block(I2CRegCache *cache, int reg, uint8_t *values, int count);
+int mcp2221_regcache_write(I2CRegCache *cache, int reg, uint8_t value);
+int mcp2221_regcache_write_block(I2CRegCache *cache, int reg, const uint8_t *values, int count);
+int mcp2221_regcache_update_bits(I2CRegCache *cache, int reg, uint8_t mask, uint8_t value);
+int mcp2221_regcache_invalidate(I2CRegCache *cache, int begin, int end);
+void mcp2221_regcache_invalidate_all(I2CRegCache *cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "mcp2221.h"
+#include "mcp2221.hpp"
+#include "mcp2221_private.h"
+#include "mcp2221_sequence.h"
+
+// the first deadline leaves time to start the player thread
+#define SEQUENCE_LEAD_US (1000)
+
+struct _GPIOSequence {
+	int n;
+
+	// per instant
+	uint64_t        *time_us;
+	mcp2221::Report *reports;
+	uint8_t         *value_mask;
+	uint8_t         *direction_mask;
+};
+
+static int mcp2221_sequence_check_echo(const uint8_t *cmd, const uint8_t *buf, int value_mask, int direction_mask) {
+	typedef mcp2221::layout::SetGpioOutput L;
+
+	if (mcp2221::layout::Code::get(buf) != L::code || mcp2221::layout::Result::get(buf) != 0) {
+		return STATUS_IO_ERROR;
+	}
+
+	for (int i = 0 ; i < 4 ; i++) {
+		if ((value_mask & (1 << i)) && L::Value::get(buf, i) != L::Value::get(cmd, i)) {
+			return STATUS_IO_ERROR;
+		}
+		if ((direction_mask & (1 << i)) && L::Direction::get(buf, i) != L::Direction::get(cmd, i)) {
+			return STATUS_IO_ERROR;
+		}
+	}
+
+	return STATUS_OK;
+}
+
+// Sort the steps and encode one report per instant.
+int mcp2221_sequence_compile(GPIOSequence **sequence, const GPIOStep *steps, int count) {
+	if (sequence == NULL || steps == NULL || count <= 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	for (int i = 0 ; i < count ; i++) {
+		if ((steps[i].value_mask | steps[i].values | steps[i].direction_mask | steps[i].directions) & 0xF0) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+	}
+
+	std::vector<GPIOStep> sorted(steps, steps + count);
+
+	// the order of the steps of one instant is kept
+	std::stable_sort(sorted.begin(), sorted.end(), [](const GPIOStep &a, const GPIOStep &b) {
+		return a.time_us < b.time_us;
+	});
+
+	int n = 1;
+	for (int i = 1 ; i < count ; i++) {
+		if (sorted[i].time_us != sorted[i - 1].time_us) {
+			n++;
+		}
+	}
+
+	GPIOSequence *s = new GPIOSequence;
+
+	s->n              = n;
+	s->time_us        = new uint64_t[n];
+	s->reports        = new mcp2221::Report[n];
+	s->value_mask     = new uint8_t[n];
+	s->direction_mask = new uint8_t[n];
+
+	int k = 0;
+
+	for (int i = 0 ; i < count ; ) {
+		GPIOSetting gpio[4];
+		int value_mask     = 0;
+		int direction_mask = 0;
+
+		memset(gpio, 0, sizeof(gpio));
+
+		s->time_us[k] = sorted[i].time_us;
+
+		for ( ; i < count && sorted[i].time_us == s->time_us[k] ; i++) {
+			for (int j = 0 ; j < 4 ; j++) {
+				if (sorted[i].value_mask & (1 << j)) {
+					gpio[j].enable_value = 1;
+					gpio[j].value        = (GPIOValue)((sorted[i].values >> j) & 0x1);
+				}
+				if (sorted[i].direction_mask & (1 << j)) {
+					gpio[j].enable_direction = 1;
+					gpio[j].direction        = (GPIODirection)((sorted[i].directions >> j) & 0x1);
+				}
+			}
+			value_mask     |= sorted[i].value_mask;
+			direction_mask |= sorted[i].direction_mask;
+		}
+
+		mcp2221::encode_set_gpio_output(s->reports[k].command(), &gpio[0], &gpio[1], &gpio[2], &gpio[3]);
+		s->value_mask[k]     = value_mask;
+		s->direction_mask[k] = direction_mask;
+		k++;
+	}
+
+	*sequence = s;
+
+	return STATUS_OK;
+}
+
+// Number of reports (instants) of the sequence.
+int mcp2221_sequence_length(GPIOSequence *sequence) {
+	return sequence->n;
+}
+
+static void mcp2221_sequence_run(MCP2221Handle *handle, GPIOSequence *sequence, int64_t *error_us, uint64_t *sent_us, int *errors, int *realtime) {
+	struct sched_param param;
+
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+
+	// needs CAP_SYS_NICE (or an rtprio limit), the sequence is played anyway
+	*realtime = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+
+	uint64_t start = mcp2221_get_time_us() + SEQUENCE_LEAD_US;
+	uint8_t buf[64];
+
+	for (int i = 0 ; i < sequence->n ; i++) {
+		uint64_t deadline = start + sequence->time_us[i];
+
+		struct timespec ts;
+		ts.tv_sec  = deadline / 1000000;
+		ts.tv_nsec = (deadline % 1000000) * 1000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+		sent_us[i]  = mcp2221_get_time_us();
+		error_us[i] = (int64_t)(sent_us[i] - deadline);
+
+		mcp2221::Report *report = &sequence->reports[i];
+
+		if (
+				mcp2221_issue_report(handle, report->wire, buf) != STATUS_OK ||
+				mcp2221_sequence_check_echo(report->command(), buf, sequence->value_mask[i], sequence->direction_mask[i]) != STATUS_OK
+		) {
+			(*errors)++;
+		}
+	}
+}
+
+// Play the sequence on a real-time thread and wait for its end.
+// A late report is sent at once, the following deadlines are kept.
+// @param step_error_us send time - deadline of each report, mcp2221_sequence_length entries (may be NULL)
+// @return STATUS_OK if every report was echoed
+int mcp2221_sequence_play(MCP2221Handle *handle, GPIOSequence *sequence, GPIOSequenceStats *stats, int64_t *step_error_us) {
+	if (handle == NULL || sequence == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	int n = sequence->n;
+	std::vector<int64_t>  error_us(n);
+	std::vector<uint64_t> sent_us(n);
+	int errors   = 0;
+	int realtime = 0;
+
+	std::thread thread(mcp2221_sequence_run, handle, sequence, error_us.data(), sent_us.data(), &errors, &realtime);
+	thread.join();
+
+	// the reports bypassed the shadow of the handle
+	mcp2221_invalidate_gpio_cache(handle);
+	mcp2221_invalidate_setting(handle);
+
+	if (step_error_us != NULL) {
+		memcpy(step_error_us, error_us.data(), sizeof(int64_t) * n);
+	}
+
+	if (stats != NULL) {
+		std::vector<int64_t> sorted(error_us);
+		double sum = 0;
+
+		std::sort(sorted.begin(), sorted.end());
+
+		for (int i = 0 ; i < n ; i++) {
+			sum += error_us[i];
+		}
+
+		stats->reports       = n;
+		stats->errors        = errors;
+		stats->realtime      = realtime;
+		stats->duration_us   = sent_us[n - 1] - sent_us[0];
+		stats->rate_hz       = stats->duration_us > 0 ? (double)(n - 1) * 1000000 / stats->duration_us : 0;
+		stats->error_min_us  = sorted[0];
+		stats->error_max_us  = sorted[n - 1];
+		stats->error_mean_us = sum / n;
+		stats->error_p99_us  = sorted[(int)(0.99 * (n - 1))];
+	}
+
+	return errors == 0 ? STATUS_OK : STATUS_IO_ERROR;
+}
+
+void mcp2221_sequence_free(GPIOSequence *sequence) {
+	if (sequence == NULL) {
+		return;
+	}
+
+	delete[] sequence->time_us;
+	delete[] sequence->reports;
+	delete[] sequence->value_mask;
+	delete[] sequence->direction_mask;
+	delete sequence;
+}
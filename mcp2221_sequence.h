@@ -0,0 +1,53 @@
+#ifndef __MCP2221_SEQUENCE_H__
+#define __MCP2221_SEQUENCE_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// GPIO sequence player
+//
+// A timeline of pin changes is compiled once : the steps are sorted, the changes of the same
+// instant are merged (the last step wins) and every instant is encoded into its 0x50 report.
+// The player sends the reports from a real-time thread, sleeping to absolute deadlines,
+// and measures how late each report left the host.
+
+typedef struct _GPIOStep {
+	uint64_t time_us;	// from the start of the sequence
+	// bit n selects / holds GPn
+	uint8_t  value_mask;
+	uint8_t  values;
+	uint8_t  direction_mask;
+	uint8_t  directions;
+} GPIOStep;
+
+typedef struct _GPIOSequenceStats {
+	int      reports;	// reports sent (one per instant)
+	int      errors;	// reports which failed or were not echoed
+	int      realtime;	// 1 if the player got SCHED_FIFO
+	uint64_t duration_us;	// first to last send
+	double   rate_hz;	// reports per second achieved
+
+	// send time - deadline
+	int64_t error_min_us;
+	int64_t error_max_us;
+	double  error_mean_us;
+	int64_t error_p99_us;
+} GPIOSequenceStats;
+
+typedef struct _GPIOSequence GPIOSequence;
+
+int mcp2221_sequence_compile(GPIOSequence **sequence, const GPIOStep *steps, int count);
+int mcp2221_sequence_length(GPIOSequence *sequence);
+int mcp2221_sequence_play(MCP2221Handle *handle, GPIOSequence *sequence, GPIOSequenceStats *stats, int64_t *step_error_us);
+void mcp2221_sequence_free(GPIOSequence *sequence);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
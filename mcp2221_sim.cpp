@@ -0,0 +1,537 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "mcp2221.h"
+#include "mcp2221_sim.h"
+
+// I2C engine states reported in byte 8 of the status
+#define SIM_I2C_IDLE          (0x00)
+#define SIM_I2C_WRITING       (0x41)
+#define SIM_I2C_WAIT_RESTART  (0x45)
+#define SIM_I2C_READING       (0x54)
+#define SIM_I2C_ADDRESS_NACK  (0x25)
+
+static uint64_t mcp2221_sim_time_us() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void mcp2221_sim_sleep_until(uint64_t time_us) {
+	struct timespec ts;
+
+	ts.tv_sec  = time_us / 1000000;
+	ts.tv_nsec = (time_us % 1000000) * 1000;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+		// interrupted, sleep again
+	}
+}
+
+// Factory flash : all ports are GPIO input
+static const uint8_t sim_default_flash_chip[10] = { 0x00, 0x12, 0x00, 0x00, 0xD8, 0x04, 0xDD, 0x00, 0x80, 0x32 };
+static const uint8_t sim_default_flash_gp[4]    = { 0x08, 0x08, 0x08, 0x08 };
+
+int mcp2221_sim_init(MCP2221Sim *sim, const MCP2221SimConfig *config) {
+	memset(sim, 0, sizeof(MCP2221Sim));
+
+	if (config != NULL) {
+		if (config->latency_us < 0 || config->jitter_us < 0 || config->frame_us < 0 || config->drop_every < 0) {
+			return STATUS_ARGUMENT_ERROR;
+		}
+
+		sim->config = *config;
+	}
+
+	memcpy(sim->flash_chip, sim_default_flash_chip, sizeof(sim->flash_chip));
+	memcpy(sim->flash_gp, sim_default_flash_gp, sizeof(sim->flash_gp));
+
+	sim->i2c_slave_address = -1;
+
+	sim->rng = sim->config.seed;
+
+	mcp2221_sim_power_cycle(sim);
+
+	return STATUS_OK;
+}
+
+int mcp2221_sim_set_input(MCP2221Sim *sim, int port, GPIOValue value) {
+	if (port < 0 || 4 <= port) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (value < 0 || GPIO_VALUE_MAX <= value) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	if (port == 1 && sim->gp_func[1] == GP1_FUNC_INT) {
+		if ((sim->int_rising && sim->gp_input[1] == GPIO_VALUE_L && value == GPIO_VALUE_H) ||
+				(sim->int_falling && sim->gp_input[1] == GPIO_VALUE_H && value == GPIO_VALUE_L)) {
+			sim->int_flag = 1;
+		}
+	}
+
+	sim->gp_input[port] = value;
+
+	return STATUS_OK;
+}
+
+// Attach the I2C slave model at address (7bit), -1 removes it.
+int mcp2221_sim_set_i2c_slave(MCP2221Sim *sim, int address) {
+	if (address < -1 || 0x7F < address) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	sim->i2c_slave_address = address;
+	sim->i2c_slave_pointer = 0;
+
+	return STATUS_OK;
+}
+
+// channel 0 - 2 : ADC1 - ADC3
+int mcp2221_sim_set_adc(MCP2221Sim *sim, int channel, int value) {
+	if (channel < 0 || 3 <= channel) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+	if (value < 0 || 0x3FF < value) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	sim->adc_value[channel] = value;
+
+	return STATUS_OK;
+}
+
+static void mcp2221_sim_i2c_reset(MCP2221Sim *sim) {
+	sim->i2c_state          = SIM_I2C_IDLE;
+	sim->i2c_nack           = 0;
+	sim->i2c_writing        = 0;
+	sim->i2c_read_remaining = 0;
+}
+
+// Reset the SRAM to the power-up configuration stored in flash.
+// The pins, the slave model and the pending responses are kept.
+void mcp2221_sim_power_cycle(MCP2221Sim *sim) {
+	for (int i = 0 ; i < 4 ; i++) {
+		sim->gp_func[i]      = sim->flash_gp[i] & 0x7;
+		sim->gp_direction[i] = (sim->flash_gp[i] >> 3) & 0x1;
+		sim->gp_value[i]     = (sim->flash_gp[i] >> 4) & 0x1;
+	}
+
+	sim->adc_reference = ((sim->flash_chip[3] >> 2) & 0x1) ? (sim->flash_chip[3] >> 3) & 0x3 : 0;
+
+	mcp2221_sim_i2c_reset(sim);
+	sim->i2c_speed_divider = 12000000 / 100000 - 3;
+}
+
+// Status / Set Parameters
+static void mcp2221_sim_status(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	if (cmd[2] == 0x10) {
+		resp[2] = sim->i2c_state != SIM_I2C_IDLE ? 0x10 : 0x11;
+		mcp2221_sim_i2c_reset(sim);
+	}
+
+	if (cmd[3] == 0x20) {
+		if (sim->i2c_state != SIM_I2C_IDLE) {
+			resp[3] = 0x21;
+		} else {
+			resp[3] = 0x20;
+			sim->i2c_speed_divider = cmd[4];
+		}
+	}
+
+	resp[8]  = sim->i2c_state;
+	resp[9]  = sim->i2c_requested & 0xFF;
+	resp[10] = (sim->i2c_requested >> 8) & 0xFF;
+	resp[11] = sim->i2c_transferred & 0xFF;
+	resp[12] = (sim->i2c_transferred >> 8) & 0xFF;
+	resp[14] = sim->i2c_speed_divider;
+	resp[16] = sim->i2c_address << 1;
+	resp[20] = sim->i2c_nack << 6;
+	resp[22] = 1;	// SCL
+	resp[23] = 1;	// SDA
+	resp[24] = sim->int_flag;
+	resp[25] = sim->i2c_read_remaining > 0;
+
+	for (int i = 0 ; i < 3 ; i++) {
+		resp[50 + 2 * i] = sim->adc_value[i] & 0xFF;
+		resp[51 + 2 * i] = (sim->adc_value[i] >> 8) & 0x3;
+	}
+
+	// hardware / firmware revision
+	resp[46] = 'A';
+	resp[47] = '6';
+	resp[48] = '1';
+	resp[49] = '1';
+}
+
+// I2C Write Data (0x90 / 0x92 / 0x94)
+static void mcp2221_sim_i2c_write(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	if (sim->i2c_read_remaining > 0) {
+		resp[1] = 0x01;	// busy
+		return;
+	}
+
+	if (!sim->i2c_writing || sim->i2c_nack) {
+		// first chunk of a new transfer
+		sim->i2c_requested     = cmd[1] | (cmd[2] << 8);
+		sim->i2c_transferred   = 0;
+		sim->i2c_address       = cmd[3] >> 1;
+		sim->i2c_nack          = sim->i2c_address != sim->i2c_slave_address;
+		sim->i2c_writing       = 1;
+		sim->i2c_state         = SIM_I2C_WRITING;
+
+		if (!sim->i2c_nack) {
+			sim->i2c_slave_pointer = -1;
+		}
+	}
+
+	int chunk = sim->i2c_requested - sim->i2c_transferred;
+	if (60 < chunk) {
+		chunk = 60;
+	}
+
+	if (sim->i2c_nack) {
+		// the data is dropped, the error is seen in the status
+		sim->i2c_state   = SIM_I2C_ADDRESS_NACK;
+		sim->i2c_writing = 0;
+		return;
+	}
+
+	for (int i = 0 ; i < chunk ; i++) {
+		if (sim->i2c_slave_pointer < 0) {
+			sim->i2c_slave_pointer = cmd[4 + i];
+		} else {
+			sim->i2c_slave_regs[sim->i2c_slave_pointer] = cmd[4 + i];
+			sim->i2c_slave_pointer = (sim->i2c_slave_pointer + 1) & 0xFF;
+		}
+	}
+	sim->i2c_transferred += chunk;
+
+	if (sim->i2c_transferred == sim->i2c_requested) {
+		sim->i2c_writing = 0;
+		sim->i2c_state   = cmd[0] == 0x94 ? SIM_I2C_WAIT_RESTART : SIM_I2C_IDLE;
+	}
+}
+
+// I2C Read Data (0x91 / 0x93)
+static void mcp2221_sim_i2c_read(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	if (sim->i2c_writing || sim->i2c_read_remaining > 0) {
+		resp[1] = 0x01;	// busy
+		return;
+	}
+
+	sim->i2c_requested   = cmd[1] | (cmd[2] << 8);
+	sim->i2c_transferred = 0;
+	sim->i2c_address     = cmd[3] >> 1;
+	sim->i2c_nack        = sim->i2c_address != sim->i2c_slave_address;
+
+	if (sim->i2c_nack) {
+		sim->i2c_state = SIM_I2C_ADDRESS_NACK;
+		return;
+	}
+
+	if (sim->i2c_slave_pointer < 0) {
+		sim->i2c_slave_pointer = 0;
+	}
+	sim->i2c_read_remaining = sim->i2c_requested;
+	sim->i2c_state          = SIM_I2C_READING;
+}
+
+// Get I2C Data
+static void mcp2221_sim_i2c_get_data(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	if (sim->i2c_read_remaining == 0) {
+		resp[1] = 0x41;	// no data
+		resp[2] = sim->i2c_state;
+		return;
+	}
+
+	int chunk = sim->i2c_read_remaining;
+	if (60 < chunk) {
+		chunk = 60;
+	}
+
+	for (int i = 0 ; i < chunk ; i++) {
+		resp[4 + i] = sim->i2c_slave_regs[sim->i2c_slave_pointer];
+		sim->i2c_slave_pointer = (sim->i2c_slave_pointer + 1) & 0xFF;
+	}
+
+	sim->i2c_read_remaining -= chunk;
+	sim->i2c_transferred    += chunk;
+
+	resp[2] = sim->i2c_read_remaining == 0 ? 0x55 : 0x54;
+	resp[3] = chunk;
+
+	if (sim->i2c_read_remaining == 0) {
+		sim->i2c_state = SIM_I2C_IDLE;
+	}
+}
+
+// Set GPIO Output Values
+static void mcp2221_sim_set_gpio_output(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	for (int i = 0 ; i < 4 ; i++) {
+		if (sim->gp_func[i] != 0) {
+			memset(resp + 4 * i + 2, 0xEE, 4);
+			continue;
+		}
+
+		if (cmd[4 * i + 2] != 0) {
+			sim->gp_value[i] = cmd[4 * i + 3] & 0x1;
+			resp[4 * i + 2] = cmd[4 * i + 2];
+			resp[4 * i + 3] = cmd[4 * i + 3];
+		} else {
+			resp[4 * i + 2] = 0xEE;
+			resp[4 * i + 3] = 0xEE;
+		}
+
+		if (cmd[4 * i + 4] != 0) {
+			sim->gp_direction[i] = cmd[4 * i + 5] & 0x1;
+			resp[4 * i + 4] = cmd[4 * i + 4];
+			resp[4 * i + 5] = cmd[4 * i + 5];
+		} else {
+			resp[4 * i + 4] = 0xEE;
+			resp[4 * i + 5] = 0xEE;
+		}
+	}
+}
+
+// Get GPIO Values
+static void mcp2221_sim_get_gpio_input(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	for (int i = 0 ; i < 4 ; i++) {
+		if (sim->gp_func[i] != 0) {
+			resp[2 + 2 * i] = 0xEE;
+			resp[3 + 2 * i] = 0xEF;
+			continue;
+		}
+
+		if (sim->gp_direction[i] == GPIO_DIR_IN) {
+			resp[2 + 2 * i] = sim->gp_input[i];
+		} else {
+			resp[2 + 2 * i] = sim->gp_value[i];
+		}
+		resp[3 + 2 * i] = sim->gp_direction[i];
+	}
+}
+
+// Set SRAM settings
+static void mcp2221_sim_set_sram_settings(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	if (cmd[5] & 0x80) {
+		sim->adc_reference = (cmd[5] & 0x1) ? (cmd[5] >> 1) & 0x3 : 0;
+	}
+
+	if (cmd[6] & 0x80) {
+		if (cmd[6] & 0x10) {
+			sim->int_rising = (cmd[6] >> 3) & 0x1;
+		}
+		if (cmd[6] & 0x04) {
+			sim->int_falling = (cmd[6] >> 1) & 0x1;
+		}
+		if (cmd[6] & 0x01) {
+			sim->int_flag = 0;
+		}
+	}
+
+	if ((cmd[7] & 0x80) == 0) {
+		return;
+	}
+
+	for (int i = 0 ; i < 4 ; i++) {
+		sim->gp_func[i]      = cmd[8 + i] & 0x7;
+		sim->gp_direction[i] = (cmd[8 + i] >> 3) & 0x1;
+		sim->gp_value[i]     = (cmd[8 + i] >> 4) & 0x1;
+	}
+}
+
+// Get SRAM settings
+static void mcp2221_sim_get_sram_settings(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	resp[2] = 18;	// chip settings length
+	resp[3] = 4;	// GP settings length
+
+	// chip settings 3, then VID / PID as in the flash chip settings
+	resp[7] = ((sim->adc_reference & 0x3) << 3) | ((sim->adc_reference != 0) << 2);
+	memcpy(resp + 8, sim->flash_chip + 4, 4);
+
+	for (int i = 0 ; i < 4 ; i++) {
+		resp[22 + i] = (sim->gp_func[i] & 0x7) | ((sim->gp_direction[i] & 0x1) << 3) | ((sim->gp_value[i] & 0x1) << 4);
+	}
+}
+
+// Read Flash Data
+static void mcp2221_sim_read_flash_data(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	switch (cmd[1]) {
+		case 0x00:
+			resp[2] = sizeof(sim->flash_chip);
+			memcpy(resp + 4, sim->flash_chip, sizeof(sim->flash_chip));
+			break;
+		case 0x01:
+			resp[2] = sizeof(sim->flash_gp);
+			memcpy(resp + 4, sim->flash_gp, sizeof(sim->flash_gp));
+			break;
+		default:
+			// USB strings are not modeled
+			resp[1] = 0x01;
+			break;
+	}
+}
+
+// Write Flash Data
+static void mcp2221_sim_write_flash_data(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	switch (cmd[1]) {
+		case 0x00:
+			memcpy(sim->flash_chip, cmd + 2, sizeof(sim->flash_chip));
+			break;
+		case 0x01:
+			memcpy(sim->flash_gp, cmd + 2, sizeof(sim->flash_gp));
+			break;
+		default:
+			resp[1] = 0x01;
+			return;
+	}
+
+	sim->flash_write_count++;
+}
+
+// Execute one command and build its response.
+void mcp2221_sim_process(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]) {
+	memset(resp, 0, 64);
+
+	resp[0] = cmd[0];
+	resp[1] = 0;
+
+	switch (cmd[0]) {
+		case 0x10:
+			mcp2221_sim_status(sim, cmd, resp);
+			break;
+		case 0x40:
+			mcp2221_sim_i2c_get_data(sim, cmd, resp);
+			break;
+		case 0x90:
+		case 0x92:
+		case 0x94:
+			mcp2221_sim_i2c_write(sim, cmd, resp);
+			break;
+		case 0x91:
+		case 0x93:
+			mcp2221_sim_i2c_read(sim, cmd, resp);
+			break;
+		case 0x50:
+			mcp2221_sim_set_gpio_output(sim, cmd, resp);
+			break;
+		case 0x51:
+			mcp2221_sim_get_gpio_input(sim, cmd, resp);
+			break;
+		case 0x60:
+			mcp2221_sim_set_sram_settings(sim, cmd, resp);
+			break;
+		case 0x61:
+			mcp2221_sim_get_sram_settings(sim, cmd, resp);
+			break;
+		case 0xB0:
+			mcp2221_sim_read_flash_data(sim, cmd, resp);
+			break;
+		case 0xB1:
+			mcp2221_sim_write_flash_data(sim, cmd, resp);
+			break;
+		default:
+			// command not supported
+			resp[1] = 0x01;
+			break;
+	}
+
+	sim->command_count++;
+}
+
+// ----- transport -----
+static int mcp2221_sim_open(void *context) {
+	MCP2221Sim *sim = (MCP2221Sim *)context;
+
+	sim->response_head    = 0;
+	sim->response_count   = 0;
+	sim->last_response_us = 0;
+
+	return STATUS_OK;
+}
+
+static int mcp2221_sim_close(void *context) {
+	return STATUS_OK;
+}
+
+static int mcp2221_sim_send(void *context, const uint8_t *data, int length) {
+	MCP2221Sim *sim = (MCP2221Sim *)context;
+	uint8_t cmd[64] = {0};
+
+	memcpy(cmd, data, length);
+
+	if (sim->response_count == MCP2221_SIM_QUEUE_SIZE) {
+		// nobody reads the responses, the device stalls
+		return STATUS_IO_ERROR;
+	}
+
+	int slot = (sim->response_head + sim->response_count) % MCP2221_SIM_QUEUE_SIZE;
+	mcp2221_sim_process(sim, cmd, sim->response[slot]);
+
+	if (sim->config.drop_every > 0 && sim->command_count % sim->config.drop_every == 0) {
+		sim->dropped_count++;
+		return STATUS_OK;
+	}
+
+	uint64_t ready = mcp2221_sim_time_us() + sim->config.latency_us;
+	if (sim->config.jitter_us > 0) {
+		ready += rand_r(&sim->rng) % (sim->config.jitter_us + 1);
+	}
+	if (sim->config.frame_us > 0) {
+		ready = (ready + sim->config.frame_us - 1) / sim->config.frame_us * sim->config.frame_us;
+
+		// the interrupt endpoint carries one report per frame
+		if (ready < sim->last_response_us + sim->config.frame_us) {
+			ready = sim->last_response_us + sim->config.frame_us;
+		}
+	}
+
+	// responses are returned in order
+	if (sim->response_count > 0) {
+		int last = (slot + MCP2221_SIM_QUEUE_SIZE - 1) % MCP2221_SIM_QUEUE_SIZE;
+		if (ready < sim->response_time_us[last]) {
+			ready = sim->response_time_us[last];
+		}
+	}
+
+	sim->response_time_us[slot] = ready;
+	sim->response_count++;
+	sim->last_response_us = ready;
+
+	return STATUS_OK;
+}
+
+static int mcp2221_sim_recv(void *context, uint8_t *data, int length, int timeout_ms) {
+	MCP2221Sim *sim = (MCP2221Sim *)context;
+	uint64_t now      = mcp2221_sim_time_us();
+	uint64_t deadline = now + (uint64_t)timeout_ms * 1000;
+
+	if (sim->response_count == 0 || deadline < sim->response_time_us[sim->response_head]) {
+		mcp2221_sim_sleep_until(deadline);
+		return STATUS_RECV_TIMEOUT;
+	}
+
+	if (now < sim->response_time_us[sim->response_head]) {
+		mcp2221_sim_sleep_until(sim->response_time_us[sim->response_head]);
+	}
+
+	memcpy(data, sim->response[sim->response_head], length);
+
+	sim->response_head = (sim->response_head + 1) % MCP2221_SIM_QUEUE_SIZE;
+	sim->response_count--;
+
+	return STATUS_OK;
+}
+
+void mcp2221_sim_get_transport(MCP2221Sim *sim, MCP2221Transport *transport) {
+	transport->context = sim;
+	transport->open    = mcp2221_sim_open;
+	transport->close   = mcp2221_sim_close;
+	transport->send    = mcp2221_sim_send;
+	transport->recv    = mcp2221_sim_recv;
+}
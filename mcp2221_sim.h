@@ -0,0 +1,92 @@
+#ifndef __MCP2221_SIM_H__
+#define __MCP2221_SIM_H__
+
+#include <stdint.h>
+
+#include "mcp2221.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Software model of the MCP2221 used as a transport.
+// It implements the command semantics seen by the host, no real hardware is needed.
+
+#define MCP2221_SIM_QUEUE_SIZE (8)
+
+typedef struct _MCP2221SimConfig {
+	// time from send to the response being readable
+	int latency_us;
+	// uniform random delay added to latency_us
+	int jitter_us;
+	// responses are ready at a frame boundary, one per frame (1000 : full speed USB), 0 : no framing
+	int frame_us;
+	// the response of every n-th command is lost (the command is executed), 0 : none
+	int drop_every;
+	unsigned int seed;
+} MCP2221SimConfig;
+
+typedef struct _MCP2221Sim {
+	MCP2221SimConfig config;
+
+	// GP0 - GP3
+	int gp_func[4];
+	int gp_direction[4];
+	int gp_value[4];	// output latch
+	int gp_input[4];	// level applied to the pin from outside
+
+	// GP1 interrupt on change
+	int int_rising;
+	int int_falling;
+	int int_flag;
+
+	// flash : chip settings 0 - 3, VID, PID, USB power attributes, USB current / GP0 - GP3
+	// loaded into SRAM by mcp2221_sim_power_cycle
+	uint8_t  flash_chip[10];
+	uint8_t  flash_gp[4];
+	uint64_t flash_write_count;
+
+	// ADC1 - ADC3 (10bit)
+	int adc_value[3];
+	int adc_reference;
+
+	// I2C slave : 256 byte register file, the first written byte selects the register
+	int     i2c_slave_address;	// -1 : no slave on the bus
+	uint8_t i2c_slave_regs[256];
+	int     i2c_slave_pointer;
+
+	// I2C engine
+	int i2c_state;
+	int i2c_address;
+	int i2c_requested;
+	int i2c_transferred;
+	int i2c_nack;
+	int i2c_writing;
+	int i2c_read_remaining;
+	int i2c_speed_divider;
+
+	// pending responses
+	uint8_t  response[MCP2221_SIM_QUEUE_SIZE][64];
+	uint64_t response_time_us[MCP2221_SIM_QUEUE_SIZE];
+	int      response_head;
+	int      response_count;
+	uint64_t last_response_us;	// ready time of the last response, it took its frame
+
+	uint64_t command_count;
+	uint64_t dropped_count;
+	unsigned int rng;
+} MCP2221Sim;
+
+int mcp2221_sim_init(MCP2221Sim *sim, const MCP2221SimConfig *config);
+void mcp2221_sim_get_transport(MCP2221Sim *sim, MCP2221Transport *transport);
+int mcp2221_sim_set_input(MCP2221Sim *sim, int port, GPIOValue value);
+int mcp2221_sim_set_i2c_slave(MCP2221Sim *sim, int address);
+int mcp2221_sim_set_adc(MCP2221Sim *sim, int channel, int value);
+void mcp2221_sim_power_cycle(MCP2221Sim *sim);
+void mcp2221_sim_process(MCP2221Sim *sim, const uint8_t cmd[64], uint8_t resp[64]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
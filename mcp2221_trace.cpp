@@ -0,0 +1,400 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sched.h>
+
+#include <atomic>
+
+#include "mcp2221.h"
+#include "mcp2221_trace.h"
+
+typedef struct _TraceSlot {
+	// 2n + 1 while record n is written, 2n + 2 when it is complete
+	std::atomic<uint64_t> seq;
+	MCP2221TraceRecord    record;
+} TraceSlot;
+
+int mcp2221_trace_enabled_flag = 0;
+
+static TraceSlot *trace_slots    = NULL;
+static uint64_t   trace_capacity = 0;
+static std::atomic<uint64_t> trace_head(0);
+
+// producers inside mcp2221_trace_record, the slots are not reset or released until it drops to 0
+static std::atomic<int> trace_producers(0);
+
+static uint64_t mcp2221_trace_time_ns() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_u16(uint8_t *p, uint16_t v) {
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+	for (int i = 0 ; i < 4 ; i++) {
+		p[i] = (v >> (8 * i)) & 0xFF;
+	}
+}
+
+static void put_u64(uint8_t *p, uint64_t v) {
+	for (int i = 0 ; i < 8 ; i++) {
+		p[i] = (v >> (8 * i)) & 0xFF;
+	}
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	uint32_t v = 0;
+	for (int i = 0 ; i < 4 ; i++) {
+		v |= (uint32_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+static uint64_t get_u64(const uint8_t *p) {
+	uint64_t v = 0;
+	for (int i = 0 ; i < 8 ; i++) {
+		v |= (uint64_t)p[i] << (8 * i);
+	}
+	return v;
+}
+
+// Allocate the ring buffer and start recording.
+// capacity is rounded up to a power of two.
+int mcp2221_trace_start(int capacity) {
+	if (capacity <= 0) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	uint64_t size = 1;
+	while (size < (uint64_t)capacity) {
+		size <<= 1;
+	}
+
+	mcp2221_trace_stop();
+
+	if (trace_slots == NULL || trace_capacity != size) {
+		delete[] trace_slots;
+		trace_slots    = new TraceSlot[size];
+		trace_capacity = size;
+	}
+
+	for (uint64_t i = 0 ; i < trace_capacity ; i++) {
+		trace_slots[i].seq.store(0, std::memory_order_relaxed);
+	}
+	trace_head.store(0, std::memory_order_relaxed);
+
+	__atomic_store_n(&mcp2221_trace_enabled_flag, 1, __ATOMIC_SEQ_CST);
+
+	return STATUS_OK;
+}
+
+// Stop recording. The recorded data is kept until the next start.
+// Returns once the records in progress are complete.
+void mcp2221_trace_stop() {
+	__atomic_store_n(&mcp2221_trace_enabled_flag, 0, __ATOMIC_SEQ_CST);
+
+	// a producer which entered before the store finishes its record,
+	// one entering after it sees the tracer stopped
+	while (trace_producers.load(std::memory_order_seq_cst) != 0) {
+		sched_yield();
+	}
+}
+
+// Release the ring buffer, producers may still be running.
+void mcp2221_trace_free() {
+	mcp2221_trace_stop();
+
+	delete[] trace_slots;
+	trace_slots    = NULL;
+	trace_capacity = 0;
+}
+
+void mcp2221_trace_record(int direction, const uint8_t *data, int length) {
+	trace_producers.fetch_add(1, std::memory_order_seq_cst);
+
+	if (!__atomic_load_n(&mcp2221_trace_enabled_flag, __ATOMIC_SEQ_CST)) {
+		trace_producers.fetch_sub(1, std::memory_order_release);
+		return;
+	}
+
+	uint64_t n = trace_head.fetch_add(1, std::memory_order_relaxed);
+	TraceSlot *slot = &trace_slots[n & (trace_capacity - 1)];
+
+	slot->seq.store(2 * n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	slot->record.timestamp_ns = mcp2221_trace_time_ns();
+	slot->record.direction    = direction;
+	slot->record.length       = length;
+	memcpy(slot->record.data, data, length);
+	memset(slot->record.data + length, 0, 64 - length);
+
+	slot->seq.store(2 * n + 2, std::memory_order_release);
+
+	trace_producers.fetch_sub(1, std::memory_order_release);
+}
+
+// Copy the recorded data, oldest first.
+// Records being overwritten while they are copied are skipped.
+int mcp2221_trace_read(MCP2221TraceRecord *records, int max, int *count) {
+	if (records == NULL || max < 0 || count == NULL) {
+		return STATUS_ARGUMENT_ERROR;
+	}
+
+	*count = 0;
+
+	if (trace_slots == NULL) {
+		return STATUS_OK;
+	}
+
+	uint64_t head  = trace_head.load(std::memory_order_acquire);
+	uint64_t begin = head > trace_capacity ? head - trace_capacity : 0;
+
+	for (uint64_t n = begin ; n < head && *count < max ; n++) {
+		TraceSlot *slot = &trace_slots[n & (trace_capacity - 1)];
+
+		uint64_t seq1 = slot->seq.load(std::memory_order_acquire);
+		if (seq1 != 2 * n + 2) {
+			continue;
+		}
+
+		records[*count] = slot->record;
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t seq2 = slot->seq.load(std::memory_order_relaxed);
+		if (seq1 != seq2) {
+			continue;
+		}
+
+		(*count)++;
+	}
+
+	return STATUS_OK;
+}
+
+// Number of records lost because the ring buffer was full.
+uint64_t mcp2221_trace_overwritten() {
+	uint64_t head = trace_head.load(std::memory_order_relaxed);
+
+	return head > trace_capacity ? head - trace_capacity : 0;
+}
+
+int mcp2221_trace_save(const char *path) {
+	int ret;
+	int count;
+
+	MCP2221TraceRecord *records = new MCP2221TraceRecord[trace_capacity > 0 ? trace_capacity : 1];
+
+	ret = mcp2221_trace_read(records, (int)trace_capacity, &count);
+	if (ret != STATUS_OK) {
+		delete[] records;
+		return ret;
+	}
+
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("[ERROR] can not open %s.\n", path);
+		delete[] records;
+		return STATUS_IO_ERROR;
+	}
+
+	uint8_t header[MCP2221_TRACE_HEADER_SIZE];
+	memcpy(header, MCP2221_TRACE_MAGIC, 4);
+	put_u16(header + 4, MCP2221_TRACE_VERSION);
+	put_u16(header + 6, MCP2221_TRACE_RECORD_SIZE);
+	put_u32(header + 8, count);
+
+	ret = STATUS_OK;
+	if (fwrite(header, sizeof(header), 1, fp) != 1) {
+		ret = STATUS_IO_ERROR;
+	}
+
+	for (int i = 0 ; i < count && ret == STATUS_OK ; i++) {
+		uint8_t raw[MCP2221_TRACE_RECORD_SIZE];
+
+		put_u64(raw, records[i].timestamp_ns);
+		raw[8] = records[i].direction;
+		raw[9] = records[i].length;
+		memcpy(raw + 10, records[i].data, 64);
+
+		if (fwrite(raw, sizeof(raw), 1, fp) != 1) {
+			ret = STATUS_IO_ERROR;
+		}
+	}
+
+	if (fclose(fp) != 0) {
+		ret = STATUS_IO_ERROR;
+	}
+
+	delete[] records;
+
+	return ret;
+}
+
+// Load a capture file. *records must be released with delete[].
+int mcp2221_trace_load(const char *path, MCP2221TraceRecord **records, int *count) {
+	uint8_t header[MCP2221_TRACE_HEADER_SIZE];
+
+	*records = NULL;
+	*count   = 0;
+
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("[ERROR] can not open %s.\n", path);
+		return STATUS_IO_ERROR;
+	}
+
+	if (
+			fread(header, sizeof(header), 1, fp) != 1 ||
+			memcmp(header, MCP2221_TRACE_MAGIC, 4) != 0 ||
+			get_u16(header + 4) != MCP2221_TRACE_VERSION ||
+			get_u16(header + 6) != MCP2221_TRACE_RECORD_SIZE
+	) {
+		printf("[ERROR] %s is not a capture file.\n", path);
+		fclose(fp);
+		return STATUS_IO_ERROR;
+	}
+
+	uint32_t n = get_u32(header + 8);
+
+	// the count is checked against the file before it sizes the allocation
+	long size = -1;
+	if (fseek(fp, 0, SEEK_END) == 0) {
+		size = ftell(fp);
+	}
+	if (size < MCP2221_TRACE_HEADER_SIZE || fseek(fp, MCP2221_TRACE_HEADER_SIZE, SEEK_SET) != 0) {
+		printf("[ERROR] can not read %s.\n", path);
+		fclose(fp);
+		return STATUS_IO_ERROR;
+	}
+	if ((uint64_t)(size - MCP2221_TRACE_HEADER_SIZE) / MCP2221_TRACE_RECORD_SIZE < n || INT_MAX < n) {
+		printf("[ERROR] %s is truncated.\n", path);
+		fclose(fp);
+		return STATUS_IO_ERROR;
+	}
+
+	MCP2221TraceRecord *buf = new MCP2221TraceRecord[n > 0 ? n : 1];
+
+	for (uint32_t i = 0 ; i < n ; i++) {
+		uint8_t raw[MCP2221_TRACE_RECORD_SIZE];
+
+		if (fread(raw, sizeof(raw), 1, fp) != 1 || 64 < raw[9]) {
+			printf("[ERROR] %s is truncated.\n", path);
+			delete[] buf;
+			fclose(fp);
+			return STATUS_IO_ERROR;
+		}
+
+		buf[i].timestamp_ns = get_u64(raw);
+		buf[i].direction    = raw[8];
+		buf[i].length       = raw[9];
+		memcpy(buf[i].data, raw + 10, 64);
+	}
+
+	fclose(fp);
+
+	*records = buf;
+	*count   = n;
+
+	return STATUS_OK;
+}
+
+const char *mcp2221_opcode_name(uint8_t opcode) {
+	switch (opcode) {
+		case 0x10: return "STATUS/SET_PARAMETERS";
+		case 0x40: return "I2C_GET_DATA";
+		case 0x50: return "SET_GPIO_OUTPUT";
+		case 0x51: return "GET_GPIO_VALUES";
+		case 0x60: return "SET_SRAM_SETTINGS";
+		case 0x61: return "GET_SRAM_SETTINGS";
+		case 0x70: return "RESET_CHIP";
+		case 0x90: return "I2C_WRITE";
+		case 0x91: return "I2C_READ";
+		case 0x92: return "I2C_WRITE_REPEATED_START";
+		case 0x93: return "I2C_READ_REPEATED_START";
+		case 0x94: return "I2C_WRITE_NO_STOP";
+		case 0xB0: return "READ_FLASH_DATA";
+		case 0xB1: return "WRITE_FLASH_DATA";
+		case 0xB2: return "SEND_FLASH_PASSWORD";
+		default:   return "UNKNOWN";
+	}
+}
+
+// Print the records and the command latency per opcode.
+// The latency of a command is the time from its send record to the following recv record.
+void mcp2221_trace_print(FILE *fp, const MCP2221TraceRecord *records, int count) {
+	uint64_t lat_count[256] = {0};
+	uint64_t lat_sum[256]   = {0};
+	uint64_t lat_min[256];
+	uint64_t lat_max[256]   = {0};
+	int pending = -1;
+
+	for (int i = 0 ; i < 256 ; i++) {
+		lat_min[i] = UINT64_MAX;
+	}
+
+	for (int i = 0 ; i < count ; i++) {
+		const MCP2221TraceRecord *r = &records[i];
+		uint8_t opcode = r->length > 0 ? r->data[0] : 0;
+
+		fprintf(fp, "%llu.%09llu %s 0x%02x %-24s",
+				(unsigned long long)(r->timestamp_ns / 1000000000),
+				(unsigned long long)(r->timestamp_ns % 1000000000),
+				r->direction == MCP2221_TRACE_SEND ? "send" : "recv",
+				opcode, mcp2221_opcode_name(opcode));
+
+		if (r->direction == MCP2221_TRACE_SEND) {
+			pending = i;
+		} else if (pending >= 0 && records[pending].data[0] == opcode) {
+			uint64_t lat = r->timestamp_ns - records[pending].timestamp_ns;
+
+			fprintf(fp, " latency %llu us", (unsigned long long)(lat / 1000));
+
+			lat_count[opcode]++;
+			lat_sum[opcode] += lat;
+			if (lat < lat_min[opcode]) lat_min[opcode] = lat;
+			if (lat_max[opcode] < lat) lat_max[opcode] = lat;
+
+			pending = -1;
+		}
+		fprintf(fp, "\n");
+
+		for (int j = 0 ; j < r->length ; j++) {
+			fprintf(fp, "0x%02x ", r->data[j]);
+			if (j % 16 == 15) {
+				fprintf(fp, "\n");
+			}
+		}
+		if (r->length % 16 != 0) {
+			fprintf(fp, "\n");
+		}
+	}
+
+	fprintf(fp, "----- latency [us] -----\n");
+	fprintf(fp, "opcode name                      count      min      avg      max\n");
+	for (int i = 0 ; i < 256 ; i++) {
+		if (lat_count[i] == 0) {
+			continue;
+		}
+
+		fprintf(fp, "0x%02x   %-24s %8llu %8llu %8llu %8llu\n",
+				i, mcp2221_opcode_name(i),
+				(unsigned long long)lat_count[i],
+				(unsigned long long)(lat_min[i] / 1000),
+				(unsigned long long)(lat_sum[i] / lat_count[i] / 1000),
+				(unsigned long long)(lat_max[i] / 1000));
+	}
+}
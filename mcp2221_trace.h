@@ -0,0 +1,58 @@
+#ifndef __MCP2221_TRACE_H__
+#define __MCP2221_TRACE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Packet tracer
+//
+// Send / recv reports are recorded into a preallocated ring buffer.
+// Producers never block, the oldest records are overwritten when it is full.
+// While the tracer is stopped the cost is a single branch.
+//
+// Capture file format (little endian)
+//   header : char magic[4] = "M2TR", uint16 version, uint16 record size, uint32 record count
+//   record : uint64 timestamp [ns], uint8 direction, uint8 length, uint8 data[64]
+
+#define MCP2221_TRACE_MAGIC        "M2TR"
+#define MCP2221_TRACE_VERSION      (1)
+#define MCP2221_TRACE_HEADER_SIZE  (12)
+#define MCP2221_TRACE_RECORD_SIZE  (74)
+
+#define MCP2221_TRACE_SEND (0)
+#define MCP2221_TRACE_RECV (1)
+
+typedef struct _MCP2221TraceRecord {
+	uint64_t timestamp_ns;	// CLOCK_MONOTONIC
+	uint8_t  direction;		// MCP2221_TRACE_SEND or MCP2221_TRACE_RECV
+	uint8_t  length;
+	uint8_t  data[64];
+} MCP2221TraceRecord;
+
+// set by start / stop, read with __atomic builtins so the header stays usable from C
+extern int mcp2221_trace_enabled_flag;
+
+static inline int mcp2221_trace_enabled() {
+	return __atomic_load_n(&mcp2221_trace_enabled_flag, __ATOMIC_RELAXED);
+}
+
+int mcp2221_trace_start(int capacity);
+void mcp2221_trace_stop();
+void mcp2221_trace_free();
+void mcp2221_trace_record(int direction, const uint8_t *data, int length);
+int mcp2221_trace_read(MCP2221TraceRecord *records, int max, int *count);
+uint64_t mcp2221_trace_overwritten();
+int mcp2221_trace_save(const char *path);
+int mcp2221_trace_load(const char *path, MCP2221TraceRecord **records, int *count);
+void mcp2221_trace_print(FILE *fp, const MCP2221TraceRecord *records, int count);
+const char *mcp2221_opcode_name(uint8_t opcode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,27 @@
+#include <stdio.h>
+
+#include "mcp2221.h"
+#include "mcp2221_trace.h"
+
+int main(int argc, char *argv[]) {
+	int ret;
+	int count;
+	MCP2221TraceRecord *records;
+
+	if (argc < 2) {
+		printf("usage : ./mcp2221_trace_dump <capture file>\n");
+		return 1;
+	}
+
+	ret = mcp2221_trace_load(argv[1], &records, &count);
+	if (ret != STATUS_OK) {
+		return 1;
+	}
+
+	printf("%d records\n", count);
+	mcp2221_trace_print(stdout, records, count);
+
+	delete[] records;
+
+	return 0;
+}
@@ -1,11 +1,55 @@
 
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <utility>
+
 #include "mcp2221.h"
+#include "mcp2221.hpp"
+#include "mcp2221_adc.h"
+#include "mcp2221_async.h"
+#include "mcp2221_client.h"
+#include "mcp2221_daemon.h"
+#include "mcp2221_hotplug.h"
+#include "mcp2221_i2c.h"
+#include "mcp2221_metrics.h"
+#include "mcp2221_poller.h"
+#include "mcp2221_private.h"
+#include "mcp2221_regcache.h"
+#include "mcp2221_sequence.h"
+#include "mcp2221_sim.h"
+#include "mcp2221_trace.h"
 #include "test.h"
 
+// "./mcp2221_test --sim" runs the tests against the simulated device
+static int use_sim = 0;
+static MCP2221Sim sim;
+
+static int test_init(MCP2221Handle *handle) {
+	if (use_sim) {
+		MCP2221Transport transport;
+
+		mcp2221_sim_init(&sim, NULL);
+		mcp2221_sim_get_transport(&sim, &transport);
+
+		return mcp2221_init_with_transport(handle, &transport);
+	}
+
+	return mcp2221_init(handle);
+}
+
 int test_sram_setting() {
 	MCP2221Handle handle;
 
-	CHECK_EQ(mcp2221_init(&handle), STATUS_OK);
+	CHECK_EQ(test_init(&handle), STATUS_OK);
 
 	SRAMSetting setting;
 
@@ -49,12 +93,14 @@ int test_sram_setting() {
 	CHECK_EQ(setting.gpn_gpio_direction[3], read_setting.gpn_gpio_direction[3]);
 
 	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
 }
 
 int test_gpio_direction() {
 	MCP2221Handle handle;
 
-	CHECK_EQ(mcp2221_init(&handle), STATUS_OK);
+	CHECK_EQ(test_init(&handle), STATUS_OK);
 
 	SRAMSetting setting;
 
@@ -96,12 +142,14 @@ int test_gpio_direction() {
 	CHECK_EQ(dirs[3], GPIO_DIR_OUT);
 
 	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
 }
 
 int test_gpio_value() {
 	MCP2221Handle handle;
 
-	CHECK_EQ(mcp2221_init(&handle), STATUS_OK);
+	CHECK_EQ(test_init(&handle), STATUS_OK);
 
 	SRAMSetting setting;
 
@@ -143,12 +191,2084 @@ int test_gpio_value() {
 	CHECK_EQ(values[3], GPIO_VALUE_H);
 
 	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
 }
 
-int main(int argc, char* argv[]) {
-	test_sram_setting();
-	test_gpio_direction();
+int test_gpio_multi() {
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	setting.enable_gpio_config = 1;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		setting.gpn_func[i]           = 0;
+		setting.gpn_gpio_direction[i] = 1;
+		setting.gpn_gpio_value[i]     = 0;
+	}
+
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+
+	CHECK_EQ(mcp2221_set_gpio_directions(&handle, GPIO_PORT_MASK_ALL, 0), STATUS_OK);
+	CHECK_EQ(mcp2221_set_gpio_values(&handle, GPIO_PORT_MASK_ALL, 0xA), STATUS_OK);
+
+	GPIOValue values[4];
+
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 0, &values[0]), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 1, &values[1]), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 2, &values[2]), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 3, &values[3]), STATUS_OK);
+
+	CHECK_EQ(values[0], GPIO_VALUE_L);
+	CHECK_EQ(values[1], GPIO_VALUE_H);
+	CHECK_EQ(values[2], GPIO_VALUE_L);
+	CHECK_EQ(values[3], GPIO_VALUE_H);
+
+	// only GP0 is altered
+	CHECK_EQ(mcp2221_set_gpio_values(&handle, GPIO_PORT_MASK(0), 0x1), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 0, &values[0]), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 1, &values[1]), STATUS_OK);
+	CHECK_EQ(values[0], GPIO_VALUE_H);
+	CHECK_EQ(values[1], GPIO_VALUE_H);
+
+	CHECK_EQ(mcp2221_set_gpio_values(&handle, 0x10, 0), STATUS_ARGUMENT_ERROR);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_gpio_snapshot() {
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	setting.enable_gpio_config = 1;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		setting.gpn_func[i]           = 0;
+		setting.gpn_gpio_direction[i] = 0;
+		setting.gpn_gpio_value[i]     = 0;
+	}
+
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+
+	CHECK_EQ(mcp2221_set_gpio_directions(&handle, GPIO_PORT_MASK_ALL, 0x3), STATUS_OK);
+	CHECK_EQ(mcp2221_set_gpio_values(&handle, GPIO_PORT_MASK(2) | GPIO_PORT_MASK(3), 0x4), STATUS_OK);
+
+	GPIOSnapshot snapshot;
+
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+
+	CHECK_EQ(snapshot.direction[0], GPIO_DIR_IN);
+	CHECK_EQ(snapshot.direction[1], GPIO_DIR_IN);
+	CHECK_EQ(snapshot.direction[2], GPIO_DIR_OUT);
+	CHECK_EQ(snapshot.direction[3], GPIO_DIR_OUT);
+	CHECK_EQ(snapshot.value[2], GPIO_VALUE_H);
+	CHECK_EQ(snapshot.value[3], GPIO_VALUE_L);
+
+	// per-port getters are answered from the cache (long enough not to expire during the test)
+	CHECK_EQ(mcp2221_set_gpio_cache(&handle, 10000000), STATUS_OK);
+
+	GPIOValue value;
+	GPIODirection dir;
+
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 2, &value), STATUS_OK);
+
+	// a cache hit : no round trip
+	uint64_t count = sim.command_count;
+
+	CHECK_EQ(mcp2221_get_gpio_direction(&handle, 3, &dir), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 3, &value), STATUS_OK);
+	if (use_sim) {
+		CHECK_EQ(sim.command_count, count);
+	}
+	CHECK_EQ(value, GPIO_VALUE_L);
+	CHECK_EQ(dir, GPIO_DIR_OUT);
+
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 2, &value), STATUS_OK);
+	CHECK_EQ(value, GPIO_VALUE_H);
+
+	// a write invalidates the cache : the write and one fresh read
+	CHECK_EQ(mcp2221_set_gpio_value(&handle, 2, GPIO_VALUE_L), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_value(&handle, 2, &value), STATUS_OK);
+	CHECK_EQ(value, GPIO_VALUE_L);
+	if (use_sim) {
+		CHECK_EQ(sim.command_count, count + 2);
+	}
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_gpio_not_gpio() {
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	setting.enable_gpio_config = 1;
+
+	setting.gpn_func[0]           = GP0_FUNC_GPIO;
+	setting.gpn_gpio_direction[0] = 0;
+	setting.gpn_gpio_value[0]     = 1;
+
+	setting.gpn_func[1]           = GP1_FUNC_ADC1;
+	setting.gpn_gpio_direction[1] = 1;
+	setting.gpn_gpio_value[1]     = 0;
+
+	setting.gpn_func[2]           = GP2_FUNC_ADC2;
+	setting.gpn_gpio_direction[2] = 1;
+	setting.gpn_gpio_value[2]     = 0;
+
+	setting.gpn_func[3]           = GP3_FUNC_GPIO;
+	setting.gpn_gpio_direction[3] = 1;
+	setting.gpn_gpio_value[3]     = 0;
+
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+
+	GPIOSnapshot snapshot;
+
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+
+	CHECK_EQ(snapshot.value[0], GPIO_VALUE_H);
+	CHECK_EQ(snapshot.direction[0], GPIO_DIR_OUT);
+	CHECK_EQ(snapshot.value[1], GPIO_VALUE_MAX);
+	CHECK_EQ(snapshot.direction[1], GPIO_DIR_MAX);
+	CHECK_EQ(snapshot.value[2], GPIO_VALUE_MAX);
+	CHECK_EQ(snapshot.direction[2], GPIO_DIR_MAX);
+	CHECK_EQ(snapshot.direction[3], GPIO_DIR_IN);
+
+	// the echo of a port which is not GPIO is 0xEE
+	CHECK_EQ(mcp2221_set_gpio_value(&handle, 1, GPIO_VALUE_H), STATUS_IO_ERROR);
+	CHECK_EQ(mcp2221_set_gpio_value(&handle, 0, GPIO_VALUE_L), STATUS_OK);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+// needs the slave model of the simulator at address 0x50
+int test_i2c() {
+	MCP2221Handle handle;
+
+	if (!use_sim) {
+		return 0;
+	}
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_sim_set_i2c_slave(&sim, 0x50), STATUS_OK);
+
+	CHECK_EQ(mcp2221_i2c_set_speed(&handle, 400000), STATUS_OK);
+
+	// register pointer + 200 bytes, split into 4 reports
+	uint8_t wdata[201];
+	wdata[0] = 0x10;
+	for (int i = 1 ; i < 201 ; i++) {
+		wdata[i] = i * 7;
+	}
+
+	CHECK_EQ(mcp2221_i2c_write(&handle, 0x50, wdata, sizeof(wdata)), STATUS_OK);
+	CHECK_EQ(sim.i2c_slave_regs[0x10], wdata[1]);
+	CHECK_EQ(sim.i2c_slave_regs[0x10 + 199], wdata[200]);
+
+	uint8_t rdata[200];
+	memset(rdata, 0, sizeof(rdata));
+
+	CHECK_EQ(mcp2221_i2c_write_read(&handle, 0x50, wdata, 1, rdata, sizeof(rdata)), STATUS_OK);
+	CHECK_EQ(memcmp(rdata, wdata + 1, sizeof(rdata)), 0);
+
+	// plain read continues from the register pointer
+	CHECK_EQ(mcp2221_i2c_write(&handle, 0x50, wdata, 1), STATUS_OK);
+	CHECK_EQ(mcp2221_i2c_read(&handle, 0x50, rdata, 3), STATUS_OK);
+	CHECK_EQ(rdata[2], wdata[3]);
+
+	// nobody answers at 0x51
+	CHECK_EQ(mcp2221_i2c_write(&handle, 0x51, wdata, 2), STATUS_I2C_NACK);
+	CHECK_EQ(mcp2221_i2c_read(&handle, 0x51, rdata, 2), STATUS_I2C_NACK);
+
+	I2CStatus status;
+
+	CHECK_EQ(mcp2221_i2c_get_status(&handle, &status), STATUS_OK);
+	CHECK_EQ(status.state, 0);
+	CHECK_EQ(status.speed_divider, 12000000 / 400000 - 3);
+
+	CHECK_EQ(mcp2221_i2c_write(&handle, 0x80, wdata, 1), STATUS_ARGUMENT_ERROR);
+	CHECK_EQ(mcp2221_i2c_read(&handle, 0x50, rdata, 0), STATUS_ARGUMENT_ERROR);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+// Two threads read different registers of one slave through the same handle.
+// The register pointer write and the read of a thread must not be split by the other thread,
+// an interleaving is rare per transfer so there are many of them.
+int test_i2c_threads() {
+	MCP2221Handle handle;
+
+	if (!use_sim) {
+		return 0;
+	}
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_sim_set_i2c_slave(&sim, 0x50), STATUS_OK);
+
+	for (int i = 0 ; i < 256 ; i++) {
+		sim.i2c_slave_regs[i] = i < 128 ? 0xA5 : 0x5A;
+	}
+
+	int errors[2] = { 0 };
+	std::thread threads[2];
+
+	for (int t = 0 ; t < 2 ; t++) {
+		threads[t] = std::thread([&handle, &errors, t] {
+			uint8_t reg = t * 128;
+			uint8_t rdata[100];
+
+			for (int i = 0 ; i < 2000 ; i++) {
+				if (mcp2221_i2c_write_read(&handle, 0x50, &reg, 1, rdata, sizeof(rdata)) != STATUS_OK) {
+					errors[t]++;
+					continue;
+				}
+				for (int j = 0 ; j < (int)sizeof(rdata) ; j++) {
+					if (rdata[j] != (t == 0 ? 0xA5 : 0x5A)) {
+						errors[t]++;
+						break;
+					}
+				}
+			}
+		});
+	}
+	for (int t = 0 ; t < 2 ; t++) {
+		threads[t].join();
+	}
+
+	CHECK_EQ(errors[0], 0);
+	CHECK_EQ(errors[1], 0);
+	CHECK_EQ(handle.transaction_lock, 0);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+// needs the slave model of the simulator at address 0x50
+int test_regcache() {
+	MCP2221Handle handle;
+	I2CRegCache cache;
+	uint8_t value;
+
+	if (!use_sim) {
+		return 0;
+	}
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_sim_set_i2c_slave(&sim, 0x50), STATUS_OK);
+
+	sim.i2c_slave_regs[0x01] = 0x3C;
+	sim.i2c_slave_regs[0xF0] = 0x11;
+
+	CHECK_EQ(mcp2221_regcache_init(&cache, &handle, 0x50), STATUS_OK);
+	CHECK_EQ(mcp2221_regcache_add_volatile(&cache, 0xF0, 0xFF), STATUS_OK);
+
+	// miss, then hit without bus traffic
+	CHECK_EQ(mcp2221_regcache_read(&cache, 0x01, &value), STATUS_OK);
+	CHECK_EQ(value, 0x3C);
+
+	uint64_t commands = sim.command_count;
+
+	CHECK_EQ(mcp2221_regcache_read(&cache, 0x01, &value), STATUS_OK);
+	CHECK_EQ(value, 0x3C);
+	CHECK_EQ(mcp2221_regcache_update_bits(&cache, 0x01, 0x0C, 0x0C), STATUS_OK);
+	CHECK_EQ(sim.command_count == commands, 1);
+	CHECK_EQ((int)cache.hits, 2);
+	CHECK_EQ((int)cache.misses, 1);
+
+	// read-modify-write goes to the bus only for the write
+	CHECK_EQ(mcp2221_regcache_update_bits(&cache, 0x01, 0x03, 0x01), STATUS_OK);
+	CHECK_EQ(sim.i2c_slave_regs[0x01], 0x3D);
+	CHECK_EQ((int)cache.bus_reads, 1);
+	CHECK_EQ((int)cache.bus_writes, 1);
+
+	// volatile registers always come from the slave
+	CHECK_EQ(mcp2221_regcache_read(&cache, 0xF0, &value), STATUS_OK);
+	sim.i2c_slave_regs[0xF0] = 0x22;
+	CHECK_EQ(mcp2221_regcache_read(&cache, 0xF0, &value), STATUS_OK);
+	CHECK_EQ(value, 0x22);
+
+	// block access
+	uint8_t block[4] = { 1, 2, 3, 4 };
+	CHECK_EQ(mcp2221_regcache_write_block(&cache, 0x10, block, 4), STATUS_OK);
+	memset(block, 0, sizeof(block));
+	commands = sim.command_count;
+	CHECK_EQ(mcp2221_regcache_read_block(&cache, 0x10, block, 4), STATUS_OK);
+	CHECK_EQ(sim.command_count == commands, 1);
+	CHECK_EQ(block[3], 4);
+
+	// the slave changed behind the cache
+	sim.i2c_slave_regs[0x01] = 0x00;
+	mcp2221_regcache_invalidate_all(&cache);
+	CHECK_EQ(mcp2221_regcache_read(&cache, 0x01, &value), STATUS_OK);
+	CHECK_EQ(value, 0x00);
+
+	CHECK_EQ(mcp2221_regcache_read_block(&cache, 0xFE, block, 4), STATUS_ARGUMENT_ERROR);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_adc() {
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	setting.enable_gpio_config   = 1;
+
+	setting.gpn_func[0]           = GP0_FUNC_GPIO;
+	setting.gpn_func[1]           = GP1_FUNC_ADC1;
+	setting.gpn_func[2]           = GP2_FUNC_ADC2;
+	setting.gpn_func[3]           = GP3_FUNC_ADC3;
+
+	CHECK_EQ(mcp2221_set_adc_reference(&handle, ADC_REF_2048MV), STATUS_OK);
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+
+	// the generic write doesn't alter the reference
+	ADCReference reference;
+
+	mcp2221_invalidate_setting(&handle);
+	CHECK_EQ(mcp2221_get_adc_reference(&handle, &reference), STATUS_OK);
+	CHECK_EQ(reference, ADC_REF_2048MV);
+
+	// the selected reference : nothing is sent
+	uint64_t commands = sim.command_count;
+	CHECK_EQ(mcp2221_set_adc_reference(&handle, ADC_REF_2048MV), STATUS_OK);
+	if (use_sim) {
+		CHECK_EQ(sim.command_count, commands);
+	}
+
+	SRAMSetting read_setting;
+
+	CHECK_EQ(mcp2221_set_adc_reference(&handle, ADC_REF_VDD), STATUS_OK);
+	mcp2221_invalidate_setting(&handle);
+	CHECK_EQ(mcp2221_get_adc_reference(&handle, &reference), STATUS_OK);
+	CHECK_EQ(reference, ADC_REF_VDD);
+	CHECK_EQ(mcp2221_read_sram_setting(&handle, &read_setting), STATUS_OK);
+	CHECK_EQ(read_setting.gpn_func[1], GP1_FUNC_ADC1);
+
+	if (!use_sim) {
+		CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+		return 0;
+	}
+
+	mcp2221_sim_set_adc(&sim, 0, 0x123);
+	mcp2221_sim_set_adc(&sim, 2, 0x3FF);
+
+	ADCSample sample;
+
+	CHECK_EQ(mcp2221_read_adc(&handle, &sample), STATUS_OK);
+	CHECK_EQ(sample.value[0], 0x123);
+	CHECK_EQ(sample.value[1], 0);
+	CHECK_EQ(sample.value[2], 0x3FF);
+
+	// stream with a buffer which is drained in time
+	ADCStream *stream;
+	ADCSample samples[64];
+	int count;
+
+	// polled up to a generous deadline, a loaded machine may run the stream late
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	int received = 0;
+
+	CHECK_EQ(mcp2221_adc_stream_start(&stream, &handle, 1000, 64), STATUS_OK);
+	while (received < 6 && std::chrono::steady_clock::now() < deadline) {
+		CHECK_EQ(mcp2221_adc_stream_read(stream, samples + received, 64 - received, &count), STATUS_OK);
+		received += count;
+		usleep(1000);
+	}
+	CHECK_EQ(received >= 6, 1);
+	CHECK_EQ(samples[0].value[0], 0x123);
+	CHECK_EQ(samples[received - 1].timestamp_us > samples[0].timestamp_us, 1);
+	CHECK_EQ((int)mcp2221_adc_stream_dropped(stream), 0);
+	CHECK_EQ(mcp2221_adc_stream_stop(stream), STATUS_OK);
+
+	// a consumer which stalls loses samples
+	deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+	CHECK_EQ(mcp2221_adc_stream_start(&stream, &handle, 500, 2), STATUS_OK);
+	while (mcp2221_adc_stream_dropped(stream) == 0 && std::chrono::steady_clock::now() < deadline) {
+		usleep(1000);
+	}
+	CHECK_EQ(mcp2221_adc_stream_read(stream, samples, 64, &count), STATUS_OK);
+	CHECK_EQ(count, 2);
+	CHECK_EQ(mcp2221_adc_stream_dropped(stream) > 0, 1);
+	CHECK_EQ(mcp2221_adc_stream_stop(stream), STATUS_OK);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+static int async_order[16];
+static int async_count = 0;
+
+static void async_callback(MCP2221Request *request, void *user) {
+	async_order[async_count++] = (int)(intptr_t)user;
+}
+
+int test_async() {
+	MCP2221Handle handle;
+	MCP2221Request requests[16];
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_async_start(&handle, 2), STATUS_OK);
+
+	// the blocking api keeps working through the pipeline
+	CHECK_EQ(mcp2221_set_gpio_directions(&handle, GPIO_PORT_MASK_ALL, 0), STATUS_OK);
+
+	for (int i = 0 ; i < 16 ; i++) {
+		memset(requests[i].cmd, 0, 64);
+		requests[i].cmd[0]   = i % 2 == 0 ? 0x51 : 0x10;
+		requests[i].callback = async_callback;
+		requests[i].user     = (void *)(intptr_t)i;
+
+		CHECK_EQ(mcp2221_async_submit(&handle, &requests[i]), STATUS_OK);
+	}
+
+	// completed in submission order
+	for (int i = 0 ; i < 16 ; i++) {
+		CHECK_EQ(mcp2221_async_wait(&handle, &requests[i], 1000), STATUS_OK);
+		CHECK_EQ(requests[i].resp[0], requests[i].cmd[0]);
+	}
+	for (int i = 0 ; i < 16 ; i++) {
+		CHECK_EQ(async_order[i], i);
+	}
+
+	CHECK_EQ(mcp2221_async_stop(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_async_submit(&handle, &requests[0]), STATUS_ARGUMENT_ERROR);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+// each thread uses its own command, a response of another thread is detected
+static void test_threads_issue(MCP2221Handle *handle, uint8_t code, int count, int *errors) {
+	uint8_t cmd[64];
+	uint8_t buf[64];
+
+	for (int i = 0 ; i < count ; i++) {
+		memset(cmd, 0, sizeof(cmd));
+		cmd[0] = code;
+
+		if (mcp2221_issue_command(handle, cmd, buf) != STATUS_OK || buf[0] != code) {
+			(*errors)++;
+		}
+	}
+}
+
+int test_threads() {
+	MCP2221Handle handle;
+	const uint8_t codes[4] = { 0x10, 0x51, 0x61, 0x10 };
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	// without and with the pipeline
+	for (int pipeline = 0 ; pipeline < 2 ; pipeline++) {
+		if (pipeline) {
+			CHECK_EQ(mcp2221_async_start(&handle, 4), STATUS_OK);
+		}
+
+		uint64_t count = sim.command_count;
+		int errors[4] = { 0 };
+		std::thread threads[4];
+
+		for (int i = 0 ; i < 4 ; i++) {
+			threads[i] = std::thread(test_threads_issue, &handle, codes[i], 200, &errors[i]);
+		}
+		for (int i = 0 ; i < 4 ; i++) {
+			threads[i].join();
+		}
+
+		for (int i = 0 ; i < 4 ; i++) {
+			CHECK_EQ(errors[i], 0);
+		}
+		if (use_sim) {
+			CHECK_EQ(sim.command_count, count + 800);
+		}
+
+		if (pipeline) {
+			CHECK_EQ(mcp2221_async_stop(&handle), STATUS_OK);
+		}
+	}
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_trace() {
+	uint8_t data[64] = {0};
+	MCP2221TraceRecord records[8];
+	int count;
+
+	CHECK_EQ(mcp2221_trace_start(4), STATUS_OK);
+
+	for (int i = 0 ; i < 6 ; i++) {
+		data[0] = 0x50;
+		data[1] = i;
+		mcp2221_trace_record(i % 2 == 0 ? MCP2221_TRACE_SEND : MCP2221_TRACE_RECV, data, 64);
+	}
+
+	mcp2221_trace_stop();
+
+	// the oldest two records are overwritten
+	CHECK_EQ(mcp2221_trace_read(records, 8, &count), STATUS_OK);
+	CHECK_EQ(count, 4);
+	CHECK_EQ(records[0].data[1], 2);
+	CHECK_EQ(records[3].data[1], 5);
+	CHECK_EQ((int)mcp2221_trace_overwritten(), 2);
+
+	CHECK_EQ(mcp2221_trace_save("test_trace.bin"), STATUS_OK);
+
+	MCP2221TraceRecord *loaded;
+	CHECK_EQ(mcp2221_trace_load("test_trace.bin", &loaded, &count), STATUS_OK);
+	CHECK_EQ(count, 4);
+	for (int i = 0 ; i < 4 ; i++) {
+		CHECK_EQ(loaded[i].timestamp_ns == records[i].timestamp_ns, 1);
+		CHECK_EQ(loaded[i].direction, records[i].direction);
+		CHECK_EQ(memcmp(loaded[i].data, records[i].data, 64), 0);
+	}
+	delete[] loaded;
+
+	// a count larger than the file is rejected before anything is allocated
+	const uint8_t counts[2][4] = { { 5, 0, 0, 0 }, { 0xFF, 0xFF, 0xFF, 0xFF } };
+
+	for (int i = 0 ; i < 2 ; i++) {
+		FILE *fp = fopen("test_trace.bin", "r+b");
+		CHECK_EQ(fp != NULL, 1);
+		CHECK_EQ(fseek(fp, 8, SEEK_SET), 0);
+		CHECK_EQ((int)fwrite(counts[i], 4, 1, fp), 1);
+		fclose(fp);
+
+		CHECK_EQ(mcp2221_trace_load("test_trace.bin", &loaded, &count), STATUS_IO_ERROR);
+		CHECK_EQ(loaded == NULL, 1);
+	}
+
+	remove("test_trace.bin");
+	mcp2221_trace_free();
+
+	// start, stop and free wait for the records in progress
+	std::atomic<int> done(0);
+
+	std::thread producer([&done] {
+		uint8_t report[64] = { 0x10 };
+
+		while (!done.load()) {
+			if (mcp2221_trace_enabled()) {
+				mcp2221_trace_record(MCP2221_TRACE_SEND, report, 64);
+			}
+		}
+	});
+
+	int failed = 0;
+
+	for (int i = 0 ; i < 200 ; i++) {
+		failed += mcp2221_trace_start(i % 2 == 0 ? 4 : 8) != STATUS_OK;
+		usleep(10);
+		if (i % 3 == 0) {
+			mcp2221_trace_stop();
+		}
+		mcp2221_trace_free();
+	}
+
+	done.store(1);
+	producer.join();
+	CHECK_EQ(failed, 0);
+
+	return 0;
+}
+
+int test_apply_setting() {
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting target;
+
+	memset(&target, 0, sizeof(target));
+
+	target.enable_gpio_config   = 1;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		target.gpn_func[i]           = 0;
+		target.gpn_gpio_direction[i] = GPIO_DIR_OUT;
+		target.gpn_gpio_value[i]     = GPIO_VALUE_L;
+	}
+	target.gpn_func[3] = GP3_FUNC_ADC3;
+
+	CHECK_EQ(mcp2221_apply_setting(&handle, &target), STATUS_OK);
+	CHECK_EQ(handle.setting_valid, 1);
+
+	uint64_t count = sim.command_count;
+
+	// identical target : nothing is sent
+	CHECK_EQ(mcp2221_apply_setting(&handle, &target), STATUS_OK);
+	if (use_sim) {
+		CHECK_EQ(sim.command_count, count);
+	}
+
+	// only gpio values : one 0x50
+	target.gpn_gpio_value[0] = GPIO_VALUE_H;
+	target.gpn_gpio_value[2] = GPIO_VALUE_H;
+	CHECK_EQ(mcp2221_apply_setting(&handle, &target), STATUS_OK);
+	if (use_sim) {
+		CHECK_EQ(sim.command_count, count + 1);
+		CHECK_EQ(sim.gp_value[0], 1);
+		CHECK_EQ(sim.gp_value[2], 1);
+	}
+
+	// changes made with the gpio api are part of the shadow
+	CHECK_EQ(mcp2221_set_gpio_values(&handle, GPIO_PORT_MASK(1), GPIO_PORT_MASK(1)), STATUS_OK);
+	target.gpn_gpio_value[1] = GPIO_VALUE_H;
+	count = sim.command_count;
+	CHECK_EQ(mcp2221_apply_setting(&handle, &target), STATUS_OK);
+	if (use_sim) {
+		CHECK_EQ(sim.command_count, count);
+	}
+
+	// after an invalidation the state is read back once
+	mcp2221_invalidate_setting(&handle);
+	count = sim.command_count;
+	CHECK_EQ(mcp2221_apply_setting(&handle, &target), STATUS_OK);
+	if (use_sim) {
+		CHECK_EQ(sim.command_count, count + 1);
+	}
+
+	SRAMSetting setting;
+	memset(&setting, 0, sizeof(setting));
+	CHECK_EQ(mcp2221_read_sram_setting(&handle, &setting), STATUS_OK);
+	CHECK_EQ(setting.gpn_func[3], GP3_FUNC_ADC3);
+	CHECK_EQ(setting.gpn_gpio_value[0], 1);
+	CHECK_EQ(setting.gpn_gpio_value[1], 1);
+
+	// the state read back next to the VID of a real device (byte 8 of 0x61) :
+	// a non-Vdd reference is decoded, setting it again sends nothing
+	if (use_sim) {
+		sim.flash_chip[4] = 0xD8;
+		sim.flash_chip[5] = 0x04;
+		sim.adc_reference = ADC_REF_1024MV;
+
+		mcp2221_invalidate_setting(&handle);
+		count = sim.command_count;
+		CHECK_EQ(mcp2221_set_adc_reference(&handle, ADC_REF_1024MV), STATUS_OK);
+		CHECK_EQ(sim.command_count, count + 1);
+		CHECK_EQ(handle.adc_reference, ADC_REF_1024MV);
+
+		CHECK_EQ(mcp2221_apply_setting(&handle, &target), STATUS_OK);
+		CHECK_EQ(sim.command_count, count + 1);
+	}
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+// ----- report layout, checked at compile time -----
+namespace {
+
+using namespace mcp2221::layout;
+
+struct Bytes {
+	uint8_t b[64];
+};
+
+// fields of the same byte
+template <typename... F>
+constexpr bool disjoint() {
+	int sum = 0;
+	int all = 0;
+
+	for (int mask : { (int)F::mask... }) {
+		sum += mask;
+		all |= mask;
+	}
+
+	return sum == all;
+}
+
+static_assert(disjoint<SetSram::AlterAdcReference, SetSram::AdcReference, SetSram::AdcReferenceVrm>(), "SRAM byte 5");
+static_assert(disjoint<SetSram::AlterInterrupt, SetSram::AlterRising, SetSram::Rising, SetSram::AlterFalling, SetSram::Falling, SetSram::ClearInterrupt>(), "SRAM byte 6");
+static_assert(disjoint<SetSram::Gp::Func, SetSram::Gp::Direction, SetSram::Gp::Value>(), "GP designation");
+static_assert(disjoint<FlashChip::DacReference, FlashChip::DacReferenceVrm, FlashChip::DacValue>(), "flash chip byte 2");
+static_assert(disjoint<I2CTransfer::Address, I2CTransfer::Read>(), "I2C address byte");
+
+// offsets of the datasheet
+static_assert(SetGpioOutput::Direction::byte(3) == 17, "0x50 GP3 direction");
+static_assert(GetGpioValues::Direction::byte(3) == 9, "0x51 GP3 direction");
+static_assert(SetSram::Gp::Func::byte(3) == 11, "0x60 GP3 designation");
+static_assert(GetSram::Gp::Func::byte(3) == 25, "0x61 GP3 designation");
+static_assert(GetSram::AdcReference::byte() == 7 && GetSram::AdcReferenceVrm::byte() == 7, "0x61 chip settings 3");
+static_assert(GetSram::AdcReference::mask == FlashChip::AdcReference::mask && GetSram::AdcReferenceVrm::mask == FlashChip::AdcReferenceVrm::mask, "0x61 / flash chip settings 3");
+static_assert(Status::Adc::byte(2) == 54, "0x10 ADC3");
+
+constexpr Bytes golden_set_gpio_output() {
+	Bytes r{};
+	GPIOSetting gp2{};
+
+	gp2.enable_value     = 1;
+	gp2.value            = GPIO_VALUE_H;
+	gp2.enable_direction = 1;
+	gp2.direction        = GPIO_DIR_OUT;
+
+	mcp2221::encode_set_gpio_output(r.b, NULL, NULL, &gp2, NULL);
+
+	return r;
+}
+
+constexpr Bytes golden_set_sram() {
+	Bytes r{};
+	SRAMSetting setting{};
+
+	setting.enable_gpio_config    = 1;
+	setting.gpn_func[1]           = GP1_FUNC_INT;
+	setting.gpn_gpio_direction[1] = GPIO_DIR_IN;
+	setting.gpn_gpio_value[1]     = 1;
+
+	mcp2221::encode_set_sram_settings(r.b, &setting);
+
+	return r;
+}
+
+constexpr Bytes golden_set_interrupt(int edge, int clear) {
+	Bytes r{};
+
+	mcp2221::encode_set_interrupt(r.b, edge != INTERRUPT_EDGE_NONE, edge, clear);
+
+	return r;
+}
+
+constexpr Bytes golden_set_adc_reference(int reference) {
+	Bytes r{};
+
+	mcp2221::encode_set_adc_reference(r.b, reference);
+
+	return r;
+}
+
+constexpr Bytes golden_status(int cancel, int divider) {
+	Bytes r{};
+
+	mcp2221::encode_status(r.b, cancel, divider);
+
+	return r;
+}
+
+constexpr Bytes golden_i2c_read() {
+	Bytes r{};
+
+	mcp2221::encode_i2c_read(r.b, I2C_CMD_READ, 0x50, 300);
+
+	return r;
+}
+
+static_assert(golden_set_gpio_output().b[0] == 0x50, "0x50 code");
+static_assert(golden_set_gpio_output().b[10] == 1 && golden_set_gpio_output().b[11] == 1, "0x50 GP2 value");
+static_assert(golden_set_gpio_output().b[12] == 1 && golden_set_gpio_output().b[13] == 0, "0x50 GP2 direction");
+static_assert(golden_set_gpio_output().b[2] == 0 && golden_set_gpio_output().b[14] == 0, "0x50 other ports");
+
+static_assert(golden_set_sram().b[5] == 0x00, "0x60 ADC reference untouched");
+static_assert(golden_set_sram().b[6] == 0x00, "0x60 interrupt untouched");
+static_assert(golden_set_sram().b[7] == 0x80 && golden_set_sram().b[9] == 0x1C, "0x60 GP1");
+
+static_assert(golden_set_interrupt(INTERRUPT_EDGE_RISING, 0).b[6] == 0x9C, "0x60 rising edge");
+static_assert(golden_set_interrupt(INTERRUPT_EDGE_BOTH, 1).b[6] == 0x9F, "0x60 both edges and clear");
+static_assert(golden_set_interrupt(INTERRUPT_EDGE_NONE, 1).b[6] == 0x81, "0x60 clear only");
+static_assert(golden_set_interrupt(INTERRUPT_EDGE_BOTH, 1).b[5] == 0x00 && golden_set_interrupt(INTERRUPT_EDGE_BOTH, 1).b[7] == 0x00, "0x60 interrupt only");
+
+static_assert(golden_set_adc_reference(ADC_REF_2048MV).b[5] == 0x85, "0x60 ADC reference");
+static_assert(golden_set_adc_reference(ADC_REF_VDD).b[5] == 0x80, "0x60 ADC reference Vdd");
+static_assert(golden_set_adc_reference(ADC_REF_2048MV).b[6] == 0x00 && golden_set_adc_reference(ADC_REF_2048MV).b[7] == 0x00, "0x60 ADC reference only");
+
+static_assert(golden_status(1, 0).b[2] == 0x10 && golden_status(1, 0).b[3] == 0x00, "0x10 cancel");
+static_assert(golden_status(0, 27).b[3] == 0x20 && golden_status(0, 27).b[4] == 27, "0x10 speed");
+
+static_assert(golden_i2c_read().b[1] == 0x2C && golden_i2c_read().b[2] == 0x01 && golden_i2c_read().b[3] == 0xA1, "0x91 length and address");
+
+constexpr Bytes sample_status() {
+	Bytes r{};
+
+	r.b[0]  = 0x10;
+	r.b[9]  = 0x34;
+	r.b[10] = 0x12;
+	r.b[16] = 0xA0;
+	r.b[20] = 0x40;
+	r.b[52] = 0xAB;
+	r.b[53] = 0xFE;
+
+	return r;
+}
+
+constexpr Bytes sample_gpio_values() {
+	Bytes r{};
+
+	r.b[0] = 0x51;
+	r.b[2] = 1;
+	r.b[3] = 0;
+	r.b[4] = 0xEE;
+	r.b[5] = 0xEF;
+
+	return r;
+}
+
+constexpr Bytes sample_sram() {
+	Bytes r{};
+
+	r.b[0]  = 0x61;
+	r.b[7]  = 0x1C;
+	r.b[8]  = 0xD8;
+	r.b[9]  = 0x04;
+	r.b[23] = 0x1C;
+
+	return r;
+}
+
+// a Vdd reference next to the VID of a real device
+constexpr Bytes sample_sram_vdd() {
+	Bytes r{};
+
+	r.b[0] = 0x61;
+	r.b[8] = 0xD8;
+	r.b[9] = 0x04;
+
+	return r;
+}
+
+constexpr Bytes status_response = sample_status();
+constexpr Bytes gpio_response   = sample_gpio_values();
+constexpr Bytes sram_response   = sample_sram();
+
+static_assert(mcp2221::StatusView(status_response.b).ok(), "0x10 response");
+static_assert(mcp2221::StatusView(status_response.b).requested_length() == 0x1234, "0x10 requested length");
+static_assert(mcp2221::StatusView(status_response.b).i2c_address() == 0x50, "0x10 address");
+static_assert(mcp2221::StatusView(status_response.b).address_nack() == 1, "0x10 NACK");
+static_assert(mcp2221::StatusView(status_response.b).adc(1) == 0x2AB, "0x10 ADC2");
+
+static_assert(mcp2221::GpioInputView(gpio_response.b).value(0) == GPIO_VALUE_H, "0x51 GP0 value");
+static_assert(mcp2221::GpioInputView(gpio_response.b).direction(0) == GPIO_DIR_OUT, "0x51 GP0 direction");
+static_assert(mcp2221::GpioInputView(gpio_response.b).value(1) == GPIO_VALUE_MAX, "0x51 GP1 not GPIO");
+static_assert(mcp2221::GpioInputView(gpio_response.b).direction(1) == GPIO_DIR_MAX, "0x51 GP1 not GPIO");
+
+static_assert(mcp2221::SramView(sram_response.b).adc_reference() == ADC_REF_4096MV, "0x61 ADC reference");
+static_assert(mcp2221::SramView(sample_sram_vdd().b).adc_reference() == ADC_REF_VDD, "0x61 VID is not the ADC reference");
+static_assert(mcp2221::SramView(sram_response.b).gp_func(1) == GP1_FUNC_INT, "0x61 GP1 function");
+static_assert(mcp2221::SramView(sram_response.b).gp_direction(1) == GPIO_DIR_IN, "0x61 GP1 direction");
+
+} // namespace
+
+// the C command api builds the same reports at run time
+int test_codec() {
+	uint8_t cmd[64];
+	GPIOSetting gp[4];
+
+	memset(gp, 0, sizeof(gp));
+	gp[2].enable_value     = 1;
+	gp[2].value            = GPIO_VALUE_H;
+	gp[2].enable_direction = 1;
+	gp[2].direction        = GPIO_DIR_OUT;
+
+	mcp2221_command_set_gpio_output(cmd, &gp[0], &gp[1], &gp[2], &gp[3]);
+	CHECK_EQ(memcmp(cmd, golden_set_gpio_output().b, 64), 0);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+	setting.enable_gpio_config    = 1;
+	setting.gpn_func[1]           = GP1_FUNC_INT;
+	setting.gpn_gpio_direction[1] = GPIO_DIR_IN;
+	setting.gpn_gpio_value[1]     = 1;
+
+	mcp2221_command_set_sram_settings(cmd, &setting);
+	CHECK_EQ(memcmp(cmd, golden_set_sram().b, 64), 0);
+
+	mcp2221_command_status(cmd, 0, 27);
+	CHECK_EQ(memcmp(cmd, golden_status(0, 27).b, 64), 0);
+
+	mcp2221_command_i2c_read(cmd, I2C_CMD_READ, 0x50, 300);
+	CHECK_EQ(memcmp(cmd, golden_i2c_read().b, 64), 0);
+
+	const uint8_t data[3] = { 0x01, 0x02, 0x03 };
+
+	mcp2221_command_i2c_write(cmd, I2C_CMD_WRITE, 0x50, 3, data, 3);
+	CHECK_EQ(cmd[0], I2C_CMD_WRITE);
+	CHECK_EQ(cmd[1], 3);
+	CHECK_EQ(cmd[3], 0xA0);
+	CHECK_EQ(memcmp(cmd + 4, data, 3), 0);
+
+	return 0;
+}
+
+int test_device() {
+	if (!use_sim) {
+		return 0;
+	}
+
+	MCP2221Transport transport;
+
+	mcp2221_sim_init(&sim, NULL);
+	mcp2221_sim_get_transport(&sim, &transport);
+	mcp2221_sim_set_adc(&sim, 1, 0x2AB);
+
+	mcp2221::Device dev;
+
+	CHECK_EQ(dev.open_transport(&transport), STATUS_OK);
+
+	// the C api works on the handle owned by the device
+	CHECK_EQ(mcp2221_set_gpio_directions(dev.handle(), GPIO_PORT_MASK_ALL, 0), STATUS_OK);
+
+	mcp2221::encode_get_gpio_input(dev.command());
+	CHECK_EQ(dev.transfer(), STATUS_OK);
+	CHECK_EQ(dev.gpio_input().ok(), true);
+	CHECK_EQ(dev.gpio_input().direction(0), GPIO_DIR_OUT);
+
+	// the handle and its buffers move with the device
+	mcp2221::Device moved(std::move(dev));
+	CHECK_EQ(dev.is_open(), false);
+	CHECK_EQ(moved.is_open(), true);
+
+	int adc[3];
+	CHECK_EQ(moved.read_adc(adc), STATUS_OK);
+	CHECK_EQ(adc[1], 0x2AB);
+
+	GPIOSnapshot snapshot;
+	CHECK_EQ(moved.get_gpio_snapshot(&snapshot), STATUS_OK);
+	CHECK_EQ(snapshot.direction[3], GPIO_DIR_OUT);
+
+	moved.close();
+	CHECK_EQ(moved.is_open(), false);
+
+	return 0;
+}
+
+int test_sequence() {
+	if (!use_sim) {
+		// counts the reports of the simulator
+		return 0;
+	}
+
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	// GPn_FUNC_GPIO for every port
+	setting.enable_gpio_config = 1;
+
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+
+	// GP0 toggles every 2ms, the other changes fall on the same instants
+	GPIOStep steps[14];
+
+	memset(steps, 0, sizeof(steps));
+
+	for (int i = 0 ; i < 10 ; i++) {
+		steps[i].time_us    = 2000 * i;
+		steps[i].value_mask = 0x1;
+		steps[i].values     = i % 2;
+	}
+	steps[10].time_us        = 0;
+	steps[10].direction_mask = 0xF;
+	steps[10].directions     = 0x0;
+	steps[11].time_us    = 4000;
+	steps[11].value_mask = 0x2;
+	steps[11].values     = 0x2;
+	// same pin and instant : the last step wins
+	steps[12].time_us    = 18000;
+	steps[12].value_mask = 0x4;
+	steps[12].values     = 0x4;
+	steps[13].time_us    = 18000;
+	steps[13].value_mask = 0x4;
+	steps[13].values     = 0x0;
+
+	GPIOSequence *sequence;
+	GPIOSequenceStats stats;
+	int64_t error_us[10];
+
+	CHECK_EQ(mcp2221_sequence_compile(&sequence, steps, 14), STATUS_OK);
+	CHECK_EQ(mcp2221_sequence_length(sequence), 10);
+
+	uint64_t count = sim.command_count;
+
+	CHECK_EQ(mcp2221_sequence_play(&handle, sequence, &stats, error_us), STATUS_OK);
+	CHECK_EQ(sim.command_count, count + 10);
+	CHECK_EQ(stats.reports, 10);
+	CHECK_EQ(stats.errors, 0);
+	CHECK_EQ(stats.error_min_us >= 0, 1);
+	CHECK_EQ(error_us[0] >= 0, 1);
+	// the last report is never early
+	CHECK_EQ((int64_t)stats.duration_us + error_us[0] >= 18000, 1);
+
+	CHECK_EQ(sim.gp_value[0], 1);
+	CHECK_EQ(sim.gp_value[1], 1);
+	CHECK_EQ(sim.gp_value[2], 0);
+	CHECK_EQ(sim.gp_direction[3], GPIO_DIR_OUT);
+
+	mcp2221_sequence_free(sequence);
+
+	CHECK_EQ(mcp2221_sequence_compile(&sequence, steps, 0), STATUS_ARGUMENT_ERROR);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_interrupt() {
+	if (!use_sim) {
+		// needs edges on GP1
+		return 0;
+	}
+
+	MCP2221Handle handle;
+	int latched;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	setting.enable_gpio_config    = 1;
+	setting.gpn_func[1]           = GP1_FUNC_INT;
+	setting.gpn_gpio_direction[1] = GPIO_DIR_IN;
+
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+	CHECK_EQ(mcp2221_set_interrupt_edge(&handle, INTERRUPT_EDGE_RISING), STATUS_OK);
+	CHECK_EQ(mcp2221_set_interrupt_edge(&handle, 4), STATUS_ARGUMENT_ERROR);
+
+	CHECK_EQ(mcp2221_get_interrupt(&handle, &latched), STATUS_OK);
+	CHECK_EQ(latched, 0);
+
+	mcp2221_sim_set_input(&sim, 1, GPIO_VALUE_H);
+	CHECK_EQ(mcp2221_get_interrupt(&handle, &latched), STATUS_OK);
+	CHECK_EQ(latched, 1);
+	CHECK_EQ(mcp2221_clear_interrupt(&handle), STATUS_OK);
+
+	// the falling edge is not selected
+	mcp2221_sim_set_input(&sim, 1, GPIO_VALUE_L);
+	CHECK_EQ(mcp2221_get_interrupt(&handle, &latched), STATUS_OK);
+	CHECK_EQ(latched, 0);
+
+	mcp2221_sim_set_input(&sim, 1, GPIO_VALUE_H);
+	mcp2221_sim_set_input(&sim, 1, GPIO_VALUE_L);
+	mcp2221_sim_set_input(&sim, 1, GPIO_VALUE_H);
+
+	// the edges merge into one event, the wait clears it
+	CHECK_EQ(mcp2221_wait_interrupt(&handle, 100, 1000), STATUS_OK);
+	CHECK_EQ(sim.int_flag, 0);
+	CHECK_EQ(mcp2221_wait_interrupt(&handle, 5, 1000), STATUS_TIMEOUT);
+
+	CHECK_EQ(mcp2221_set_interrupt_edge(&handle, INTERRUPT_EDGE_FALLING), STATUS_OK);
+	mcp2221_sim_set_input(&sim, 1, GPIO_VALUE_L);
+	CHECK_EQ(mcp2221_wait_interrupt(&handle, 100, 1000), STATUS_OK);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+static std::atomic<int> poller_port(-1);
+static std::atomic<int> poller_value(-1);
+
+static void poller_callback(int port, GPIOValue value, GPIODirection direction, void *user) {
+	poller_port.store(port);
+	poller_value.store(value);
+}
+
+// wait for a condition checked by the poller thread
+template <typename Predicate>
+static int test_wait_for(Predicate predicate, int timeout_ms) {
+	for (int i = 0 ; i < timeout_ms ; i++) {
+		if (predicate()) {
+			return 1;
+		}
+		usleep(1000);
+	}
+
+	return predicate();
+}
+
+int test_gpio_poller() {
+	MCP2221Handle handle;
+	GPIOPoller *poller;
+	GPIOPollerStats stats;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	setting.enable_gpio_config = 1;
+
+	setting.gpn_func[0] = GP0_FUNC_GPIO;
+	setting.gpn_func[1] = GP1_FUNC_ADC1;
+	setting.gpn_func[2] = GP2_FUNC_ADC2;
+	setting.gpn_func[3] = GP3_FUNC_GPIO;
+
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+
+	CHECK_EQ(mcp2221_gpio_poller_start(&poller, &handle, 0x1, 2000, 1000, poller_callback, NULL), STATUS_ARGUMENT_ERROR);
+	CHECK_EQ(mcp2221_gpio_poller_start(&poller, &handle, 0x1, 1000, 16000, poller_callback, NULL), STATUS_OK);
+
+	// backs off while nothing changes
+	CHECK_EQ(test_wait_for([poller, &stats] {
+		mcp2221_gpio_poller_get_stats(poller, &stats);
+		return stats.interval_us == 16000;
+	}, 1000), 1);
+	CHECK_EQ(stats.changes, 0);
+
+	// GP3 is not watched
+	CHECK_EQ(mcp2221_set_gpio_value(&handle, 3, GPIO_VALUE_H), STATUS_OK);
+	CHECK_EQ(mcp2221_set_gpio_value(&handle, 0, GPIO_VALUE_H), STATUS_OK);
+
+	CHECK_EQ(test_wait_for([] { return poller_port.load() >= 0; }, 1000), 1);
+	CHECK_EQ(poller_port.load(), 0);
+	CHECK_EQ(poller_value.load(), GPIO_VALUE_H);
+
+	GPIOSnapshot snapshot;
+	CHECK_EQ(mcp2221_gpio_poller_get_state(poller, &snapshot), STATUS_OK);
+	CHECK_EQ(snapshot.value[3], GPIO_VALUE_H);
+
+	mcp2221_gpio_poller_get_stats(poller, &stats);
+	CHECK_EQ(stats.changes, 1);
+	CHECK_EQ(stats.errors, 0);
+
+	CHECK_EQ(mcp2221_gpio_poller_stop(poller), STATUS_OK);
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_flash_setting() {
+	if (!use_sim) {
+		// keep the flash of real hardware as it is
+		return 0;
+	}
+
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	FlashSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	CHECK_EQ(mcp2221_read_flash_setting(&handle, &setting), STATUS_OK);
+	CHECK_EQ(setting.vid, 0x04D8);
+	CHECK_EQ(setting.pid, 0x00DD);
+
+	setting.enable_chip_setting = 1;
+	setting.adc_reference       = ADC_REF_2048MV;
+	setting.enable_gp_setting   = 1;
+	setting.gpn_func[0]           = GP0_FUNC_GPIO;
+	setting.gpn_gpio_direction[0] = GPIO_DIR_OUT;
+	setting.gpn_gpio_value[0]     = GPIO_VALUE_H;
+	setting.gpn_func[2]           = GP2_FUNC_ADC2;
+
+	CHECK_EQ(mcp2221_write_flash_setting(&handle, &setting), STATUS_OK);
+	CHECK_EQ(sim.flash_write_count, 2);
+
+	// identical : read back only
+	CHECK_EQ(mcp2221_write_flash_setting(&handle, &setting), STATUS_OK);
+	CHECK_EQ(sim.flash_write_count, 2);
+
+	// the fields not handled by FlashSetting are kept
+	CHECK_EQ(sim.flash_chip[4], 0xD8);
+	CHECK_EQ(sim.flash_chip[8], 0x80);
+
+	// the board comes up configured, without any SRAM write
+	mcp2221_sim_power_cycle(&sim);
+
+	GPIOSnapshot snapshot;
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+	CHECK_EQ(snapshot.direction[0], GPIO_DIR_OUT);
+	CHECK_EQ(snapshot.value[0], GPIO_VALUE_H);
+	CHECK_EQ(snapshot.direction[2], GPIO_DIR_MAX);
+
+	SRAMSetting sram;
+	memset(&sram, 0, sizeof(sram));
+	CHECK_EQ(mcp2221_read_sram_setting(&handle, &sram), STATUS_OK);
+	CHECK_EQ(sram.gpn_func[2], GP2_FUNC_ADC2);
+
+	ADCReference reference;
+	CHECK_EQ(mcp2221_get_adc_reference(&handle, &reference), STATUS_OK);
+	CHECK_EQ(reference, ADC_REF_2048MV);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_gpio_coalesce() {
+	if (!use_sim) {
+		// counts the reports of the simulator
+		return 0;
+	}
+
+	MCP2221Handle handle;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	SRAMSetting setting;
+
+	memset(&setting, 0, sizeof(setting));
+
+	setting.enable_gpio_config = 1;
+
+	setting.gpn_func[0] = GP0_FUNC_GPIO;
+	setting.gpn_func[1] = GP1_FUNC_ADC1;
+	setting.gpn_func[2] = GP2_FUNC_GPIO;
+	setting.gpn_func[3] = GP3_FUNC_GPIO;
+
+	CHECK_EQ(mcp2221_write_sram_setting(&handle, &setting), STATUS_OK);
+
+	// long enough not to expire during the test
+	CHECK_EQ(mcp2221_set_gpio_coalesce(&handle, 10000000), STATUS_OK);
+
+	GPIOSetting gpio[4];
+	int status[4];
+	int next_us;
+
+	uint64_t count = sim.command_count;
+
+	memset(gpio, 0, sizeof(gpio));
+	gpio[0].enable_value = 1;
+	gpio[0].value        = GPIO_VALUE_H;
+	gpio[3].enable_direction = 1;
+	gpio[3].direction        = GPIO_DIR_OUT;
+	CHECK_EQ(mcp2221_queue_gpio_output(&handle, gpio, &status[0]), STATUS_OK);
+
+	memset(gpio, 0, sizeof(gpio));
+	gpio[1].enable_value = 1;
+	gpio[1].value        = GPIO_VALUE_H;
+	CHECK_EQ(mcp2221_queue_gpio_output(&handle, gpio, &status[1]), STATUS_OK);
+
+	// last writer wins
+	memset(gpio, 0, sizeof(gpio));
+	gpio[0].enable_value = 1;
+	gpio[0].value        = GPIO_VALUE_L;
+	gpio[2].enable_value = 1;
+	gpio[2].value        = GPIO_VALUE_H;
+	CHECK_EQ(mcp2221_queue_gpio_output(&handle, gpio, &status[2]), STATUS_OK);
+
+	CHECK_EQ(status[0], STATUS_PENDING);
+	CHECK_EQ(sim.command_count, count);
+
+	CHECK_EQ(mcp2221_poll_gpio(&handle, &next_us), STATUS_OK);
+	CHECK_EQ(next_us > 0, 1);
+
+	// GP1 is not GPIO, only its writer fails
+	CHECK_EQ(mcp2221_flush_gpio(&handle), STATUS_IO_ERROR);
+	CHECK_EQ(sim.command_count, count + 1);
+	CHECK_EQ(status[0], STATUS_OK);
+	CHECK_EQ(status[1], STATUS_IO_ERROR);
+	CHECK_EQ(status[2], STATUS_OK);
+
+	CHECK_EQ(mcp2221_poll_gpio(&handle, &next_us), STATUS_OK);
+	CHECK_EQ(next_us, -1);
+
+	// the legacy setters are sent at once with the queued writes, with the result of their own field
+	memset(gpio, 0, sizeof(gpio));
+	gpio[3].enable_value = 1;
+	gpio[3].value        = GPIO_VALUE_H;
+	CHECK_EQ(mcp2221_queue_gpio_output(&handle, gpio, &status[0]), STATUS_OK);
+	CHECK_EQ(mcp2221_set_gpio_value(&handle, 1, GPIO_VALUE_H), STATUS_IO_ERROR);
+	CHECK_EQ(sim.command_count, count + 2);
+	CHECK_EQ(status[0], STATUS_OK);
+	CHECK_EQ(mcp2221_set_gpio_value(&handle, 2, GPIO_VALUE_H), STATUS_OK);
+	CHECK_EQ(sim.command_count, count + 3);
+
+	// a read sends the queued writes first
+	memset(gpio, 0, sizeof(gpio));
+	gpio[2].enable_value = 1;
+	gpio[2].value        = GPIO_VALUE_L;
+	CHECK_EQ(mcp2221_queue_gpio_output(&handle, gpio, &status[0]), STATUS_OK);
+
+	GPIOSnapshot snapshot;
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+	CHECK_EQ(sim.command_count, count + 5);
+	CHECK_EQ(status[0], STATUS_OK);
+	CHECK_EQ(snapshot.value[0], GPIO_VALUE_L);
+	CHECK_EQ(snapshot.value[2], GPIO_VALUE_L);
+	CHECK_EQ(snapshot.value[3], GPIO_VALUE_H);
+	CHECK_EQ(snapshot.direction[3], GPIO_DIR_OUT);
+
+	// an expired window is sent by the timer of the handle, without any other call
+	CHECK_EQ(mcp2221_set_gpio_coalesce(&handle, 1000), STATUS_OK);
+	CHECK_EQ(mcp2221_queue_gpio_output(&handle, gpio, &status[0]), STATUS_OK);
+
+	for (int i = 0 ; i < 10000 && __atomic_load_n(&status[0], __ATOMIC_ACQUIRE) == STATUS_PENDING ; i++) {
+		usleep(100);
+	}
+	CHECK_EQ(__atomic_load_n(&status[0], __ATOMIC_ACQUIRE), STATUS_OK);
+	CHECK_EQ(mcp2221_poll_gpio(&handle, &next_us), STATUS_OK);
+	CHECK_EQ(next_us, -1);
+	CHECK_EQ(sim.command_count, count + 6);
+
+	// the result is stored by the thread which flushes, it is complete once a flush of this thread returned
+	CHECK_EQ(mcp2221_set_gpio_coalesce(&handle, 10000000), STATUS_OK);
+	CHECK_EQ(mcp2221_queue_gpio_output(&handle, gpio, &status[0]), STATUS_OK);
+	CHECK_EQ(__atomic_load_n(&status[0], __ATOMIC_ACQUIRE), STATUS_PENDING);
+
+	std::thread other([&handle] {
+		mcp2221_flush_gpio(&handle);
+	});
+	int flushed = mcp2221_flush_gpio(&handle);
+	int result  = __atomic_load_n(&status[0], __ATOMIC_ACQUIRE);
+	other.join();
+
+	CHECK_EQ(flushed, STATUS_OK);
+	CHECK_EQ(result, STATUS_OK);
+
+	// batches flushed by two threads reach the device in queue order :
+	// GP0, GP2 and GP3 count the writes, the writer flushes after every second one
+	// so a sent value is 1 or 2 ahead of the previous one, unless an older batch lands last
+	const int writes = 2000;
+	static MCP2221TraceRecord records[4 * writes];	// a send and a recv per write at most
+	int recorded;
+	int errors = 0;
+	std::atomic<int> done(0);
+
+	CHECK_EQ(mcp2221_set_gpio_coalesce(&handle, 10000000), STATUS_OK);
+	CHECK_EQ(mcp2221_trace_start(4 * writes), STATUS_OK);
+
+	std::thread flusher([&handle, &done] {
+		while (!done.load()) {
+			mcp2221_flush_gpio(&handle);
+		}
+	});
+
+	for (int i = 1 ; i <= writes ; i++) {
+		const int ports[3] = { 0, 2, 3 };
+
+		memset(gpio, 0, sizeof(gpio));
+		for (int j = 0 ; j < 3 ; j++) {
+			gpio[ports[j]].enable_value = 1;
+			gpio[ports[j]].value        = (GPIOValue)((i >> j) & 1);
+		}
+		errors += mcp2221_queue_gpio_output(&handle, gpio, NULL) != STATUS_OK;
+
+		if (i % 2 == 0) {
+			errors += mcp2221_flush_gpio(&handle) != STATUS_OK;
+		}
+	}
+
+	done.store(1);
+	flusher.join();
+	CHECK_EQ(errors, 0);
+
+	mcp2221_trace_stop();
+	CHECK_EQ(mcp2221_trace_read(records, 4 * writes, &recorded), STATUS_OK);
+	CHECK_EQ((int)mcp2221_trace_overwritten(), 0);
+	mcp2221_trace_free();
+
+	int previous  = 0;
+	int reordered = 0;
+
+	for (int i = 0 ; i < recorded ; i++) {
+		const uint8_t *cmd = records[i].data;
+
+		if (records[i].direction != MCP2221_TRACE_SEND || cmd[0] != 0x50) {
+			continue;
+		}
+
+		int value = cmd[3 + 4 * 0] | (cmd[3 + 4 * 2] << 1) | (cmd[3 + 4 * 3] << 2);
+		int ahead = (value - previous + 8) % 8;
+
+		reordered += ahead < 1 || 2 < ahead;
+		previous = value;
+	}
+	CHECK_EQ(reordered, 0);
+	CHECK_EQ(previous, writes % 8);
+	CHECK_EQ(sim.gp_value[0], writes & 1);
+
+	CHECK_EQ(mcp2221_set_gpio_coalesce(&handle, 0), STATUS_OK);
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+// reports sent back to back are answered one per frame
+int test_sim_frames() {
+	if (!use_sim) {
+		return 0;
+	}
+
+	MCP2221Transport transport;
+	MCP2221SimConfig config;
+	uint8_t cmd[64];
+	uint8_t buf[64];
+
+	memset(&config, 0, sizeof(config));
+	config.frame_us = 1000;
+
+	CHECK_EQ(mcp2221_sim_init(&sim, &config), STATUS_OK);
+	mcp2221_sim_get_transport(&sim, &transport);
+	CHECK_EQ(transport.open(transport.context), STATUS_OK);
+
+	mcp2221_command_get_gpio_input(cmd);
+
+	for (int i = 0 ; i < 4 ; i++) {
+		CHECK_EQ(transport.send(transport.context, cmd, 64), STATUS_OK);
+	}
+	for (int i = 1 ; i < 4 ; i++) {
+		CHECK_EQ(sim.response_time_us[i] - sim.response_time_us[i - 1], 1000);
+	}
+
+	for (int i = 0 ; i < 4 ; i++) {
+		CHECK_EQ(transport.recv(transport.context, buf, 64, 100), STATUS_OK);
+		CHECK_EQ(buf[0], 0x51);
+	}
+
+	// a command after the last response takes the next frame
+	CHECK_EQ(transport.send(transport.context, cmd, 64), STATUS_OK);
+	CHECK_EQ(sim.response_time_us[4] - sim.response_time_us[3] >= 1000, 1);
+
+	return 0;
+}
+
+int test_timeout() {
+	if (!use_sim) {
+		return 0;
+	}
+
+	MCP2221Handle handle;
+	MCP2221Transport transport;
+	MCP2221SimConfig config;
+	GPIOSnapshot snapshot;
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 20000;
+
+	CHECK_EQ(mcp2221_sim_init(&sim, &config), STATUS_OK);
+	mcp2221_sim_get_transport(&sim, &transport);
+	CHECK_EQ(mcp2221_init_with_transport(&handle, &transport), STATUS_OK);
+
+	CHECK_EQ(mcp2221_set_timeout(&handle, 0), STATUS_ARGUMENT_ERROR);
+	CHECK_EQ(mcp2221_set_timeout(&handle, 5), STATUS_OK);
+
+	auto start = std::chrono::steady_clock::now();
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_RECV_TIMEOUT);
+	CHECK_EQ(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(15), true);
+
+	// the budget of the caller cuts the handle timeout short
+	CHECK_EQ(mcp2221_set_timeout(&handle, 1000), STATUS_OK);
+
+	{
+		mcp2221::Budget budget(5000);
+
+		start = std::chrono::steady_clock::now();
+		CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_RECV_TIMEOUT);
+		CHECK_EQ(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(15), true);
+	}
+	CHECK_EQ(mcp2221_budget_remaining_us(), -1);
+
+	// an exhausted budget : nothing is sent
+	uint64_t count = sim.command_count;
+	{
+		mcp2221::Budget budget(0);
+
+		CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_SEND_TIMEOUT);
+		CHECK_EQ(mcp2221_budget_remaining_us(), 0);
+	}
+	CHECK_EQ(sim.command_count, count);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	// lost responses of idempotent commands are retried
+	memset(&config, 0, sizeof(config));
+	config.drop_every = 2;
+
+	CHECK_EQ(mcp2221_sim_init(&sim, &config), STATUS_OK);
+	mcp2221_sim_get_transport(&sim, &transport);
+	CHECK_EQ(mcp2221_init_with_transport(&handle, &transport), STATUS_OK);
+	CHECK_EQ(mcp2221_set_timeout(&handle, 5), STATUS_OK);
+
+	int failed = 0;
+	for (int i = 0 ; i < 4 ; i++) {
+		failed += mcp2221_get_gpio_snapshot(&handle, &snapshot) != STATUS_OK;
+	}
+	CHECK_EQ(failed > 0, 1);
+
+	CHECK_EQ(mcp2221_set_retry(&handle, -1, 0, 0), STATUS_ARGUMENT_ERROR);
+	CHECK_EQ(mcp2221_set_retry(&handle, 2, 100, 1000), STATUS_OK);
+
+	for (int i = 0 ; i < 10 ; i++) {
+		CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+	}
+	CHECK_EQ(sim.dropped_count > 0, 1);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+// the inputs read by the next 0x51 carry the index of the next request
+static void test_correlation_mark(MCP2221Request *request, void *user) {
+	int next = (int)(intptr_t)user + 1;
+
+	for (int i = 0 ; i < 4 ; i++) {
+		sim.gp_input[i] = (next >> i) & 1;
+	}
+}
+
+int test_correlation() {
+	if (!use_sim) {
+		return 0;
+	}
+
+	MCP2221Handle handle;
+	MCP2221Transport transport;
+	MCP2221SimConfig config;
+	MCP2221ResponseStats stats;
+	SRAMSetting setting;
+	GPIOSnapshot snapshot;
+
+	memset(&config, 0, sizeof(config));
+	config.latency_us = 20000;
+
+	CHECK_EQ(mcp2221_sim_init(&sim, &config), STATUS_OK);
+	mcp2221_sim_get_transport(&sim, &transport);
+	CHECK_EQ(mcp2221_init_with_transport(&handle, &transport), STATUS_OK);
+	CHECK_EQ(mcp2221_set_timeout(&handle, 5), STATUS_OK);
+
+	// the late response is drained before the next command
+	CHECK_EQ(mcp2221_read_sram_setting(&handle, &setting), STATUS_RECV_TIMEOUT);
+	usleep(30000);
+	sim.config.latency_us = 0;
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+
+	mcp2221_get_response_stats(&handle, &stats);
+	CHECK_EQ(stats.recv_timeouts, 1);
+	CHECK_EQ(stats.discarded, 1);
+	CHECK_EQ(stats.mismatched, 0);
+
+	// the late response arrives while the next command waits
+	sim.config.latency_us = 20000;
+	CHECK_EQ(mcp2221_read_sram_setting(&handle, &setting), STATUS_RECV_TIMEOUT);
+	sim.config.latency_us = 40000;
+	CHECK_EQ(mcp2221_set_timeout(&handle, 100), STATUS_OK);
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+
+	mcp2221_get_response_stats(&handle, &stats);
+	CHECK_EQ(stats.recv_timeouts, 2);
+	CHECK_EQ(stats.discarded, 1);
+	CHECK_EQ(stats.mismatched, 1);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	// a lost response in the pipeline fails only its own command
+	MCP2221Request requests[8];
+
+	memset(&config, 0, sizeof(config));
+	config.drop_every = 4;
+
+	CHECK_EQ(mcp2221_sim_init(&sim, &config), STATUS_OK);
+	mcp2221_sim_get_transport(&sim, &transport);
+	CHECK_EQ(mcp2221_init_with_transport(&handle, &transport), STATUS_OK);
+	CHECK_EQ(mcp2221_set_timeout(&handle, 5), STATUS_OK);
+	CHECK_EQ(mcp2221_async_start(&handle, 2), STATUS_OK);
+
+	uint64_t dropped = sim.dropped_count;
+
+	for (int i = 0 ; i < 8 ; i++) {
+		memset(&requests[i], 0, sizeof(requests[i]));
+		requests[i].cmd[0] = i % 2 == 0 ? 0x51 : 0x10;
+
+		CHECK_EQ(mcp2221_async_submit(&handle, &requests[i]), STATUS_OK);
+	}
+
+	int timeouts = 0;
+	for (int i = 0 ; i < 8 ; i++) {
+		int ret = mcp2221_async_wait(&handle, &requests[i], 1000);
+
+		if (ret == STATUS_RECV_TIMEOUT) {
+			timeouts++;
+		} else {
+			CHECK_EQ(ret, STATUS_OK);
+			CHECK_EQ(requests[i].resp[0], requests[i].cmd[0]);
+		}
+	}
+	CHECK_EQ(timeouts, (int)(sim.dropped_count - dropped));
+	CHECK_EQ(timeouts > 0, 1);
+
+	CHECK_EQ(mcp2221_async_stop(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	// commands with the same code are sent one at a time : a lost response fails its own command,
+	// the next ones still get their own responses
+	config.drop_every = 3;
+
+	CHECK_EQ(mcp2221_sim_init(&sim, &config), STATUS_OK);
+	mcp2221_sim_get_transport(&sim, &transport);
+	CHECK_EQ(mcp2221_init_with_transport(&handle, &transport), STATUS_OK);
+	CHECK_EQ(mcp2221_set_timeout(&handle, 5), STATUS_OK);
+
+	for (int i = 0 ; i < 4 ; i++) {
+		sim.gp_func[i]      = 0;
+		sim.gp_direction[i] = GPIO_DIR_IN;
+		sim.gp_input[i]     = 0;
+	}
+
+	CHECK_EQ(mcp2221_async_start(&handle, 4), STATUS_OK);
+
+	dropped = sim.dropped_count;
+
+	for (int i = 0 ; i < 8 ; i++) {
+		memset(&requests[i], 0, sizeof(requests[i]));
+		requests[i].cmd[0]   = 0x51;
+		requests[i].callback = test_correlation_mark;
+		requests[i].user     = (void *)(intptr_t)i;
+
+		CHECK_EQ(mcp2221_async_submit(&handle, &requests[i]), STATUS_OK);
+	}
+
+	timeouts = 0;
+	for (int i = 0 ; i < 8 ; i++) {
+		int ret = mcp2221_async_wait(&handle, &requests[i], 1000);
+
+		if (ret == STATUS_RECV_TIMEOUT) {
+			timeouts++;
+			continue;
+		}
+
+		CHECK_EQ(ret, STATUS_OK);
+		CHECK_EQ(requests[i].resp[0], 0x51);
+
+		int index = 0;
+		for (int k = 0 ; k < 4 ; k++) {
+			index |= requests[i].resp[2 + 2 * k] << k;
+		}
+		CHECK_EQ(index, i);
+	}
+	CHECK_EQ(timeouts, (int)(sim.dropped_count - dropped));
+	CHECK_EQ(timeouts, 2);
+
+	CHECK_EQ(mcp2221_async_stop(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_metrics() {
+	MCP2221Handle handle;
+	GPIOSnapshot snapshot;
+	static MCP2221Metrics before;
+	static MCP2221Metrics after;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+
+	mcp2221_metrics_start();
+	mcp2221_metrics_snapshot(&before);
+
+	// recorded into one shard per thread
+	std::thread threads[2];
+	int errors[2] = { 0, 0 };
+
+	for (int t = 0 ; t < 2 ; t++) {
+		threads[t] = std::thread([&handle, &errors, t] {
+			GPIOSnapshot s;
+
+			for (int i = 0 ; i < 50 ; i++) {
+				errors[t] += mcp2221_get_gpio_snapshot(&handle, &s) != STATUS_OK;
+			}
+		});
+	}
+	for (int t = 0 ; t < 2 ; t++) {
+		threads[t].join();
+	}
+	CHECK_EQ(errors[0] + errors[1], 0);
+
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+
+	mcp2221_metrics_snapshot(&after);
+	mcp2221_metrics_stop();
+
+	const MCP2221OpcodeMetrics *b = &before.opcode[0x51];
+	const MCP2221OpcodeMetrics *a = &after.opcode[0x51];
+
+	CHECK_EQ(a->commands - b->commands, 101);
+	CHECK_EQ(a->sent_reports - b->sent_reports, 101);
+	CHECK_EQ(a->sent_bytes - b->sent_bytes, 101 * 64);
+	CHECK_EQ(a->recv_reports - b->recv_reports, 101);
+	CHECK_EQ(a->errors - b->errors, 0);
+
+	uint64_t bucketed = 0;
+	for (int i = 0 ; i < MCP2221_METRICS_BUCKETS ; i++) {
+		bucketed += a->latency_bucket[i] - b->latency_bucket[i];
+	}
+	CHECK_EQ(bucketed, 101);
+
+	double p50 = mcp2221_metrics_quantile_us(a, 0.5);
+	double p99 = mcp2221_metrics_quantile_us(a, 0.99);
+	CHECK_EQ(p50 > 0 && p50 <= p99, true);
+
+	// stopped : nothing is recorded
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_OK);
+	mcp2221_metrics_snapshot(&before);
+	CHECK_EQ(before.opcode[0x51].commands, a->commands);
+
+	char text[65536];
+	FILE *fp = fmemopen(text, sizeof(text), "w");
+
+	CHECK_EQ(mcp2221_metrics_write_prometheus(fp, &after), STATUS_OK);
+	fclose(fp);
+
+	CHECK_EQ(strstr(text, "# TYPE mcp2221_command_latency_seconds histogram") != NULL, true);
+	CHECK_EQ(strstr(text, "mcp2221_commands_total{opcode=\"0x51\",command=\"GET_GPIO_VALUES\"}") != NULL, true);
+	CHECK_EQ(strstr(text, "mcp2221_command_latency_seconds_bucket{opcode=\"0x51\",command=\"GET_GPIO_VALUES\",le=\"+Inf\"}") != NULL, true);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_daemon() {
+	if (!use_sim) {
+		return 0;
+	}
+
+	MCP2221Handle handle;
+	MCP2221Daemon *daemon;
+	DaemonStats stats;
+
+	CHECK_EQ(test_init(&handle), STATUS_OK);
+	CHECK_EQ(mcp2221_set_gpio_directions(&handle, GPIO_PORT_MASK_ALL, 0), STATUS_OK);
+
+	// the window is long enough for the four writes below to share one batch
+	CHECK_EQ(mcp2221_daemon_start(&daemon, &handle, "/tmp/mcp2221_test.sock", 200000), STATUS_OK);
+
+	// a running daemon is not taken over
+	MCP2221Daemon *second;
+	CHECK_EQ(mcp2221_daemon_start(&second, &handle, "/tmp/mcp2221_test.sock", 0), STATUS_IO_ERROR);
+	CHECK_EQ(access("/tmp/mcp2221_test.sock", F_OK), 0);
+
+	// the mode does not depend on the umask
+	struct stat st;
+	CHECK_EQ(stat("/tmp/mcp2221_test.sock", &st), 0);
+	CHECK_EQ(st.st_mode & 0777, MCP2221_DAEMON_SOCKET_MODE);
+
+	// every request is sent before any response is waited for
+	MCP2221Client writers[4];
+	for (int i = 0 ; i < 4 ; i++) {
+		CHECK_EQ(mcp2221_client_connect(&writers[i], "/tmp/mcp2221_test.sock"), STATUS_OK);
+	}
+	for (int i = 0 ; i < 4 ; i++) {
+		DaemonRequest request;
+
+		memset(&request, 0, sizeof(request));
+		request.op         = DAEMON_OP_SET_GPIO;
+		request.value_mask = GPIO_PORT_MASK(i);
+		request.values     = GPIO_PORT_MASK(i);
+
+		CHECK_EQ(send(writers[i].fd, &request, sizeof(request), MSG_NOSIGNAL), (ssize_t)sizeof(request));
+	}
+	for (int i = 0 ; i < 4 ; i++) {
+		DaemonResponse response;
+
+		CHECK_EQ(recv(writers[i].fd, &response, sizeof(response), 0), (ssize_t)sizeof(response));
+		CHECK_EQ(response.status, STATUS_OK);
+		CHECK_EQ(mcp2221_client_close(&writers[i]), STATUS_OK);
+	}
+
+	// the four writes went out as one report
+	mcp2221_daemon_get_stats(daemon, &stats);
+	CHECK_EQ(stats.requests, 4);
+	CHECK_EQ(stats.reports, 1);
+	CHECK_EQ(stats.coalesced, 3);
+
+	MCP2221Client client;
+	GPIOSnapshot snapshot;
+
+	CHECK_EQ(mcp2221_client_connect(&client, "/tmp/mcp2221_test.sock"), STATUS_OK);
+
+	// every write reached the device
+	CHECK_EQ(mcp2221_client_get_gpio(&client, &snapshot, 0), STATUS_OK);
+	for (int i = 0 ; i < 4 ; i++) {
+		CHECK_EQ(snapshot.value[i], GPIO_VALUE_H);
+	}
+
+	// conflicting writes of one client are applied in order, the device ends with the last one
+	CHECK_EQ(mcp2221_client_set_gpio(&client, GPIO_PORT_MASK(0) | GPIO_PORT_MASK(1), 0, 0, 0), STATUS_OK);
+	CHECK_EQ(mcp2221_client_set_gpio(&client, GPIO_PORT_MASK(0), GPIO_PORT_MASK(0), 0, 0), STATUS_OK);
+	CHECK_EQ(mcp2221_client_set_gpio(&client, GPIO_PORT_MASK(0), 0, 0, 0), STATUS_OK);
+	CHECK_EQ(sim.gp_value[0], 0);
+	CHECK_EQ(sim.gp_value[1], 0);
+	CHECK_EQ(sim.gp_value[2], 1);
+
+	// a fresh read, then one from the snapshot
+	CHECK_EQ(mcp2221_client_get_gpio(&client, &snapshot, 1000000), STATUS_OK);
+	CHECK_EQ(snapshot.value[0], GPIO_VALUE_L);
+	mcp2221_daemon_get_stats(daemon, &stats);
+	uint64_t hits = stats.snapshot_hits;
+	CHECK_EQ(mcp2221_client_get_gpio(&client, &snapshot, 1000000), STATUS_OK);
+	CHECK_EQ(snapshot.value[0], GPIO_VALUE_L);
+	mcp2221_daemon_get_stats(daemon, &stats);
+	CHECK_EQ(stats.snapshot_hits, hits + 1);
+
+	uint8_t cmd[64];
+	uint8_t buf[64];
+	mcp2221_command_get_sram_setting(cmd);
+	CHECK_EQ(mcp2221_client_issue_command(&client, cmd, buf), STATUS_OK);
+	CHECK_EQ(buf[0], 0x61);
+
+	CHECK_EQ(mcp2221_client_close(&client), STATUS_OK);
+	CHECK_EQ(mcp2221_daemon_stop(daemon), STATUS_OK);
+	CHECK_EQ(access("/tmp/mcp2221_test.sock", F_OK) != 0, 1);
+
+	// the socket file of a daemon which died is reused
+	int stale = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, "/tmp/mcp2221_test.sock");
+	CHECK_EQ(bind(stale, (struct sockaddr *)&addr, sizeof(addr)), 0);
+	close(stale);
+
+	CHECK_EQ(mcp2221_daemon_start(&daemon, &handle, "/tmp/mcp2221_test.sock", 0), STATUS_OK);
+	CHECK_EQ(mcp2221_client_connect(&client, "/tmp/mcp2221_test.sock"), STATUS_OK);
+	CHECK_EQ(mcp2221_daemon_stop(daemon), STATUS_OK);
+
+	// a failed call leaves the buffer of the caller alone
+	memset(buf, 0xAA, sizeof(buf));
+	CHECK_EQ(mcp2221_client_issue_command(&client, cmd, buf), STATUS_IO_ERROR);
+	CHECK_EQ(buf[0], 0xAA);
+	CHECK_EQ(buf[63], 0xAA);
+	CHECK_EQ(mcp2221_client_close(&client), STATUS_OK);
+
+	// the default socket lives in a directory only its owner can write
+	char path[108];
+	char saved[256];
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (runtime_dir != NULL) {
+		snprintf(saved, sizeof(saved), "%s", runtime_dir);
+	}
+
+	setenv("XDG_RUNTIME_DIR", "/run/user/1000", 1);
+	CHECK_EQ(mcp2221_daemon_default_socket(path, sizeof(path)), STATUS_OK);
+	CHECK_EQ(strcmp(path, "/run/user/1000/mcp2221.sock"), 0);
+	CHECK_EQ(mcp2221_daemon_default_socket(path, 8), STATUS_ARGUMENT_ERROR);
+
+	unsetenv("XDG_RUNTIME_DIR");
+	CHECK_EQ(mcp2221_daemon_default_socket(path, sizeof(path)), STATUS_OK);
+	CHECK_EQ(strcmp(path, MCP2221_DAEMON_SOCKET), 0);
+
+	if (runtime_dir != NULL) {
+		setenv("XDG_RUNTIME_DIR", saved, 1);
+	}
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int test_enumerate() {
+	MCP2221DeviceInfo devices[16];
+	int count;
+
+	CHECK_EQ(mcp2221_enumerate(devices, 16, &count), STATUS_OK);
+
+	// a failed open must not release the hid library of the other handles
+	MCP2221Handle missing;
+	CHECK_EQ(mcp2221_init_by_serial(&missing, "no-such-serial"), STATUS_IO_ERROR);
+	CHECK_EQ(mcp2221_init_by_serial(&missing, ""), STATUS_ARGUMENT_ERROR);
+
+	for (int i = 0 ; i < count ; i++) {
+		MCP2221Handle handle;
+
+		CHECK_EQ(mcp2221_init_by_path(&handle, devices[i].path), STATUS_OK);
+		CHECK_EQ(mcp2221_is_connected(&handle), 1);
+		CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+	}
+
+	if (use_sim) {
+		// no serial number to find the device again
+		MCP2221Handle handle;
+
+		CHECK_EQ(test_init(&handle), STATUS_OK);
+		CHECK_EQ(mcp2221_set_auto_reopen(&handle, 1), STATUS_ARGUMENT_ERROR);
+		CHECK_EQ(mcp2221_is_connected(&handle), 1);
+		CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+	}
+
+	return 0;
+}
+
+// the simulator behind a node which can't be opened for a while after its arrival
+struct TestHotplugTransport {
+	MCP2221Transport sim;
+	int opens;
+	int failing_opens;
+};
+
+static int test_hotplug_open(void *context) {
+	TestHotplugTransport *t = (TestHotplugTransport *)context;
+
+	t->opens++;
+	if (t->failing_opens > 0) {
+		t->failing_opens--;
+		return STATUS_IO_ERROR;
+	}
+
+	return t->sim.open(t->sim.context);
+}
+
+static int test_hotplug_close(void *context) {
+	TestHotplugTransport *t = (TestHotplugTransport *)context;
+
+	return t->sim.close(t->sim.context);
+}
+
+static int test_hotplug_send(void *context, const uint8_t *data, int length) {
+	TestHotplugTransport *t = (TestHotplugTransport *)context;
+
+	return t->sim.send(t->sim.context, data, length);
+}
+
+static int test_hotplug_recv(void *context, uint8_t *data, int length, int timeout_ms) {
+	TestHotplugTransport *t = (TestHotplugTransport *)context;
+
+	return t->sim.recv(t->sim.context, data, length, timeout_ms);
+}
+
+// removal and arrival posted without udev
+int test_hotplug() {
+	if (!use_sim) {
+		return 0;
+	}
+
+	MCP2221Handle handle;
+	MCP2221Transport transport;
+	TestHotplugTransport t;
+	SRAMSetting setting;
+	GPIOSnapshot snapshot;
+
+	CHECK_EQ(mcp2221_sim_init(&sim, NULL), STATUS_OK);
+	mcp2221_sim_get_transport(&sim, &t.sim);
+	t.opens         = 0;
+	t.failing_opens = 0;
+
+	transport.context = &t;
+	transport.open    = test_hotplug_open;
+	transport.close   = test_hotplug_close;
+	transport.send    = test_hotplug_send;
+	transport.recv    = test_hotplug_recv;
+
+	CHECK_EQ(mcp2221_init_with_transport(&handle, &transport), STATUS_OK);
+	CHECK_EQ(mcp2221_hotplug_attach(&handle), STATUS_OK);
+
+	// only the hidapi backend sends the report in place, the others go through transport.send
+	CHECK_EQ(handle.send_report == NULL, true);
+	CHECK_EQ(mcp2221_read_sram_setting(&handle, &setting), STATUS_OK);
+	CHECK_EQ(handle.setting_valid, 1);
+
+	// removed : the commands fail without reaching the device
+	uint64_t count = sim.command_count;
+
+	mcp2221_hotplug_post(&handle, HOTPLUG_EVENT_REMOVED, NULL);
+	CHECK_EQ(mcp2221_is_connected(&handle), 0);
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_IO_ERROR);
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_IO_ERROR);
+	CHECK_EQ(sim.command_count, count);
+
+	// added, the first two opens fail : retried after a delay, not on every command
+	t.failing_opens = 2;
+	mcp2221_hotplug_post(&handle, HOTPLUG_EVENT_ADDED, NULL);
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_IO_ERROR);
+	CHECK_EQ(t.opens, 2);
+	CHECK_EQ(mcp2221_get_gpio_snapshot(&handle, &snapshot), STATUS_IO_ERROR);
+	CHECK_EQ(t.opens, 2);
+	CHECK_EQ(mcp2221_is_connected(&handle), 0);
+
+	int ret = STATUS_IO_ERROR;
+	for (int i = 0 ; i < 100 && ret != STATUS_OK ; i++) {
+		usleep(10000);
+		ret = mcp2221_get_gpio_snapshot(&handle, &snapshot);
+	}
+	CHECK_EQ(ret, STATUS_OK);
+	CHECK_EQ(t.opens, 4);
+	CHECK_EQ(mcp2221_is_connected(&handle), 1);
+	CHECK_EQ(sim.command_count, count + 1);
+
+	// the device came back with its power-on settings
+	CHECK_EQ(handle.setting_valid, 0);
+
+	CHECK_EQ(mcp2221_destroy(&handle), STATUS_OK);
+
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	int fail = 0;
+
+	if (argc >= 2 && strcmp(argv[1], "--sim") == 0) {
+		use_sim = 1;
+	}
+
+	fail |= test_trace();
+	fail |= test_codec();
+	fail |= test_sram_setting();
+	fail |= test_gpio_direction();
+	fail |= test_gpio_multi();
+	fail |= test_gpio_snapshot();
+	fail |= test_gpio_not_gpio();
+	fail |= test_i2c();
+	fail |= test_i2c_threads();
+	fail |= test_regcache();
+	fail |= test_adc();
+	fail |= test_async();
+	fail |= test_threads();
+	fail |= test_enumerate();
+	fail |= test_hotplug();
+	fail |= test_apply_setting();
+	fail |= test_device();
+	fail |= test_sequence();
+	fail |= test_interrupt();
+	fail |= test_gpio_poller();
+	fail |= test_flash_setting();
+	fail |= test_gpio_coalesce();
+	fail |= test_sim_frames();
+	fail |= test_timeout();
+	fail |= test_correlation();
+	fail |= test_metrics();
+	fail |= test_daemon();
+
+	if (fail) {
+		printf("\ntest failed.\n");
+		return 1;
+	}
 
-	printf("test success.\n");
+	printf("\ntest success.\n");
 }
 